@@ -0,0 +1,145 @@
+#!/bin/sh
+#
+# run-bench.sh -- runs the libusbmuxd benchmarks against mockmuxd
+#
+# Usage: run-bench.sh [TOOLS_DIR [BENCH_PROGRAM]]
+#
+# Every result is printed to stdout as one JSON object per line, progress
+# goes to stderr. The following environment variables tune the runs:
+#
+#   BENCH_ITERATIONS  iterations of the library benchmarks (default 200)
+#   BENCH_SECONDS     duration of each relay benchmark (default 3)
+#   BENCH_MB          size of the file sent through inetcat (default 256)
+#   BENCH_PORT        local TCP port used for iproxy (default 27015)
+#   BENCH_DEVICES     device counts for the library benchmarks
+#                     (default "1 100 1000")
+#
+
+TOOLS=${1:-../tools}
+BENCH=${2:-$TOOLS/libusbmuxd-bench}
+ITERATIONS=${BENCH_ITERATIONS:-200}
+DURATION=${BENCH_SECONDS:-3}
+MB=${BENCH_MB:-256}
+PORT=${BENCH_PORT:-27015}
+DEVICES=${BENCH_DEVICES:-"1 100 1000"}
+
+WORKDIR=`mktemp -d "${TMPDIR:-/tmp}/libusbmuxd-bench.XXXXXX"` || exit 1
+USBMUXD_SOCKET_ADDRESS=UNIX:$WORKDIR/mockmuxd.sock
+export USBMUXD_SOCKET_ADDRESS
+
+MOCK_PID=
+IPROXY_PID=
+FAILED=0
+
+cleanup() {
+	[ -n "$IPROXY_PID" ] && kill $IPROXY_PID 2>/dev/null
+	[ -n "$MOCK_PID" ] && kill $MOCK_PID 2>/dev/null
+	wait 2>/dev/null
+	rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+log() {
+	echo "bench: $*" >&2
+}
+
+run() {
+	"$@" || FAILED=1
+}
+
+start_mock() {
+	"$TOOLS/mockmuxd" -n $1 &
+	MOCK_PID=$!
+	"$BENCH" wait "$WORKDIR/mockmuxd.sock" || exit 1
+}
+
+stop_mock() {
+	kill $MOCK_PID 2>/dev/null
+	wait $MOCK_PID 2>/dev/null
+	MOCK_PID=
+}
+
+# start_iproxy ADDR [OPTIONS] -- returns 1 if iproxy did not come up
+start_iproxy() {
+	ADDR=$1
+	shift
+	"$TOOLS/iproxy" "$@" >/dev/null 2>&1 &
+	IPROXY_PID=$!
+	sleep 1
+	if ! kill -0 $IPROXY_PID 2>/dev/null; then
+		IPROXY_PID=
+		return 1
+	fi
+	"$BENCH" wait "$ADDR"
+}
+
+stop_iproxy() {
+	kill $IPROXY_PID 2>/dev/null
+	wait $IPROXY_PID 2>/dev/null
+	IPROXY_PID=
+}
+
+relay_bench() {
+	run "$BENCH" -L "$1" rr "$2" 64 $DURATION
+	run "$BENCH" -L "$1" rr "$2" 16384 $DURATION
+	run "$BENCH" -L "$1" stream "$2" $DURATION
+	run "$BENCH" -L "$1" rr "$2" 64 $DURATION 4
+}
+
+# Library: message handling, device list, subscribe replay
+for N in $DEVICES; do
+	log "library benchmarks with $N devices"
+	start_mock $N
+	run "$BENCH" -L "devices=$N" xml $ITERATIONS
+	run "$BENCH" -L "devices=$N" device-list $ITERATIONS
+	run "$BENCH" -L "devices=$N" subscribe $N
+	stop_mock
+done
+
+# Connect latency and relays, all against the echo service on port 7
+start_mock 1
+
+log "connect latency"
+run "$BENCH" -L "echo" connect 7 $ITERATIONS
+run "$BENCH" -L "discard" connect 9 $ITERATIONS
+
+log "direct device connection"
+relay_bench "direct" device:7
+
+log "iproxy over TCP"
+if start_iproxy 127.0.0.1:$PORT $PORT:7; then
+	relay_bench "iproxy-tcp" 127.0.0.1:$PORT
+	stop_iproxy
+else
+	FAILED=1
+fi
+
+log "iproxy over a unix domain socket"
+if start_iproxy "$WORKDIR/iproxy.sock" "$WORKDIR/iproxy.sock:7"; then
+	relay_bench "iproxy-unix" "$WORKDIR/iproxy.sock"
+	stop_iproxy
+else
+	FAILED=1
+fi
+
+log "iproxy with io_uring"
+if start_iproxy 127.0.0.1:$PORT -U $PORT:7; then
+	relay_bench "iproxy-io-uring" 127.0.0.1:$PORT
+	stop_iproxy
+else
+	log "iproxy -U not available, skipped"
+fi
+
+log "inetcat transfer modes"
+dd if=/dev/zero of="$WORKDIR/data" bs=1048576 count=$MB 2>/dev/null
+BYTES=`expr $MB \* 1048576`
+run "$BENCH" -L "inetcat-stream" exec $BYTES "$WORKDIR/data" -- "$TOOLS/inetcat" -s 7
+run "$BENCH" -L "inetcat-file" exec $BYTES - -- "$TOOLS/inetcat" -f "$WORKDIR/data" -o /dev/null 7
+for P in 2 4; do
+	run "$BENCH" -L "inetcat-parallel-$P" exec $BYTES - -- "$TOOLS/inetcat" -P $P -f "$WORKDIR/data" -o /dev/null 7
+done
+
+stop_mock
+
+exit $FAILED
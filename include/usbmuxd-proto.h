@@ -90,6 +90,29 @@ struct usbmuxd_device_record {
 	uint32_t location;
 };
 
+/* Capture files written by libusbmuxd_set_capture_file() start with
+ * USBMUXD_CAPTURE_MAGIC, followed by records that each consist of a
+ * usbmuxd_capture_record and length bytes of data: the usbmuxd_header
+ * and payload of the packet as they went over the socket. The fields of
+ * usbmuxd_capture_record and usbmuxd_header are stored in little-endian
+ * byte order, so captures can be replayed on any host. */
+#define USBMUXD_CAPTURE_MAGIC "LMUXCAP1"
+#define USBMUXD_CAPTURE_MAGIC_LEN 8
+
+enum usbmuxd_capture_type {
+	CAPTURE_OPEN = 1,    // new connection to usbmuxd, no data
+	CAPTURE_SEND = 2,    // packet sent to usbmuxd
+	CAPTURE_RECEIVE = 3, // packet received from usbmuxd
+};
+
+struct usbmuxd_capture_record {
+	uint64_t time_us;  // microseconds since the capture was started
+	uint32_t conn;     // connection the packet belongs to
+	uint16_t type;     // enum usbmuxd_capture_type
+	uint16_t reserved; // set to zero
+	uint32_t length;   // length of the data following the record
+};
+
 #pragma pack(pop)
 
 #ifdef __cplusplus
@@ -272,6 +272,12 @@ USBMUXD_API int usbmuxd_recv(int sfd, char *data, uint32_t len, uint32_t *recv_b
 /**
  * Reads the SystemBUID
  *
+ * The BUID does not change while usbmuxd is running, so it is only
+ * requested once per usbmuxd socket address and then answered from a
+ * cache. The cache is cleared when the device monitor (see
+ * usbmuxd_events_subscribe()) loses its connection to usbmuxd, or when
+ * usbmuxd cannot be reached.
+ *
  * @param buid pointer to a variable that will be set to point to a newly
  *     allocated string with the System BUID returned by usbmuxd
  *
@@ -279,6 +285,16 @@ USBMUXD_API int usbmuxd_recv(int sfd, char *data, uint32_t len, uint32_t *recv_b
  */
 USBMUXD_API int usbmuxd_read_buid(char** buid);
 
+/**
+ * Starts reading the SystemBUID in a background thread, so that a later
+ * usbmuxd_read_buid() is answered from the cache, or only waits for the
+ * request that is already in flight.
+ *
+ * @return 0 if the BUID is cached, being read, or the read was started,
+ *     a negative errno value otherwise.
+ */
+USBMUXD_API int usbmuxd_prefetch_buid(void);
+
 /**
  * Read a pairing record
  *
@@ -324,6 +340,211 @@ USBMUXD_API int usbmuxd_save_pair_record_with_device_id(const char* record_id, u
  */
 USBMUXD_API int usbmuxd_delete_pair_record(const char* record_id);
 
+/** One record of usbmuxd_read_pair_records(). */
+typedef struct {
+	const char *record_id; /**< in: identifier of the record to read */
+	char *record_data;     /**< out: newly allocated record data, to be freed by the caller */
+	uint32_t record_size;  /**< out: size of record_data */
+	int result;            /**< out: 0 on success, a negative error value otherwise */
+} usbmuxd_pair_record_read_t;
+
+/** One record of usbmuxd_save_pair_records(). */
+typedef struct {
+	const char *record_id;   /**< in: identifier of the record to save */
+	uint32_t device_id;      /**< in: device identifier of the connected device, or 0 */
+	const char *record_data; /**< in: record data */
+	uint32_t record_size;    /**< in: size of record_data */
+	int result;              /**< out: 0 on success, a negative error value otherwise */
+} usbmuxd_pair_record_save_t;
+
+/**
+ * Read multiple pairing records over a single connection to usbmuxd
+ *
+ * The requests are pipelined instead of waiting for each reply before the
+ * next request is sent. Each record gets its own result.
+ *
+ * @param records array of records to read
+ * @param count number of entries in records
+ *
+ * @return the number of records that were read successfully, or a
+ *     negative errno value if no request could be sent to usbmuxd at all.
+ *     Records that could not be completed get that error as their result.
+ */
+USBMUXD_API int usbmuxd_read_pair_records(usbmuxd_pair_record_read_t *records, unsigned int count);
+
+/**
+ * Save multiple pairing records over a single connection to usbmuxd
+ *
+ * The requests are pipelined instead of waiting for each reply before the
+ * next request is sent. Each record gets its own result. Records are
+ * checked like in usbmuxd_save_pair_record(), so a record without
+ * record_id or record_data or with a record_size of 0 fails with -EINVAL.
+ *
+ * @param records array of records to save
+ * @param count number of entries in records
+ *
+ * @return the number of records that were saved successfully, or a
+ *     negative errno value if no request could be sent to usbmuxd at all.
+ *     Records that could not be completed get that error as their result.
+ */
+USBMUXD_API int usbmuxd_save_pair_records(usbmuxd_pair_record_save_t *records, unsigned int count);
+
+/** Version of the libusbmuxd_stats_t structure defined by this header. */
+#define LIBUSBMUXD_STATS_VERSION 2
+
+/** Number of buckets of the latency histograms in libusbmuxd_op_stats_t. */
+#define LIBUSBMUXD_STATS_LATENCY_BUCKETS 16
+
+/** Operations that are accounted for separately in libusbmuxd_stats_t. */
+enum libusbmuxd_stats_op {
+	LIBUSBMUXD_OP_CONNECT = 0,         /**< usbmuxd_connect() */
+	LIBUSBMUXD_OP_GET_DEVICE_LIST,     /**< usbmuxd_get_device_list(), also used by usbmuxd_get_device() */
+	LIBUSBMUXD_OP_READ_BUID,           /**< usbmuxd_read_buid() */
+	LIBUSBMUXD_OP_READ_PAIR_RECORD,    /**< usbmuxd_read_pair_record() */
+	LIBUSBMUXD_OP_SAVE_PAIR_RECORD,    /**< usbmuxd_save_pair_record() and usbmuxd_save_pair_record_with_device_id() */
+	LIBUSBMUXD_OP_DELETE_PAIR_RECORD,  /**< usbmuxd_delete_pair_record() */
+	LIBUSBMUXD_NUM_OPS
+};
+
+/**
+ * Statistics of one operation type.
+ * Bucket i of latency_hist counts the calls that took less than
+ * (100 << i) microseconds but at least as long as the bound of bucket i-1.
+ * The last bucket counts all calls that took longer.
+ */
+typedef struct {
+	uint64_t count;      /**< number of calls */
+	uint64_t errors;     /**< number of calls that returned an error */
+	uint64_t time_us;    /**< total time spent in the calls, in microseconds */
+	uint64_t latency_hist[LIBUSBMUXD_STATS_LATENCY_BUCKETS];
+} libusbmuxd_op_stats_t;
+
+/**
+ * Runtime statistics of libusbmuxd, see libusbmuxd_get_stats().
+ * All counters are totals since the library was loaded or since the last
+ * call to libusbmuxd_reset_stats().
+ */
+typedef struct {
+	uint32_t version;            /**< set to LIBUSBMUXD_STATS_VERSION by the caller */
+	uint32_t reserved;
+	libusbmuxd_op_stats_t ops[LIBUSBMUXD_NUM_OPS]; /**< indexed by enum libusbmuxd_stats_op */
+	uint64_t sockets_opened;     /**< control connections to usbmuxd that were established */
+	uint64_t socket_errors;      /**< failed attempts to connect to usbmuxd */
+	uint64_t retries;            /**< requests repeated with the binary protocol or a Listen after RESULT_BADVERSION or an unsupported ListDevices */
+	uint64_t packets_sent;       /**< packets sent on control connections */
+	uint64_t packets_received;   /**< packets received on control connections */
+	uint64_t bytes_sent;         /**< bytes sent on control connections, including headers */
+	uint64_t bytes_received;     /**< bytes received on control connections, including headers */
+	uint64_t monitor_connects;   /**< times the device monitor (re)established its connection to usbmuxd */
+	uint64_t events;             /**< device events delivered to subscribers */
+	/* version 2 */
+	uint64_t pair_record_cache_hits;   /**< usbmuxd_read_pair_record() calls answered from the cache */
+	uint64_t pair_record_cache_misses; /**< usbmuxd_read_pair_record() calls that had to ask usbmuxd while the cache was enabled */
+	uint64_t buid_cache_hits;          /**< usbmuxd_read_buid() calls answered from the cache */
+	uint64_t buid_cache_misses;        /**< usbmuxd_read_buid() calls that had to ask usbmuxd */
+} libusbmuxd_stats_t;
+
+/**
+ * Retrieves the runtime statistics of the library.
+ * The counters are updated with relaxed atomic operations, so the snapshot
+ * is not taken atomically as a whole while other threads use the library.
+ *
+ * @param stats Pointer to a libusbmuxd_stats_t whose version member has
+ *     been set to LIBUSBMUXD_STATS_VERSION. It will be filled with the
+ *     current counters. Fields added after the version given by the
+ *     caller are not written.
+ *
+ * @return 0 on success, or -EINVAL if stats is NULL or the version is not
+ *     supported by the library.
+ */
+USBMUXD_API int libusbmuxd_get_stats(libusbmuxd_stats_t *stats);
+
+/**
+ * Resets all statistics counters of the library to 0.
+ * Operations in progress while this is called might not be accounted for
+ * consistently.
+ */
+USBMUXD_API void libusbmuxd_reset_stats(void);
+
+/** Points in the control path at which trace records are emitted. */
+enum libusbmuxd_trace_point {
+	LIBUSBMUXD_TRACE_SOCKET_CONNECT = 1, /**< a connection to usbmuxd was opened */
+	LIBUSBMUXD_TRACE_SEND_PACKET,        /**< a request was encoded and sent */
+	LIBUSBMUXD_TRACE_RECEIVE_PACKET,     /**< a packet was received and decoded */
+	LIBUSBMUXD_TRACE_GET_RESULT,         /**< the reply to a request was received */
+	LIBUSBMUXD_TRACE_EVENT               /**< a device event was delivered to the subscribers */
+};
+
+/**
+ * Trace record passed to the trace callback.
+ * Timestamps are in microseconds of a monotonic clock.
+ */
+typedef struct {
+	enum libusbmuxd_trace_point point;
+	uint64_t start_us;  /**< when the operation started */
+	uint64_t end_us;    /**< when the operation ended */
+	uint64_t wait_us;   /**< RECEIVE_PACKET: time spent waiting for the packet header */
+	uint64_t xml_us;    /**< SEND_PACKET, RECEIVE_PACKET: time spent encoding or decoding the XML plist */
+	uint32_t tag;       /**< tag of the packet or request */
+	uint32_t message;   /**< message type of the packet; for EVENT the event type */
+	uint32_t size;      /**< size of the packet including the header */
+	uint32_t device_id; /**< EVENT: handle of the device */
+	int32_t result;     /**< SOCKET_CONNECT: socket or negative errno; SEND_PACKET, RECEIVE_PACKET: bytes transferred or negative error;
+	                         GET_RESULT: result code sent by usbmuxd or negative error */
+} libusbmuxd_trace_t;
+
+/**
+ * Trace callback prototype. It is called synchronously from the thread
+ * doing the operation, including the device monitor thread, so it should
+ * return quickly.
+ */
+typedef void (*libusbmuxd_trace_cb_t)(const libusbmuxd_trace_t *trace, void *user_data);
+
+/**
+ * Sets a callback that receives a trace record for every operation on the
+ * connections to usbmuxd, or removes it if callback is NULL. The callback
+ * should be set before other threads start using the library.
+ *
+ * @param callback Function to call, or NULL.
+ * @param user_data Custom data passed on to the callback function.
+ */
+USBMUXD_API void libusbmuxd_set_trace_callback(libusbmuxd_trace_cb_t callback, void *user_data);
+
+/**
+ * Enables caching of pair records read with usbmuxd_read_pair_record(), or
+ * disables the cache and drops all cached records if ttl is 0, which is
+ * the default. A cached record is dropped when it is older than ttl
+ * seconds, when it is saved or deleted through this library, and when the
+ * device monitor reports a UE_DEVICE_PAIRED or UE_DEVICE_REMOVE event for
+ * the device with the same UDID. The events are only seen while there is
+ * an event subscription (see usbmuxd_events_subscribe()), so without one,
+ * changes made by other processes go unnoticed until the ttl expires.
+ * Hits and misses are counted in libusbmuxd_stats_t.
+ *
+ * @param ttl Maximum age of a cached record in seconds, or 0 to disable
+ *     the cache.
+ */
+USBMUXD_API void libusbmuxd_set_pair_record_cache(unsigned int ttl);
+
+/**
+ * Starts recording the traffic on all control connections to usbmuxd to
+ * a capture file, or stops recording if path is NULL. Every packet sent
+ * or received is written with its header, payload and a timestamp, in the
+ * format described in usbmuxd-proto.h. Data of device connections made
+ * with usbmuxd_connect() is not recorded. A capture can be played back
+ * with mockmuxd --replay.
+ *
+ * Recording can also be enabled by setting the environment variable
+ * LIBUSBMUXD_CAPTURE to the path of the capture file before the first
+ * connection to usbmuxd is made.
+ *
+ * @param path Path of the capture file, which is overwritten, or NULL.
+ *
+ * @return 0 on success or a negative errno value if the file could not
+ *     be created.
+ */
+USBMUXD_API int libusbmuxd_set_capture_file(const char *path);
+
 /**
  * Enable or disable the use of inotify extension. Enabled by default.
  * Use 0 to disable and 1 to enable inotify support.
@@ -332,8 +553,36 @@ USBMUXD_API int usbmuxd_delete_pair_record(const char* record_id);
  */
 USBMUXD_API void libusbmuxd_set_use_inotify(int set);
 
+/**
+ * Sets the debug level. Messages with a level above it are discarded
+ * without being formatted. Errors have level 0 and are reported by default.
+ *
+ * @param level The debug level, 0 by default.
+ */
 USBMUXD_API void libusbmuxd_set_debug_level(int level);
 
+/**
+ * Log callback prototype.
+ *
+ * @param level The level of the message, 0 for errors.
+ * @param message The message, without a trailing newline. It is only
+ *     valid during the call.
+ * @param user_data The user_data passed to libusbmuxd_set_log_callback().
+ */
+typedef void (*libusbmuxd_log_cb_t)(int level, const char *message, void *user_data);
+
+/**
+ * Sends the messages of the library to a callback instead of printing
+ * them to stderr, or restores printing to stderr if callback is NULL.
+ * Only messages up to the level set with libusbmuxd_set_debug_level() are
+ * passed on. The callback can be called from any thread using the library,
+ * including the device monitor thread, and should return quickly.
+ *
+ * @param callback Function to call, or NULL.
+ * @param user_data Custom data passed on to the callback function.
+ */
+USBMUXD_API void libusbmuxd_set_log_callback(libusbmuxd_log_cb_t callback, void *user_data);
+
 /**
  * Returns a static string of the libusbmuxd version.
  *
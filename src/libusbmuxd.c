@@ -25,6 +25,7 @@
 #endif
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
@@ -58,6 +59,7 @@
 #else
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #if defined(HAVE_PROGRAM_INVOCATION_SHORT_NAME) && !defined(HAVE_PROGRAM_INVOCATION_SHORT_NAME_ERRNO_H)
@@ -118,9 +120,141 @@ static int libusbmuxd_debug = 0;
 #ifndef PACKAGE_NAME
 #define PACKAGE_NAME PACKAGE
 #endif
-#define LIBUSBMUXD_DEBUG(level, format, ...) if (level <= libusbmuxd_debug) fprintf(stderr, ("[" PACKAGE "] " format), __VA_ARGS__); fflush(stderr);
+/* Disabled levels only cost the comparison, the message is not formatted. */
+#define LIBUSBMUXD_DEBUG(level, format, ...) do { if (level <= libusbmuxd_debug) log_message(level, format, __VA_ARGS__); } while (0)
 #define LIBUSBMUXD_ERROR(format, ...) LIBUSBMUXD_DEBUG(0, format, __VA_ARGS__)
 
+#define LOG_PREFIX "[" PACKAGE "] "
+#define LOG_PREFIX_LEN (sizeof(LOG_PREFIX)-1)
+
+static libusbmuxd_log_cb_t log_cb = NULL;
+static void *log_user_data = NULL;
+
+#ifdef __GNUC__
+__attribute__((format(printf, 2, 3)))
+#endif
+static void log_message(int level, const char *format, ...)
+{
+	libusbmuxd_log_cb_t callback = log_cb;
+	char buf[1024];
+	char *msg = buf;
+	va_list args;
+	int len;
+
+	memcpy(buf, LOG_PREFIX, LOG_PREFIX_LEN);
+	va_start(args, format);
+	len = vsnprintf(buf + LOG_PREFIX_LEN, sizeof(buf) - LOG_PREFIX_LEN, format, args);
+	va_end(args);
+	if (len < 0) {
+		return;
+	}
+	len += LOG_PREFIX_LEN;
+	if ((size_t)len >= sizeof(buf)) {
+		/* long messages such as plist dumps */
+		msg = (char*)malloc(len + 1);
+		if (!msg) {
+			msg = buf;
+			len = sizeof(buf) - 1;
+		} else {
+			memcpy(msg, buf, LOG_PREFIX_LEN);
+			va_start(args, format);
+			vsnprintf(msg + LOG_PREFIX_LEN, len + 1 - LOG_PREFIX_LEN, format, args);
+			va_end(args);
+		}
+	}
+
+	if (callback) {
+		/* the callback gets the message without prefix and trailing newline */
+		char *text = msg + LOG_PREFIX_LEN;
+		if (len > 0 && msg[len-1] == '\n') {
+			msg[len-1] = '\0';
+		}
+		callback(level, text, log_user_data);
+	} else {
+		/* stderr is unbuffered, so this is a single write */
+		fputs(msg, stderr);
+	}
+	if (msg != buf) {
+		free(msg);
+	}
+}
+
+/* The statistics counters are only modified with relaxed atomic adds so
+ * accounting never needs a lock; resetting them uses atomic stores. */
+#if defined(__GNUC__) || defined(__clang__)
+#define STAT_ADD(x, v) __atomic_fetch_add(&(x), (v), __ATOMIC_RELAXED)
+#define STAT_GET(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STAT_SET(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#elif defined(_WIN32)
+#define STAT_ADD(x, v) InterlockedExchangeAdd64((volatile LONG64*)&(x), (LONG64)(v))
+#define STAT_GET(x) InterlockedCompareExchange64((volatile LONG64*)&(x), 0, 0)
+#define STAT_SET(x, v) InterlockedExchange64((volatile LONG64*)&(x), (LONG64)(v))
+#else
+#define STAT_ADD(x, v) ((x) += (v))
+#define STAT_GET(x) (x)
+#define STAT_SET(x, v) ((x) = (v))
+#endif
+
+static libusbmuxd_stats_t stats;
+
+static libusbmuxd_trace_cb_t trace_cb = NULL;
+static void *trace_user_data = NULL;
+
+/* With USDT probes built in, trace records are always filled in so the
+ * probes get their arguments; otherwise only if a callback is set. */
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+#define TRACE_ENABLED 1
+#define TRACE_PROBE(name, t) STAP_PROBEV(libusbmuxd, name, (t)->start_us, (t)->end_us, (t)->wait_us, (t)->xml_us, (t)->tag, (t)->message, (t)->size, (t)->device_id, (t)->result)
+#else
+#define TRACE_ENABLED (trace_cb != NULL)
+#define TRACE_PROBE(name, t)
+#endif
+#define TRACE_NOW() (TRACE_ENABLED ? get_time_us() : 0)
+#define TRACE_EMIT(name, t) do { (t)->end_us = get_time_us(); TRACE_PROBE(name, t); trace_call(t); } while (0)
+
+/* capture_file and capture_start are protected by capture_mutex; the
+ * pointer is also checked without it to skip recording quickly. */
+static FILE *volatile capture_file = NULL;
+static uint64_t capture_start = 0;
+static mutex_t capture_mutex;
+static thread_once_t capture_init_once = THREAD_ONCE_INIT;
+
+/* maximum number of pair record requests in flight on one connection */
+#define PAIR_RECORD_BATCH_WINDOW 16
+
+struct pair_record_cache_entry {
+	char *record_id;
+	char *data;
+	uint32_t size;
+	uint64_t expires_us;
+};
+
+/* The pair record cache is protected by pair_record_cache_mutex.
+ * pair_record_cache_generation is increased whenever records are dropped,
+ * so a record read from usbmuxd is not stored if it was invalidated while
+ * the request was in flight. */
+static struct collection pair_record_cache;
+static mutex_t pair_record_cache_mutex;
+static thread_once_t pair_record_cache_once = THREAD_ONCE_INIT;
+static volatile unsigned int pair_record_cache_ttl = 0;
+static uint32_t pair_record_cache_generation = 0;
+
+struct buid_cache_entry {
+	char *endpoint;
+	char *buid;
+	int pending; /* number of reads in flight for this endpoint */
+};
+
+/* The BUID cache holds one entry per usbmuxd socket address and is
+ * protected by buid_cache_mutex. Entries are never freed, only their BUID,
+ * so they stay valid while waiting on buid_cache_cond. */
+static struct collection buid_cache;
+static mutex_t buid_cache_mutex;
+static cond_t buid_cache_cond;
+static thread_once_t buid_cache_once = THREAD_ONCE_INIT;
+static uint32_t buid_cache_generation = 0;
+
 static struct collection devices;
 static THREAD_T devmon = THREAD_T_NULL;
 static int listenfd = -1;
@@ -156,12 +290,270 @@ static usbmuxd_device_info_t *devices_find(uint32_t handle)
 	return NULL;
 }
 
+static uint64_t get_time_us(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000 + (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static void trace_init(libusbmuxd_trace_t *trace, enum libusbmuxd_trace_point point, uint64_t started)
+{
+	memset(trace, 0, sizeof(libusbmuxd_trace_t));
+	trace->point = point;
+	trace->start_us = started;
+}
+
+static void trace_call(const libusbmuxd_trace_t *trace)
+{
+	libusbmuxd_trace_cb_t callback = trace_cb;
+	if (callback) {
+		callback(trace, trace_user_data);
+	}
+}
+
+static int capture_open(const char *path)
+{
+	FILE *f = NULL;
+	int res = 0;
+
+	if (path) {
+		f = fopen(path, "wb");
+		if (!f || fwrite(USBMUXD_CAPTURE_MAGIC, 1, USBMUXD_CAPTURE_MAGIC_LEN, f) != USBMUXD_CAPTURE_MAGIC_LEN) {
+			res = -errno;
+			LIBUSBMUXD_ERROR("ERROR: Could not create capture file %s: %s\n", path, strerror(errno));
+			if (f) {
+				fclose(f);
+			}
+			return (res < 0) ? res : -EIO;
+		}
+		fflush(f);
+	}
+	mutex_lock(&capture_mutex);
+	if (capture_file) {
+		fclose(capture_file);
+	}
+	capture_start = get_time_us();
+	capture_file = f;
+	mutex_unlock(&capture_mutex);
+
+	return res;
+}
+
+static void capture_init(void)
+{
+	const char *path = getenv("LIBUSBMUXD_CAPTURE");
+	mutex_init(&capture_mutex);
+	if (path && *path) {
+		capture_open(path);
+	}
+}
+
+/** Stores the lowest size bytes of val at buf in little-endian order. */
+static void capture_put_le(unsigned char *buf, uint64_t val, int size)
+{
+	int i;
+	for (i = 0; i < size; i++) {
+		buf[i] = (unsigned char)(val >> (i * 8));
+	}
+}
+
+/**
+ * Appends a record to the capture file if recording is enabled. For
+ * packets, header and payload are written as they went over the socket,
+ * with the record and the header in little-endian byte order.
+ */
+static void capture_packet(int sfd, enum usbmuxd_capture_type type, const struct usbmuxd_header *header, const void *payload, uint32_t payload_size)
+{
+	unsigned char rec[sizeof(struct usbmuxd_capture_record)];
+	unsigned char hdr[sizeof(struct usbmuxd_header)];
+
+	if (!capture_file) {
+		return;
+	}
+	capture_put_le(rec + 8, (uint32_t)sfd, 4);
+	capture_put_le(rec + 12, (uint16_t)type, 2);
+	capture_put_le(rec + 14, 0, 2);
+	capture_put_le(rec + 16, (header) ? sizeof(struct usbmuxd_header) + payload_size : 0, 4);
+	if (header) {
+		capture_put_le(hdr, header->length, 4);
+		capture_put_le(hdr + 4, header->version, 4);
+		capture_put_le(hdr + 8, header->message, 4);
+		capture_put_le(hdr + 12, header->tag, 4);
+	}
+
+	mutex_lock(&capture_mutex);
+	if (capture_file) {
+		capture_put_le(rec, get_time_us() - capture_start, 8);
+		fwrite(rec, sizeof(rec), 1, capture_file);
+		if (header) {
+			fwrite(hdr, sizeof(hdr), 1, capture_file);
+			if (payload_size > 0) {
+				fwrite(payload, 1, payload_size, capture_file);
+			}
+		}
+		fflush(capture_file);
+	}
+	mutex_unlock(&capture_mutex);
+}
+
+static void pair_record_cache_init(void)
+{
+	mutex_init(&pair_record_cache_mutex);
+	collection_init(&pair_record_cache);
+}
+
+static void pair_record_cache_entry_free(struct pair_record_cache_entry *entry)
+{
+	free(entry->record_id);
+	free(entry->data);
+	free(entry);
+}
+
+/**
+ * Drops the cached record with the given id, or all records if record_id
+ * is NULL.
+ */
+static void pair_record_cache_invalidate(const char *record_id)
+{
+	thread_once(&pair_record_cache_once, pair_record_cache_init);
+	mutex_lock(&pair_record_cache_mutex);
+	pair_record_cache_generation++;
+	FOREACH(struct pair_record_cache_entry *entry, &pair_record_cache) {
+		if (!record_id || strcmp(entry->record_id, record_id) == 0) {
+			collection_remove(&pair_record_cache, entry);
+			pair_record_cache_entry_free(entry);
+		}
+	} ENDFOREACH
+	mutex_unlock(&pair_record_cache_mutex);
+}
+
+/**
+ * Looks up a record in the cache and returns a copy of it.
+ *
+ * @return 0 on a hit, -ENOENT otherwise. On a miss, generation is set to
+ *     the value to pass to pair_record_cache_store().
+ */
+static int pair_record_cache_lookup(const char *record_id, char **record_data, uint32_t *record_size, uint32_t *generation)
+{
+	uint64_t now = get_time_us();
+	int res = -ENOENT;
+
+	thread_once(&pair_record_cache_once, pair_record_cache_init);
+	mutex_lock(&pair_record_cache_mutex);
+	FOREACH(struct pair_record_cache_entry *entry, &pair_record_cache) {
+		if (strcmp(entry->record_id, record_id) == 0) {
+			if (now >= entry->expires_us) {
+				collection_remove(&pair_record_cache, entry);
+				pair_record_cache_entry_free(entry);
+			} else {
+				*record_data = (char*)malloc(entry->size);
+				if (*record_data) {
+					memcpy(*record_data, entry->data, entry->size);
+					*record_size = entry->size;
+					res = 0;
+				}
+			}
+			break;
+		}
+	} ENDFOREACH
+	*generation = pair_record_cache_generation;
+	mutex_unlock(&pair_record_cache_mutex);
+
+	if (res == 0) {
+		STAT_ADD(stats.pair_record_cache_hits, 1);
+	} else {
+		STAT_ADD(stats.pair_record_cache_misses, 1);
+	}
+	return res;
+}
+
+static void pair_record_cache_store(const char *record_id, const char *record_data, uint32_t record_size, uint32_t generation)
+{
+	struct pair_record_cache_entry *entry = (struct pair_record_cache_entry*)malloc(sizeof(struct pair_record_cache_entry));
+	unsigned int ttl = pair_record_cache_ttl;
+
+	if (!entry) {
+		return;
+	}
+	entry->record_id = strdup(record_id);
+	entry->data = (char*)malloc(record_size);
+	entry->size = record_size;
+	entry->expires_us = get_time_us() + (uint64_t)ttl * 1000000;
+	if (!entry->record_id || !entry->data || ttl == 0) {
+		pair_record_cache_entry_free(entry);
+		return;
+	}
+	memcpy(entry->data, record_data, record_size);
+
+	mutex_lock(&pair_record_cache_mutex);
+	if (generation != pair_record_cache_generation) {
+		mutex_unlock(&pair_record_cache_mutex);
+		pair_record_cache_entry_free(entry);
+		return;
+	}
+	FOREACH(struct pair_record_cache_entry *old, &pair_record_cache) {
+		if (strcmp(old->record_id, record_id) == 0) {
+			collection_remove(&pair_record_cache, old);
+			pair_record_cache_entry_free(old);
+		}
+	} ENDFOREACH
+	collection_add(&pair_record_cache, entry);
+	mutex_unlock(&pair_record_cache_mutex);
+}
+
+static void buid_cache_init(void)
+{
+	mutex_init(&buid_cache_mutex);
+	cond_init(&buid_cache_cond);
+	collection_init(&buid_cache);
+}
+
+static void buid_cache_invalidate(void)
+{
+	thread_once(&buid_cache_once, buid_cache_init);
+	mutex_lock(&buid_cache_mutex);
+	buid_cache_generation++;
+	FOREACH(struct buid_cache_entry *entry, &buid_cache) {
+		free(entry->buid);
+		entry->buid = NULL;
+	} ENDFOREACH
+	mutex_unlock(&buid_cache_mutex);
+}
+
+/**
+ * Accounts for a finished call of a public operation.
+ */
+static void stats_op_done(enum libusbmuxd_stats_op op, uint64_t started, int failed)
+{
+	libusbmuxd_op_stats_t *opstats = &stats.ops[op];
+	uint64_t elapsed = get_time_us() - started;
+	int i = 0;
+
+	while (i < LIBUSBMUXD_STATS_LATENCY_BUCKETS-1 && elapsed >= (100ULL << i)) {
+		i++;
+	}
+	STAT_ADD(opstats->count, 1);
+	if (failed) {
+		STAT_ADD(opstats->errors, 1);
+	}
+	STAT_ADD(opstats->time_us, elapsed);
+	STAT_ADD(opstats->latency_hist[i], 1);
+}
+
 /**
  * Creates a socket connection to usbmuxd.
  * For Mac/Linux it is a unix domain socket,
  * for Windows it is a tcp socket.
  */
-static int connect_usbmuxd_socket()
+static int open_usbmuxd_socket()
 {
 	int res = -1;
 	char *usbmuxd_socket_addr = getenv("USBMUXD_SOCKET_ADDRESS");
@@ -229,6 +621,30 @@ static int connect_usbmuxd_socket()
 	return res;
 }
 
+static int connect_usbmuxd_socket()
+{
+	uint64_t started = TRACE_NOW();
+	int res;
+
+	thread_once(&capture_init_once, capture_init);
+	res = open_usbmuxd_socket();
+	if (res < 0) {
+		STAT_ADD(stats.socket_errors, 1);
+		/* a usbmuxd started later might have a different BUID */
+		buid_cache_invalidate();
+	} else {
+		STAT_ADD(stats.sockets_opened, 1);
+		capture_packet(res, CAPTURE_OPEN, NULL, NULL, 0);
+	}
+	if (TRACE_ENABLED) {
+		libusbmuxd_trace_t trace;
+		trace_init(&trace, LIBUSBMUXD_TRACE_SOCKET_CONNECT, started);
+		trace.result = res;
+		TRACE_EMIT(socket_connect, &trace);
+	}
+	return res;
+}
+
 static void sanitize_udid(usbmuxd_device_info_t *devinfo)
 {
 	if (!devinfo)
@@ -338,17 +754,18 @@ static usbmuxd_device_info_t *device_info_from_device_record(struct usbmuxd_devi
 	return devinfo;
 }
 
-static int receive_packet(int sfd, struct usbmuxd_header *header, void **payload, int timeout)
+/**
+ * Receives a packet and returns its payload as it was sent by usbmuxd.
+ *
+ * @return The length of the packet, or a negative errno value.
+ */
+static int read_raw_packet(int sfd, struct usbmuxd_header *header, char **payload, int timeout, libusbmuxd_trace_t *trace)
 {
 	int recv_len;
 	struct usbmuxd_header hdr;
 	char *payload_loc = NULL;
 
-	header->length = 0;
-	header->version = 0;
-	header->message = 0;
-	header->tag = 0;
-
+	*payload = NULL;
 	recv_len = socket_receive_timeout(sfd, &hdr, sizeof(hdr), 0, timeout);
 	if (recv_len < 0) {
 		if (!cancelling) {
@@ -361,6 +778,13 @@ static int receive_packet(int sfd, struct usbmuxd_header *header, void **payload
 		LIBUSBMUXD_DEBUG(1, "%s: Received packet is too small, got %d bytes!\n", __func__, recv_len);
 		return recv_len;
 	}
+	STAT_ADD(stats.bytes_received, recv_len);
+	if (trace) {
+		trace->wait_us = get_time_us() - trace->start_us;
+		trace->tag = hdr.tag;
+		trace->message = hdr.message;
+		trace->size = hdr.length;
+	}
 
 	uint32_t payload_size = hdr.length - sizeof(hdr);
 	if (payload_size > 0) {
@@ -373,18 +797,48 @@ static int receive_packet(int sfd, struct usbmuxd_header *header, void **payload
 			}
 			rsize += res;
 		} while (rsize < payload_size);
+		STAT_ADD(stats.bytes_received, rsize);
 		if (rsize != payload_size) {
 			LIBUSBMUXD_DEBUG(1, "%s: Error receiving payload of size %d (bytes received: %d)\n", __func__, payload_size, rsize);
 			free(payload_loc);
 			return -EBADMSG;
 		}
 	}
+	STAT_ADD(stats.packets_received, 1);
+	capture_packet(sfd, CAPTURE_RECEIVE, &hdr, payload_loc, payload_size);
+
+	memcpy(header, &hdr, sizeof(hdr));
+	*payload = payload_loc;
+
+	return hdr.length;
+}
+
+static int read_packet(int sfd, struct usbmuxd_header *header, void **payload, int timeout, libusbmuxd_trace_t *trace)
+{
+	int recv_len;
+	struct usbmuxd_header hdr;
+	char *payload_loc = NULL;
+
+	header->length = 0;
+	header->version = 0;
+	header->message = 0;
+	header->tag = 0;
+
+	recv_len = read_raw_packet(sfd, &hdr, &payload_loc, timeout, trace);
+	if (recv_len < (int)sizeof(hdr)) {
+		return recv_len;
+	}
+	uint32_t payload_size = hdr.length - sizeof(hdr);
 
 	if (hdr.message == MESSAGE_PLIST) {
 		char *message = NULL;
 		plist_t plist = NULL;
+		uint64_t decode_start = (trace) ? get_time_us() : 0;
 		plist_from_xml(payload_loc, payload_size, &plist);
 		free(payload_loc);
+		if (trace) {
+			trace->xml_us = get_time_us() - decode_start;
+		}
 
 		if (!plist) {
 			LIBUSBMUXD_DEBUG(1, "%s: Error getting plist from payload!\n", __func__);
@@ -483,10 +937,39 @@ static int receive_packet(int sfd, struct usbmuxd_header *header, void **payload
 	return hdr.length;
 }
 
-/**
- * Retrieves the result code to a previously sent request.
- */
-static int usbmuxd_get_result(int sfd, uint32_t tag, uint32_t *result, void **result_plist)
+static int receive_packet(int sfd, struct usbmuxd_header *header, void **payload, int timeout)
+{
+	libusbmuxd_trace_t trace;
+	int res;
+
+	if (!TRACE_ENABLED) {
+		return read_packet(sfd, header, payload, timeout, NULL);
+	}
+	trace_init(&trace, LIBUSBMUXD_TRACE_RECEIVE_PACKET, get_time_us());
+	res = read_packet(sfd, header, payload, timeout, &trace);
+	trace.result = res;
+	TRACE_EMIT(receive_packet, &trace);
+
+	return res;
+}
+
+static int receive_raw_packet(int sfd, struct usbmuxd_header *header, char **payload, int timeout)
+{
+	libusbmuxd_trace_t trace;
+	int res;
+
+	if (!TRACE_ENABLED) {
+		return read_raw_packet(sfd, header, payload, timeout, NULL);
+	}
+	trace_init(&trace, LIBUSBMUXD_TRACE_RECEIVE_PACKET, get_time_us());
+	res = read_raw_packet(sfd, header, payload, timeout, &trace);
+	trace.result = res;
+	TRACE_EMIT(receive_packet, &trace);
+
+	return res;
+}
+
+static int read_result(int sfd, uint32_t tag, uint32_t *result, void **result_plist)
 {
 	struct usbmuxd_header hdr;
 	int recv_len;
@@ -534,7 +1017,27 @@ static int usbmuxd_get_result(int sfd, uint32_t tag, uint32_t *result, void **re
 	return -EPROTO;
 }
 
-static int send_packet(int sfd, uint32_t message, uint32_t tag, void *payload, uint32_t payload_size)
+/**
+ * Retrieves the result code to a previously sent request.
+ */
+static int usbmuxd_get_result(int sfd, uint32_t tag, uint32_t *result, void **result_plist)
+{
+	libusbmuxd_trace_t trace;
+	int res;
+
+	if (!TRACE_ENABLED) {
+		return read_result(sfd, tag, result, result_plist);
+	}
+	trace_init(&trace, LIBUSBMUXD_TRACE_GET_RESULT, get_time_us());
+	res = read_result(sfd, tag, result, result_plist);
+	trace.tag = tag;
+	trace.result = (res == 1) ? (int32_t)*result : res;
+	TRACE_EMIT(get_result, &trace);
+
+	return res;
+}
+
+static int write_packet(int sfd, uint32_t message, uint32_t tag, void *payload, uint32_t payload_size)
 {
 	struct usbmuxd_header header;
 
@@ -547,6 +1050,9 @@ static int send_packet(int sfd, uint32_t message, uint32_t tag, void *payload, u
 	}
 	int sent = socket_send(sfd, &header, sizeof(header));
 	if (sent != sizeof(header)) {
+		if (sent > 0) {
+			STAT_ADD(stats.bytes_sent, sent);
+		}
 		LIBUSBMUXD_DEBUG(1, "%s: ERROR: could not send packet header\n", __func__);
 		return -1;
 	}
@@ -561,22 +1067,50 @@ static int send_packet(int sfd, uint32_t message, uint32_t tag, void *payload, u
 		} while (ssize < payload_size);
 		sent += ssize;
 	}
+	STAT_ADD(stats.bytes_sent, sent);
 	if (sent != (int)header.length) {
 		LIBUSBMUXD_DEBUG(1, "%s: ERROR: could not send whole packet (sent %d of %d)\n", __func__, sent, header.length);
-		socket_close(sfd);
 		return -1;
 	}
+	STAT_ADD(stats.packets_sent, 1);
+	capture_packet(sfd, CAPTURE_SEND, &header, payload, (payload) ? payload_size : 0);
 	return sent;
 }
 
+/**
+ * Sends a packet and emits its trace record. started is the time the
+ * packet was started to be built and xml_us the time spent encoding it.
+ */
+static int send_packet_timed(int sfd, uint32_t message, uint32_t tag, void *payload, uint32_t payload_size, uint64_t started, uint64_t xml_us)
+{
+	int res = write_packet(sfd, message, tag, payload, payload_size);
+	if (TRACE_ENABLED) {
+		libusbmuxd_trace_t trace;
+		trace_init(&trace, LIBUSBMUXD_TRACE_SEND_PACKET, started);
+		trace.xml_us = xml_us;
+		trace.tag = tag;
+		trace.message = message;
+		trace.size = sizeof(struct usbmuxd_header) + ((payload) ? payload_size : 0);
+		trace.result = res;
+		TRACE_EMIT(send_packet, &trace);
+	}
+	return res;
+}
+
+static int send_packet(int sfd, uint32_t message, uint32_t tag, void *payload, uint32_t payload_size)
+{
+	return send_packet_timed(sfd, message, tag, payload, payload_size, TRACE_NOW(), 0);
+}
+
 static int send_plist_packet(int sfd, uint32_t tag, plist_t message)
 {
 	int res;
 	char *payload = NULL;
 	uint32_t payload_size = 0;
+	uint64_t started = TRACE_NOW();
 
 	plist_to_xml(message, &payload, &payload_size);
-	res = send_packet(sfd, MESSAGE_PLIST, tag, payload, payload_size);
+	res = send_packet_timed(sfd, MESSAGE_PLIST, tag, payload, payload_size, started, TRACE_NOW() - started);
 	free(payload);
 
 	return res;
@@ -815,7 +1349,12 @@ static int send_read_buid_packet(int sfd, uint32_t tag)
 	return res;
 }
 
-static int send_pair_record_packet(int sfd, uint32_t tag, const char* msgtype, const char* pair_record_id, uint32_t device_id, plist_t data)
+/**
+ * Sends a pair record request. The record data is put into the request as
+ * a data node created straight from the caller's buffer, so it is copied
+ * only once before it is serialized.
+ */
+static int send_pair_record_packet(int sfd, uint32_t tag, const char* msgtype, const char* pair_record_id, uint32_t device_id, const char *data, uint32_t data_size)
 {
 	int res = -1;
 
@@ -823,7 +1362,7 @@ static int send_pair_record_packet(int sfd, uint32_t tag, const char* msgtype, c
 	plist_t plist = create_plist_message(msgtype);
 	plist_dict_set_item(plist, "PairRecordID", plist_new_string(pair_record_id));
 	if (data) {
-		plist_dict_set_item(plist, "PairRecordData", plist_copy(data));
+		plist_dict_set_item(plist, "PairRecordData", plist_new_data(data, data_size));
 	}
 	if (device_id > 0) {
 		plist_dict_set_item(plist, "DeviceID", plist_new_uint(device_id));
@@ -848,14 +1387,31 @@ static void generate_event(const usbmuxd_device_info_t *dev, enum usbmuxd_event_
 		return;
 	}
 
+	if (pair_record_cache_ttl && (event == UE_DEVICE_PAIRED || event == UE_DEVICE_REMOVE)) {
+		pair_record_cache_invalidate(dev->udid);
+	}
+
 	ev.event = event;
 	memcpy(&ev.device, dev, sizeof(usbmuxd_device_info_t));
 
+	libusbmuxd_trace_t trace;
+	int tracing = TRACE_ENABLED;
+	if (tracing) {
+		trace_init(&trace, LIBUSBMUXD_TRACE_EVENT, get_time_us());
+		trace.message = event;
+		trace.device_id = dev->handle;
+	}
+
+	STAT_ADD(stats.events, 1);
 	mutex_lock(&listener_mutex);
 	FOREACH(struct usbmuxd_subscription_context* context, &listeners) {
 		context->callback(&ev, context->user_data);
 	} ENDFOREACH
 	mutex_unlock(&listener_mutex);
+
+	if (tracing) {
+		TRACE_EMIT(generate_event, &trace);
+	}
 }
 
 static int usbmuxd_listen_poll()
@@ -1023,6 +1579,7 @@ retry:
 		socket_close(sfd);
 		if ((res == RESULT_BADVERSION) && (proto_version == 1)) {
 			proto_version = 0;
+			STAT_ADD(stats.retries, 1);
 			goto retry;
 		}
 		LIBUSBMUXD_DEBUG(1, "%s: ERROR: did not get OK but %d\n", __func__, res);
@@ -1131,6 +1688,7 @@ static void *device_monitor(void *data)
 		if (listenfd < 0) {
 			continue;
 		}
+		STAT_ADD(stats.monitor_connects, 1);
 
 		while (running) {
 			int res = get_next_event(listenfd);
@@ -1138,6 +1696,13 @@ static void *device_monitor(void *data)
 				break;
 			}
 		}
+		if (running) {
+			/* usbmuxd went away, it might come back with other data */
+			buid_cache_invalidate();
+			if (pair_record_cache_ttl) {
+				pair_record_cache_invalidate(NULL);
+			}
+		}
 
 		mutex_lock(&listener_mutex);
 		if (collection_count(&listeners) == 0) {
@@ -1272,7 +1837,7 @@ int usbmuxd_unsubscribe(void)
 	return res;
 }
 
-int usbmuxd_get_device_list(usbmuxd_device_info_t **device_list)
+static int get_device_list(usbmuxd_device_info_t **device_list)
 {
 	int sfd;
 	int tag;
@@ -1325,6 +1890,7 @@ retry:
 				socket_close(sfd);
 				try_list_devices = 0;
 				plist_free(list);
+				STAT_ADD(stats.retries, 1);
 				goto retry;
 			}
 			plist_free(list);
@@ -1341,6 +1907,7 @@ retry:
 			socket_close(sfd);
 			if ((res == RESULT_BADVERSION) && (proto_version == 1)) {
 				proto_version = 0;
+				STAT_ADD(stats.retries, 1);
 				goto retry;
 			}
 			LIBUSBMUXD_DEBUG(1, "%s: Did not get response to scan request (with result=0)...\n", __func__);
@@ -1413,6 +1980,14 @@ got_device_list:
 	return dev_cnt;
 }
 
+int usbmuxd_get_device_list(usbmuxd_device_info_t **device_list)
+{
+	uint64_t started = get_time_us();
+	int res = get_device_list(device_list);
+	stats_op_done(LIBUSBMUXD_OP_GET_DEVICE_LIST, started, (res < 0));
+	return res;
+}
+
 int usbmuxd_device_list_free(usbmuxd_device_info_t **device_list)
 {
 	if (device_list) {
@@ -1529,7 +2104,7 @@ int usbmuxd_get_device(const char *udid, usbmuxd_device_info_t *device, enum usb
 	return result;
 }
 
-int usbmuxd_connect(const uint32_t handle, const unsigned short port)
+static int connect_device(const uint32_t handle, const unsigned short port)
 {
 	int sfd;
 	int tag;
@@ -1558,6 +2133,7 @@ retry:
 				if ((res == RESULT_BADVERSION) && (proto_version == 1)) {
 					proto_version = 0;
 					socket_close(sfd);
+					STAT_ADD(stats.retries, 1);
 					goto retry;
 				}
 				LIBUSBMUXD_DEBUG(1, "%s: Connect failed, Error code=%d\n", __func__, res);
@@ -1581,6 +2157,14 @@ retry:
 	return -result;
 }
 
+int usbmuxd_connect(const uint32_t handle, const unsigned short port)
+{
+	uint64_t started = get_time_us();
+	int res = connect_device(handle, port);
+	stats_op_done(LIBUSBMUXD_OP_CONNECT, started, (res < 0));
+	return res;
+}
+
 int usbmuxd_disconnect(int sfd)
 {
 	return socket_close(sfd);
@@ -1628,7 +2212,7 @@ int usbmuxd_recv(int sfd, char *data, uint32_t len, uint32_t *recv_bytes)
 	return usbmuxd_recv_timeout(sfd, data, len, recv_bytes, 5000);
 }
 
-int usbmuxd_read_buid(char **buid)
+static int read_buid(char **buid)
 {
 	int sfd;
 	int tag;
@@ -1669,7 +2253,265 @@ int usbmuxd_read_buid(char **buid)
 	return ret;
 }
 
-int usbmuxd_read_pair_record(const char* record_id, char **record_data, uint32_t *record_size)
+static const char *buid_cache_endpoint(void)
+{
+	const char *addr = getenv("USBMUXD_SOCKET_ADDRESS");
+	return (addr) ? addr : "";
+}
+
+/**
+ * Finds or creates the cache entry of an endpoint. Must be called with
+ * buid_cache_mutex held.
+ */
+static struct buid_cache_entry *buid_cache_entry_get(const char *endpoint)
+{
+	struct buid_cache_entry *entry;
+
+	FOREACH(struct buid_cache_entry *e, &buid_cache) {
+		if (strcmp(e->endpoint, endpoint) == 0) {
+			return e;
+		}
+	} ENDFOREACH
+	entry = (struct buid_cache_entry*)calloc(1, sizeof(struct buid_cache_entry));
+	if (entry) {
+		entry->endpoint = strdup(endpoint);
+		if (!entry->endpoint) {
+			free(entry);
+			return NULL;
+		}
+		collection_add(&buid_cache, entry);
+	}
+	return entry;
+}
+
+/**
+ * Stores the result of a read started while holding a pending count on
+ * entry and wakes up readers waiting for it.
+ */
+static void buid_cache_finish(struct buid_cache_entry *entry, uint32_t generation, int res, const char *buid)
+{
+	mutex_lock(&buid_cache_mutex);
+	entry->pending--;
+	if (res == 0 && buid && !entry->buid && generation == buid_cache_generation) {
+		entry->buid = strdup(buid);
+	}
+	cond_broadcast(&buid_cache_cond);
+	mutex_unlock(&buid_cache_mutex);
+}
+
+static int cached_read_buid(char **buid)
+{
+	const char *endpoint = buid_cache_endpoint();
+	struct buid_cache_entry *entry;
+	uint32_t generation;
+	int res;
+
+	if (!buid) {
+		return -EINVAL;
+	}
+	*buid = NULL;
+
+	thread_once(&buid_cache_once, buid_cache_init);
+	mutex_lock(&buid_cache_mutex);
+	entry = buid_cache_entry_get(endpoint);
+	if (!entry) {
+		mutex_unlock(&buid_cache_mutex);
+		return read_buid(buid);
+	}
+	/* wait for a read that is already in flight, e.g. a prefetch */
+	while (!entry->buid && entry->pending > 0) {
+		if (cond_wait_timeout(&buid_cache_cond, &buid_cache_mutex, 5000) != 0) {
+			break;
+		}
+	}
+	if (entry->buid) {
+		*buid = strdup(entry->buid);
+		mutex_unlock(&buid_cache_mutex);
+		STAT_ADD(stats.buid_cache_hits, 1);
+		return (*buid) ? 0 : -ENOMEM;
+	}
+	entry->pending++;
+	generation = buid_cache_generation;
+	mutex_unlock(&buid_cache_mutex);
+
+	STAT_ADD(stats.buid_cache_misses, 1);
+	res = read_buid(buid);
+	buid_cache_finish(entry, generation, res, *buid);
+
+	return res;
+}
+
+struct buid_prefetch {
+	struct buid_cache_entry *entry;
+	uint32_t generation;
+};
+
+static void *buid_prefetch_thread(void *data)
+{
+	struct buid_prefetch *prefetch = (struct buid_prefetch*)data;
+	char *buid = NULL;
+	int res = read_buid(&buid);
+
+	buid_cache_finish(prefetch->entry, prefetch->generation, res, buid);
+	free(buid);
+	free(prefetch);
+
+	return NULL;
+}
+
+int usbmuxd_prefetch_buid(void)
+{
+	struct buid_prefetch *prefetch;
+	struct buid_cache_entry *entry;
+	THREAD_T th = THREAD_T_NULL;
+
+	thread_once(&buid_cache_once, buid_cache_init);
+	mutex_lock(&buid_cache_mutex);
+	entry = buid_cache_entry_get(buid_cache_endpoint());
+	if (!entry) {
+		mutex_unlock(&buid_cache_mutex);
+		return -ENOMEM;
+	}
+	if (entry->buid || entry->pending > 0) {
+		mutex_unlock(&buid_cache_mutex);
+		return 0;
+	}
+	prefetch = (struct buid_prefetch*)malloc(sizeof(struct buid_prefetch));
+	if (!prefetch) {
+		mutex_unlock(&buid_cache_mutex);
+		return -ENOMEM;
+	}
+	entry->pending++;
+	prefetch->entry = entry;
+	prefetch->generation = buid_cache_generation;
+	mutex_unlock(&buid_cache_mutex);
+
+	if (thread_new(&th, buid_prefetch_thread, prefetch) != 0) {
+		buid_cache_finish(entry, prefetch->generation, -1, NULL);
+		free(prefetch);
+		return -EAGAIN;
+	}
+	thread_detach(th);
+
+	return 0;
+}
+
+int usbmuxd_read_buid(char **buid)
+{
+	uint64_t started = get_time_us();
+	int res = cached_read_buid(buid);
+	stats_op_done(LIBUSBMUXD_OP_READ_BUID, started, (res != 0));
+	return res;
+}
+
+/**
+ * Gets the result code of a Result reply in either protocol.
+ */
+static int reply_result_code(const struct usbmuxd_header *hdr, const char *payload, uint32_t *rc)
+{
+	if (hdr->message == MESSAGE_RESULT && hdr->length >= sizeof(*hdr) + sizeof(uint32_t)) {
+		memcpy(rc, payload, sizeof(uint32_t));
+		return 0;
+	}
+	if (hdr->message == MESSAGE_PLIST) {
+		plist_t pl = NULL;
+		plist_t node;
+		uint64_t val = 0;
+		int res = -EPROTO;
+		plist_from_xml(payload, hdr->length - sizeof(*hdr), &pl);
+		node = (pl) ? plist_dict_get_item(pl, "Number") : NULL;
+		if (node && plist_get_node_type(node) == PLIST_UINT) {
+			plist_get_uint_val(node, &val);
+			*rc = (uint32_t)val;
+			res = 0;
+		}
+		plist_free(pl);
+		return res;
+	}
+	return -EPROTO;
+}
+
+/**
+ * Extracts the record from a ReadPairRecord reply into a newly allocated
+ * buffer returned in record_data. The record is copied straight out of the
+ * parsed reply.
+ */
+static int decode_pair_record_reply(const struct usbmuxd_header *hdr, const char *payload, char **record_data, uint32_t *record_size)
+{
+	plist_t pl = NULL;
+	plist_t node = NULL;
+	const char *data;
+	uint64_t size = 0;
+	uint32_t rc = 0;
+	int ret = 0;
+
+	if (hdr->message == MESSAGE_PLIST) {
+		plist_from_xml(payload, hdr->length - sizeof(*hdr), &pl);
+		if (pl && plist_get_node_type(pl) == PLIST_DICT) {
+			node = plist_dict_get_item(pl, "PairRecordData");
+		}
+	}
+	if (!node) {
+		/* no record, so this is a Result message with an error */
+		plist_free(pl);
+		if (reply_result_code(hdr, payload, &rc) < 0) {
+			LIBUSBMUXD_DEBUG(1, "%s: Unexpected message of type %d received!\n", __func__, hdr->message);
+			return -EPROTO;
+		}
+		return (rc != 0) ? -(int)rc : -1;
+	}
+	if (plist_get_node_type(node) != PLIST_DATA) {
+		LIBUSBMUXD_DEBUG(1, "%s: Invalid PairRecordData in reply\n", __func__);
+		plist_free(pl);
+		return -EBADMSG;
+	}
+	data = plist_get_data_ptr(node, &size);
+	if (!data || size == 0) {
+		ret = -1;
+	} else if (size > UINT32_MAX) {
+		ret = -EBADMSG;
+	} else {
+		*record_size = (uint32_t)size;
+		*record_data = (char*)malloc(size);
+		if (*record_data) {
+			memcpy(*record_data, data, size);
+		} else {
+			ret = -ENOMEM;
+		}
+	}
+	plist_free(pl);
+
+	return ret;
+}
+
+/**
+ * Receives the reply to a ReadPairRecord request and extracts the record
+ * with decode_pair_record_reply().
+ */
+static int receive_pair_record_reply(int sfd, uint32_t tag, char **record_data, uint32_t *record_size)
+{
+	struct usbmuxd_header hdr;
+	char *payload = NULL;
+	int ret;
+	int len = receive_raw_packet(sfd, &hdr, &payload, 5000);
+
+	if (len < 0) {
+		return len;
+	}
+	if ((size_t)len < sizeof(hdr)) {
+		free(payload);
+		return -EPROTO;
+	}
+	if (hdr.tag != tag) {
+		LIBUSBMUXD_DEBUG(1, "%s: WARNING: tag mismatch (%d != %d). Proceeding anyway.\n", __func__, hdr.tag, tag);
+	}
+	ret = decode_pair_record_reply(&hdr, payload, record_data, record_size);
+	free(payload);
+
+	return ret;
+}
+
+static int read_pair_record(const char* record_id, char **record_data, uint32_t *record_size)
 {
 	int sfd;
 	int tag;
@@ -1690,39 +2532,57 @@ int usbmuxd_read_pair_record(const char* record_id, char **record_data, uint32_t
 	proto_version = 1;
 	tag = ++use_tag;
 
-	if (send_pair_record_packet(sfd, tag, "ReadPairRecord", record_id, 0, NULL) <= 0) {
+	if (send_pair_record_packet(sfd, tag, "ReadPairRecord", record_id, 0, NULL, 0) <= 0) {
 		LIBUSBMUXD_DEBUG(1, "%s: Error sending ReadPairRecord message!\n", __func__);
 	} else {
-		uint32_t rc = 0;
-		plist_t pl = NULL;
-		ret = usbmuxd_get_result(sfd, tag, &rc, &pl);
-		if ((ret == 1) && (rc == 0)) {
-			plist_t node = plist_dict_get_item(pl, "PairRecordData");
-			if (node && plist_get_node_type(node) == PLIST_DATA) {
-				uint64_t int64val = 0;
-				plist_get_data_val(node, record_data, &int64val);
-				if (*record_data && int64val > 0) {
-					*record_size = (uint32_t)int64val;
-					ret = 0;
-				}
-			}
-		} else if (ret == 1) {
-			ret = -(int)rc;
-		}
-		plist_free(pl);
+		ret = receive_pair_record_reply(sfd, tag, record_data, record_size);
 	}
 	socket_close(sfd);
 
 	return ret;
 }
 
-int usbmuxd_save_pair_record_with_device_id(const char* record_id, uint32_t device_id, const char *record_data, uint32_t record_size)
+static int cached_read_pair_record(const char* record_id, char **record_data, uint32_t *record_size)
+{
+	uint32_t generation = 0;
+	int res;
+
+	if (!pair_record_cache_ttl || !record_id || !record_data || !record_size) {
+		return read_pair_record(record_id, record_data, record_size);
+	}
+	if (pair_record_cache_lookup(record_id, record_data, record_size, &generation) == 0) {
+		return 0;
+	}
+	res = read_pair_record(record_id, record_data, record_size);
+	if (res == 0) {
+		pair_record_cache_store(record_id, *record_data, *record_size, generation);
+	}
+	return res;
+}
+
+int usbmuxd_read_pair_record(const char* record_id, char **record_data, uint32_t *record_size)
+{
+	uint64_t started = get_time_us();
+	int res = cached_read_pair_record(record_id, record_data, record_size);
+	stats_op_done(LIBUSBMUXD_OP_READ_PAIR_RECORD, started, (res != 0));
+	return res;
+}
+
+/**
+ * Checks the arguments of a pair record save, for single and batch saves.
+ */
+static int save_pair_record_valid(const char* record_id, const char *record_data, uint32_t record_size)
+{
+	return (record_id && record_data && record_size > 0);
+}
+
+static int save_pair_record(const char* record_id, uint32_t device_id, const char *record_data, uint32_t record_size)
 {
 	int sfd;
 	int tag;
 	int ret = -1;
 
-	if (!record_id || !record_data || !record_size) {
+	if (!save_pair_record_valid(record_id, record_data, record_size)) {
 		return -EINVAL;
 	}
 
@@ -1735,8 +2595,7 @@ int usbmuxd_save_pair_record_with_device_id(const char* record_id, uint32_t devi
 	proto_version = 1;
 	tag = ++use_tag;
 
-	plist_t data = plist_new_data(record_data, record_size);
-	if (send_pair_record_packet(sfd, tag, "SavePairRecord", record_id, device_id, data) <= 0) {
+	if (send_pair_record_packet(sfd, tag, "SavePairRecord", record_id, device_id, record_data, record_size) <= 0) {
 		LIBUSBMUXD_DEBUG(1, "%s: Error sending SavePairRecord message!\n", __func__);
 	} else {
 		uint32_t rc = 0;
@@ -1748,18 +2607,28 @@ int usbmuxd_save_pair_record_with_device_id(const char* record_id, uint32_t devi
 			LIBUSBMUXD_DEBUG(1, "%s: Error: saving pair record failed: %d\n", __func__, ret);
 		}
 	}
-	plist_free(data);
 	socket_close(sfd);
 
 	return ret;
 }
 
+int usbmuxd_save_pair_record_with_device_id(const char* record_id, uint32_t device_id, const char *record_data, uint32_t record_size)
+{
+	uint64_t started = get_time_us();
+	int res = save_pair_record(record_id, device_id, record_data, record_size);
+	if (pair_record_cache_ttl && record_id) {
+		pair_record_cache_invalidate(record_id);
+	}
+	stats_op_done(LIBUSBMUXD_OP_SAVE_PAIR_RECORD, started, (res != 0));
+	return res;
+}
+
 int usbmuxd_save_pair_record(const char* record_id, const char *record_data, uint32_t record_size)
 {
 	return usbmuxd_save_pair_record_with_device_id(record_id, 0, record_data, record_size);
 }
 
-int usbmuxd_delete_pair_record(const char* record_id)
+static int delete_pair_record(const char* record_id)
 {
 	int sfd;
 	int tag;
@@ -1778,7 +2647,7 @@ int usbmuxd_delete_pair_record(const char* record_id)
 	proto_version = 1;
 	tag = ++use_tag;
 
-	if (send_pair_record_packet(sfd, tag, "DeletePairRecord", record_id, 0, NULL) <= 0) {
+	if (send_pair_record_packet(sfd, tag, "DeletePairRecord", record_id, 0, NULL, 0) <= 0) {
 		LIBUSBMUXD_DEBUG(1, "%s: Error sending DeletePairRecord message!\n", __func__);
 	} else {
 		uint32_t rc = 0;
@@ -1795,6 +2664,269 @@ int usbmuxd_delete_pair_record(const char* record_id)
 	return ret;
 }
 
+int usbmuxd_delete_pair_record(const char* record_id)
+{
+	uint64_t started = get_time_us();
+	int res = delete_pair_record(record_id);
+	if (pair_record_cache_ttl && record_id) {
+		pair_record_cache_invalidate(record_id);
+	}
+	stats_op_done(LIBUSBMUXD_OP_DELETE_PAIR_RECORD, started, (res != 0));
+	return res;
+}
+
+/**
+ * Reads or saves pair records over one connection to usbmuxd. Up to
+ * PAIR_RECORD_BATCH_WINDOW requests are in flight at a time, so neither
+ * side blocks on full socket buffers; usbmuxd answers them in order.
+ * Exactly one of reads and saves is set. Reads that can be answered from
+ * the pair record cache are not sent.
+ */
+static int pair_record_batch(usbmuxd_pair_record_read_t *reads, usbmuxd_pair_record_save_t *saves, unsigned int count)
+{
+	enum libusbmuxd_stats_op op = (saves) ? LIBUSBMUXD_OP_SAVE_PAIR_RECORD : LIBUSBMUXD_OP_READ_PAIR_RECORD;
+	struct usbmuxd_header hdr;
+	char *payload = NULL;
+	unsigned int *todo = NULL;
+	uint32_t *tags = NULL;
+	uint32_t *generations = NULL;
+	uint64_t *sent_at = NULL;
+	unsigned int num_todo = 0;
+	unsigned int sent = 0, received = 0;
+	unsigned int i;
+	int succeeded = 0;
+	int sfd = -1;
+	int err = 0;
+
+#define BATCH_RESULT(i) (*((saves) ? &saves[i].result : &reads[i].result))
+
+	if (!reads && !saves) {
+		return -EINVAL;
+	}
+	if (count == 0) {
+		return 0;
+	}
+	todo = (unsigned int*)malloc(count * sizeof(unsigned int));
+	tags = (uint32_t*)malloc(count * sizeof(uint32_t));
+	generations = (uint32_t*)calloc(count, sizeof(uint32_t));
+	sent_at = (uint64_t*)malloc(count * sizeof(uint64_t));
+	if (!todo || !tags || !generations || !sent_at) {
+		free(todo);
+		free(tags);
+		free(generations);
+		free(sent_at);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < count; i++) {
+		uint64_t started = get_time_us();
+		BATCH_RESULT(i) = -1;
+		if (reads) {
+			reads[i].record_data = NULL;
+			reads[i].record_size = 0;
+		}
+		if ((reads && !reads[i].record_id) || (saves && !save_pair_record_valid(saves[i].record_id, saves[i].record_data, saves[i].record_size))) {
+			BATCH_RESULT(i) = -EINVAL;
+			stats_op_done(op, started, 1);
+			continue;
+		}
+		if (reads && pair_record_cache_ttl && pair_record_cache_lookup(reads[i].record_id, &reads[i].record_data, &reads[i].record_size, &generations[i]) == 0) {
+			BATCH_RESULT(i) = 0;
+			succeeded++;
+			stats_op_done(op, started, 0);
+			continue;
+		}
+		todo[num_todo++] = i;
+	}
+
+	if (num_todo > 0) {
+		sfd = connect_usbmuxd_socket();
+		if (sfd < 0) {
+			LIBUSBMUXD_DEBUG(1, "%s: Error: Connection to usbmuxd failed: %s\n", __func__, strerror(-sfd));
+			err = sfd;
+		}
+		proto_version = 1;
+	}
+
+	while (err == 0 && received < num_todo) {
+		int res;
+		while (sent < num_todo && sent - received < PAIR_RECORD_BATCH_WINDOW) {
+			i = todo[sent];
+			tags[sent] = ++use_tag;
+			sent_at[sent] = get_time_us();
+			if (saves) {
+				res = send_pair_record_packet(sfd, tags[sent], "SavePairRecord", saves[i].record_id, saves[i].device_id, saves[i].record_data, saves[i].record_size);
+			} else {
+				res = send_pair_record_packet(sfd, tags[sent], "ReadPairRecord", reads[i].record_id, 0, NULL, 0);
+			}
+			if (res <= 0) {
+				LIBUSBMUXD_DEBUG(1, "%s: Error sending pair record request!\n", __func__);
+				err = -ECONNRESET;
+				break;
+			}
+			sent++;
+		}
+		if (err != 0) {
+			break;
+		}
+
+		i = todo[received];
+		res = receive_raw_packet(sfd, &hdr, &payload, 5000);
+		if (res < (int)sizeof(hdr)) {
+			/* the connection is unusable, fail the remaining records */
+			free(payload);
+			payload = NULL;
+			err = (res < 0) ? res : -EPROTO;
+			break;
+		}
+		if (hdr.tag != tags[received]) {
+			LIBUSBMUXD_DEBUG(1, "%s: WARNING: tag mismatch (%d != %d). Proceeding anyway.\n", __func__, hdr.tag, tags[received]);
+		}
+		if (saves) {
+			uint32_t rc = 0;
+			res = reply_result_code(&hdr, payload, &rc);
+			if (res == 0 && rc != 0) {
+				res = -(int)rc;
+			}
+			if (pair_record_cache_ttl) {
+				pair_record_cache_invalidate(saves[i].record_id);
+			}
+		} else {
+			res = decode_pair_record_reply(&hdr, payload, &reads[i].record_data, &reads[i].record_size);
+			if (res == 0 && pair_record_cache_ttl) {
+				pair_record_cache_store(reads[i].record_id, reads[i].record_data, reads[i].record_size, generations[i]);
+			}
+		}
+		free(payload);
+		payload = NULL;
+		BATCH_RESULT(i) = res;
+		if (res == 0) {
+			succeeded++;
+		}
+		stats_op_done(op, sent_at[received], (res != 0));
+		received++;
+	}
+
+	for (; received < num_todo; received++) {
+		i = todo[received];
+		BATCH_RESULT(i) = err;
+		if (saves && pair_record_cache_ttl && received < sent) {
+			/* the record may have been saved without us seeing the reply */
+			pair_record_cache_invalidate(saves[i].record_id);
+		}
+		/* records that were never sent failed right away */
+		stats_op_done(op, (received < sent) ? sent_at[received] : get_time_us(), 1);
+	}
+	if (sfd >= 0) {
+		socket_close(sfd);
+	}
+	free(todo);
+	free(tags);
+	free(generations);
+	free(sent_at);
+
+#undef BATCH_RESULT
+
+	if (err != 0 && succeeded == 0 && sent == 0) {
+		return err;
+	}
+	return succeeded;
+}
+
+int usbmuxd_read_pair_records(usbmuxd_pair_record_read_t *records, unsigned int count)
+{
+	return pair_record_batch(records, NULL, count);
+}
+
+int usbmuxd_save_pair_records(usbmuxd_pair_record_save_t *records, unsigned int count)
+{
+	return pair_record_batch(NULL, records, count);
+}
+
+int libusbmuxd_get_stats(libusbmuxd_stats_t *out)
+{
+	int i, j;
+
+	if (!out || out->version == 0 || out->version > LIBUSBMUXD_STATS_VERSION) {
+		return -EINVAL;
+	}
+	for (i = 0; i < LIBUSBMUXD_NUM_OPS; i++) {
+		out->ops[i].count = STAT_GET(stats.ops[i].count);
+		out->ops[i].errors = STAT_GET(stats.ops[i].errors);
+		out->ops[i].time_us = STAT_GET(stats.ops[i].time_us);
+		for (j = 0; j < LIBUSBMUXD_STATS_LATENCY_BUCKETS; j++) {
+			out->ops[i].latency_hist[j] = STAT_GET(stats.ops[i].latency_hist[j]);
+		}
+	}
+	out->reserved = 0;
+	out->sockets_opened = STAT_GET(stats.sockets_opened);
+	out->socket_errors = STAT_GET(stats.socket_errors);
+	out->retries = STAT_GET(stats.retries);
+	out->packets_sent = STAT_GET(stats.packets_sent);
+	out->packets_received = STAT_GET(stats.packets_received);
+	out->bytes_sent = STAT_GET(stats.bytes_sent);
+	out->bytes_received = STAT_GET(stats.bytes_received);
+	out->monitor_connects = STAT_GET(stats.monitor_connects);
+	out->events = STAT_GET(stats.events);
+	if (out->version >= 2) {
+		out->pair_record_cache_hits = STAT_GET(stats.pair_record_cache_hits);
+		out->pair_record_cache_misses = STAT_GET(stats.pair_record_cache_misses);
+		out->buid_cache_hits = STAT_GET(stats.buid_cache_hits);
+		out->buid_cache_misses = STAT_GET(stats.buid_cache_misses);
+	}
+
+	return 0;
+}
+
+void libusbmuxd_reset_stats(void)
+{
+	int i, j;
+
+	/* other threads may be updating the counters, so every field is
+	 * cleared with an atomic store instead of a memset */
+	for (i = 0; i < LIBUSBMUXD_NUM_OPS; i++) {
+		STAT_SET(stats.ops[i].count, 0);
+		STAT_SET(stats.ops[i].errors, 0);
+		STAT_SET(stats.ops[i].time_us, 0);
+		for (j = 0; j < LIBUSBMUXD_STATS_LATENCY_BUCKETS; j++) {
+			STAT_SET(stats.ops[i].latency_hist[j], 0);
+		}
+	}
+	STAT_SET(stats.sockets_opened, 0);
+	STAT_SET(stats.socket_errors, 0);
+	STAT_SET(stats.retries, 0);
+	STAT_SET(stats.packets_sent, 0);
+	STAT_SET(stats.packets_received, 0);
+	STAT_SET(stats.bytes_sent, 0);
+	STAT_SET(stats.bytes_received, 0);
+	STAT_SET(stats.monitor_connects, 0);
+	STAT_SET(stats.events, 0);
+	STAT_SET(stats.pair_record_cache_hits, 0);
+	STAT_SET(stats.pair_record_cache_misses, 0);
+	STAT_SET(stats.buid_cache_hits, 0);
+	STAT_SET(stats.buid_cache_misses, 0);
+}
+
+void libusbmuxd_set_trace_callback(libusbmuxd_trace_cb_t callback, void *user_data)
+{
+	trace_user_data = user_data;
+	trace_cb = callback;
+}
+
+void libusbmuxd_set_pair_record_cache(unsigned int ttl)
+{
+	pair_record_cache_ttl = ttl;
+	if (ttl == 0) {
+		pair_record_cache_invalidate(NULL);
+	}
+}
+
+int libusbmuxd_set_capture_file(const char *path)
+{
+	thread_once(&capture_init_once, capture_init);
+	return capture_open(path);
+}
+
 void libusbmuxd_set_use_inotify(int set)
 {
 #ifdef HAVE_INOTIFY
@@ -1802,6 +2934,12 @@ void libusbmuxd_set_use_inotify(int set)
 #endif
 }
 
+void libusbmuxd_set_log_callback(libusbmuxd_log_cb_t callback, void *user_data)
+{
+	log_user_data = user_data;
+	log_cb = callback;
+}
+
 void libusbmuxd_set_debug_level(int level)
 {
 	libusbmuxd_debug = level;
@@ -0,0 +1,128 @@
+/*
+ * device.c -- device selection and connection shared by the tools
+ *
+ * Copyright (C) 2017 Adrien Guinet <adrien@guinet.me>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <sys/socket.h>
+#endif
+
+#include <libimobiledevice-glue/socket.h>
+#include "device.h"
+
+int select_device(const char* udid, enum usbmux_lookup_options lookup_opts, usbmuxd_device_info_t* dev)
+{
+    usbmuxd_device_info_t *dev_list = NULL;
+    usbmuxd_device_info_t *found = NULL;
+
+    if (udid) {
+        if (usbmuxd_get_device(udid, dev, lookup_opts) > 0) {
+            found = dev;
+        }
+    } else {
+        int count;
+        if ((count = usbmuxd_get_device_list(&dev_list)) < 0) {
+            printf("Connecting to usbmuxd failed, terminating.\n");
+            free(dev_list);
+            return -1;
+        }
+
+        if (dev_list == NULL || dev_list[0].handle == 0) {
+            fprintf(stderr, "No connected device found, terminating.\n");
+            free(dev_list);
+            return -1;
+        }
+
+        int i;
+        for (i = 0; i < count; i++) {
+            if (dev_list[i].conn_type == CONNECTION_TYPE_USB && (lookup_opts & DEVICE_LOOKUP_USBMUX)) {
+                found = &(dev_list[i]);
+                break;
+            }
+            if (dev_list[i].conn_type == CONNECTION_TYPE_NETWORK && (lookup_opts & DEVICE_LOOKUP_NETWORK)) {
+                found = &(dev_list[i]);
+                break;
+            }
+        }
+    }
+
+    if (found == NULL || found->handle == 0) {
+        fprintf(stderr, "No connected/matching device found, disconnecting client.\n");
+        free(dev_list);
+        return -1;
+    }
+
+    if (found != dev) {
+        memcpy(dev, found, sizeof(usbmuxd_device_info_t));
+    }
+    free(dev_list);
+
+    return 0;
+}
+
+int connect_device(const usbmuxd_device_info_t* dev, int device_port)
+{
+    int devfd = -1;
+    if (dev->conn_type == CONNECTION_TYPE_NETWORK) {
+        unsigned char saddr_[32];
+        memset(saddr_, '\0', sizeof(saddr_));
+        struct sockaddr* saddr = (struct sockaddr*)&saddr_[0];
+        if (dev->conn_data[1] == 0x02) { // AF_INET
+            saddr->sa_family = AF_INET;
+            memcpy(&saddr->sa_data[0], (uint8_t*)dev->conn_data+2, 14);
+        }
+        else if (dev->conn_data[1] == 0x1E) { //AF_INET6 (bsd)
+#ifdef AF_INET6
+            saddr->sa_family = AF_INET6;
+            memcpy(&saddr->sa_data[0], (uint8_t*)dev->conn_data+2, 26);
+#else
+            fprintf(stderr, "ERROR: Got an IPv6 address but this system doesn't support IPv6\n");
+            return -EAFNOSUPPORT;
+#endif
+        }
+        else {
+            fprintf(stderr, "Unsupported address family 0x%02x\n", dev->conn_data[1]);
+            return -EAFNOSUPPORT;
+        }
+        char addrtxt[48];
+        addrtxt[0] = '\0';
+        if (!socket_addr_to_string(saddr, addrtxt, sizeof(addrtxt))) {
+            fprintf(stderr, "Failed to convert network address: %d (%s)\n", errno, strerror(errno));
+        }
+        devfd = socket_connect_addr(saddr, device_port);
+        if (devfd < 0) {
+            devfd = -errno;
+        }
+    } else if (dev->conn_type == CONNECTION_TYPE_USB) {
+        devfd = usbmuxd_connect(dev->handle, device_port);
+    }
+    return devfd;
+}
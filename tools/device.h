@@ -0,0 +1,41 @@
+/*
+ * device.h -- device selection and connection shared by the tools
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef TOOLS_DEVICE_H
+#define TOOLS_DEVICE_H
+
+#include "usbmuxd.h"
+
+/**
+ * Looks up the device with the given UDID, or the first device that
+ * matches lookup_opts if udid is NULL, and copies its info to dev. Prints
+ * an error message if no device was found.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int select_device(const char* udid, enum usbmux_lookup_options lookup_opts, usbmuxd_device_info_t* dev);
+
+/**
+ * Opens a connection to the given port on the device, either through
+ * usbmuxd or directly to the network address of the device.
+ *
+ * @return socket file descriptor, or a negative errno value on error.
+ */
+int connect_device(const usbmuxd_device_info_t* dev, int device_port);
+
+#endif
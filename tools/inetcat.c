@@ -47,7 +47,12 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <signal.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #endif
 
 #ifdef _MSC_VER
@@ -59,7 +64,11 @@ typedef SSIZE_T ssize_t;
 
 #include <getopt.h>
 #include <libimobiledevice-glue/socket.h>
+#include <libimobiledevice-glue/thread.h>
 #include "usbmuxd.h"
+#include "device.h"
+
+#define STREAM_BUFFER_SIZE (256 * 1024)
 
 static int debug_level = 0;
 
@@ -73,15 +82,15 @@ static size_t read_data_socket(int fd, uint8_t* buf, size_t bufsize)
         perror("ioctlsocket FIONREAD failed");
         exit(1);
     }
+    size_t bufread = (bytesavailable >= bufsize) ? bufsize:bytesavailable;
 #else
-    size_t bytesavailable = 0;
-    if (ioctl(fd, FIONREAD, &bytesavailable) != 0) {
-        perror("ioctl FIONREAD failed");
-        exit(1);
-    }
+    /* read() returns whatever is available, no need to ask for the amount first */
+    size_t bufread = bufsize;
 #endif
-    size_t bufread = (bytesavailable >= bufsize) ? bufsize:bytesavailable;
-    ssize_t ret = read(fd, buf, bufread);
+    ssize_t ret;
+    do {
+        ret = read(fd, buf, bufread);
+    } while (ret < 0 && errno == EINTR);
     if (ret < 0) {
         perror("read failed");
         exit(1);
@@ -89,6 +98,917 @@ static size_t read_data_socket(int fd, uint8_t* buf, size_t bufsize)
     return (size_t)ret;
 }
 
+/**
+ * Writes the whole buffer, retrying after partial writes.
+ *
+ * @return 0 on success, -1 on error with errno set.
+ */
+static int write_all(int fd, const uint8_t* buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+#ifndef _WIN32
+/*
+ * In streaming mode each direction is copied through its own buffer, or
+ * on Linux through a pipe with splice() so the data never has to be copied
+ * to user space. The device socket is non-blocking, so a device that does
+ * not read while it is sending cannot stall the other direction. stdin and
+ * stdout are shared with other processes and keep their blocking mode, so
+ * a slow reader of stdout still holds up both directions. When
+ * stdin reaches EOF the sending side of the device connection is shut
+ * down and inetcat keeps relaying until the device closes the connection.
+ */
+struct stream_dir {
+    int in;
+    int out;
+    int eof;
+    uint8_t* buf;
+    size_t len;
+    size_t off;
+    uint64_t bytes;
+#ifdef __linux__
+    int pipe[2];
+    size_t pipe_size;
+    int sendfile;
+#endif
+};
+
+#ifdef __linux__
+/**
+ * Checks if splice() can move data from or to the given file descriptor.
+ * Terminals and files opened for appending do not support it.
+ */
+static int splice_supported(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return 0;
+    }
+    if (S_ISREG(st.st_mode)) {
+        return !(fcntl(fd, F_GETFL) & O_APPEND);
+    }
+    return S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode);
+}
+#endif
+
+static int stream_dir_init(struct stream_dir* dir, int in, int out)
+{
+    memset(dir, 0, sizeof(struct stream_dir));
+    dir->in = in;
+    dir->out = out;
+#ifdef __linux__
+    dir->pipe[0] = -1;
+    dir->pipe[1] = -1;
+    struct stat st;
+    if (fstat(in, &st) == 0 && S_ISREG(st.st_mode) && fstat(out, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        /* a file is sent straight from the page cache */
+        dir->sendfile = 1;
+        return 0;
+    }
+    if (splice_supported(in) && splice_supported(out) && pipe2(dir->pipe, O_NONBLOCK | O_CLOEXEC) == 0) {
+        int size = fcntl(dir->pipe[1], F_SETPIPE_SZ, STREAM_BUFFER_SIZE);
+        dir->pipe_size = (size > 0) ? (size_t)size : 65536;
+        return 0;
+    }
+#endif
+    dir->buf = (uint8_t*)malloc(STREAM_BUFFER_SIZE);
+    return (dir->buf) ? 0 : -1;
+}
+
+static void stream_dir_free(struct stream_dir* dir)
+{
+#ifdef __linux__
+    if (dir->pipe[0] >= 0) {
+        close(dir->pipe[0]);
+        close(dir->pipe[1]);
+    }
+#endif
+    free(dir->buf);
+}
+
+/**
+ * @return 1 if there is data that has not been written out yet.
+ */
+static int stream_dir_pending(struct stream_dir* dir)
+{
+#ifdef __linux__
+    if (dir->sendfile) {
+        return !dir->eof;
+    }
+#endif
+    return dir->len > dir->off;
+}
+
+/**
+ * @return 1 if there is room to read more input.
+ */
+static int stream_dir_can_read(struct stream_dir* dir)
+{
+    if (dir->eof) {
+        return 0;
+    }
+#ifdef __linux__
+    if (dir->sendfile) {
+        /* the input is read by stream_dir_write() */
+        return 0;
+    }
+    if (dir->pipe[0] >= 0) {
+        return dir->len - dir->off < dir->pipe_size;
+    }
+#endif
+    return !stream_dir_pending(dir);
+}
+
+/**
+ * Reads from the input of the direction. For a pipe, len counts the
+ * bytes in the pipe and off stays 0.
+ *
+ * @return 0 on success, -1 on error with errno set.
+ */
+static int stream_dir_read(struct stream_dir* dir)
+{
+    ssize_t n;
+#ifdef __linux__
+    if (dir->pipe[0] >= 0) {
+        n = splice(dir->in, NULL, dir->pipe[1], NULL, dir->pipe_size - dir->len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } else
+#endif
+    {
+        n = read(dir->in, dir->buf, STREAM_BUFFER_SIZE);
+    }
+    if (n < 0) {
+        return (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    if (n == 0) {
+        dir->eof = 1;
+        return 0;
+    }
+#ifdef __linux__
+    if (dir->pipe[0] >= 0) {
+        dir->len += n;
+        return 0;
+    }
+#endif
+    dir->len = n;
+    dir->off = 0;
+    return 0;
+}
+
+/**
+ * Writes as much of the pending data to the output as possible.
+ *
+ * @return 0 on success, -1 on error with errno set.
+ */
+static int stream_dir_write(struct stream_dir* dir)
+{
+    ssize_t n;
+#ifdef __linux__
+    if (dir->sendfile) {
+        n = sendfile(dir->out, dir->in, NULL, STREAM_BUFFER_SIZE);
+        if (n == 0) {
+            dir->eof = 1;
+        }
+    } else if (dir->pipe[0] >= 0) {
+        n = splice(dir->pipe[0], NULL, dir->out, NULL, dir->len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            dir->len -= n;
+        }
+    } else
+#endif
+    {
+        n = write(dir->out, dir->buf + dir->off, dir->len - dir->off);
+        if (n > 0) {
+            dir->off += n;
+        }
+    }
+    if (n > 0) {
+        dir->bytes += n;
+    }
+    if (n < 0) {
+        return (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    return 0;
+}
+
+static double get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_rate(const char* what, uint64_t bytes, double elapsed)
+{
+    fprintf(stderr, "%s %llu bytes in %.3f seconds (%.2f MB/s)\n", what, (unsigned long long)bytes, elapsed, (elapsed > 0) ? bytes / elapsed / 1000000.0 : 0.0);
+}
+
+/**
+ * Relays between infd/outfd and the device connection in streaming mode.
+ * If report is set the transfer rates are printed when done.
+ *
+ * @return 0 if both sides finished, 1 on error.
+ */
+static int stream_relay(int devfd, int infd, int outfd, int report)
+{
+    struct stream_dir to_dev;
+    struct stream_dir from_dev;
+    int maxfd = devfd;
+    int shut = 0;
+    int ret = 0;
+    double started = get_time();
+
+    if (infd > maxfd) {
+        maxfd = infd;
+    }
+    if (outfd > maxfd) {
+        maxfd = outfd;
+    }
+    if (stream_dir_init(&to_dev, infd, devfd) < 0) {
+        stream_dir_free(&to_dev);
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    if (stream_dir_init(&from_dev, devfd, outfd) < 0) {
+        stream_dir_free(&to_dev);
+        stream_dir_free(&from_dev);
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    fcntl(devfd, F_SETFL, fcntl(devfd, F_GETFL) | O_NONBLOCK);
+
+    while (1) {
+        fd_set read_fds;
+        fd_set write_fds;
+        FD_ZERO(&read_fds);
+        FD_ZERO(&write_fds);
+
+        if (to_dev.eof && !stream_dir_pending(&to_dev) && !shut) {
+            /* let the device know that there is no more data */
+            shutdown(devfd, SHUT_WR);
+            shut = 1;
+        }
+        if (from_dev.eof && !stream_dir_pending(&from_dev)) {
+            break;
+        }
+        if (stream_dir_can_read(&to_dev)) {
+            FD_SET(infd, &read_fds);
+        }
+        if (stream_dir_pending(&to_dev)) {
+            FD_SET(devfd, &write_fds);
+        }
+        if (stream_dir_can_read(&from_dev)) {
+            FD_SET(devfd, &read_fds);
+        }
+        if (stream_dir_pending(&from_dev)) {
+            FD_SET(outfd, &write_fds);
+        }
+
+        if (select(maxfd+1, &read_fds, &write_fds, NULL, NULL) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("select");
+            ret = 1;
+            break;
+        }
+
+        if ((FD_ISSET(infd, &read_fds) && stream_dir_read(&to_dev) < 0)
+         || (FD_ISSET(devfd, &read_fds) && stream_dir_read(&from_dev) < 0)) {
+            perror("read failed");
+            ret = 1;
+            break;
+        }
+        if ((FD_ISSET(devfd, &write_fds) && stream_dir_write(&to_dev) < 0)
+         || (FD_ISSET(outfd, &write_fds) && stream_dir_write(&from_dev) < 0)) {
+            perror("write failed");
+            ret = 1;
+            break;
+        }
+    }
+
+    if (report) {
+        double elapsed = get_time() - started;
+        print_rate("Sent", to_dev.bytes, elapsed);
+        print_rate("Received", from_dev.bytes, elapsed);
+    }
+
+    stream_dir_free(&to_dev);
+    stream_dir_free(&from_dev);
+
+    return ret;
+}
+#endif
+
+#ifndef _WIN32
+/*
+ * Parallel mode splits the input into chunks that are sent over several
+ * device connections, whichever is ready first.
+ *
+ * Every connection starts with a 16 byte handshake: the magic "INCP", a
+ * 64 bit session id picked at random for the transfer, the 16 bit index of
+ * the connection and the 16 bit number of connections, all big endian. The
+ * receiving end uses it to group the connections of a transfer and to keep
+ * concurrent transfers apart, and acknowledges each connection by sending
+ * the handshake back unchanged.
+ *
+ * After that each chunk is preceded by a 12 byte header holding its
+ * sequence number (64 bit) and its length (32 bit), both big endian. A
+ * chunk with length 0 marks the end of the data; its sequence number is the
+ * total number of chunks. Data coming back has to use the same framing and
+ * is written out in sequence order, so the same tool can be used on both
+ * ends (see --listen).
+ */
+#define PARALLEL_HELLO_SIZE 16
+#define PARALLEL_MAGIC "INCP"
+#define PARALLEL_MAX_STREAMS 64
+/* how long to wait for the handshake of a connection, in milliseconds */
+#define PARALLEL_HELLO_TIMEOUT 10000
+#define PARALLEL_HEADER_SIZE 12
+#define PARALLEL_CHUNK_SIZE (256 * 1024)
+/* how far ahead of the output the received chunks may get */
+#define PARALLEL_WINDOW 64
+
+struct par_chunk {
+    uint64_t seq;
+    uint32_t len;
+    uint8_t* data;
+    struct par_chunk* next;
+};
+
+struct par_state {
+    mutex_t mutex;
+    cond_t cond;
+    int outfd;
+    uint64_t in_seq;
+    int in_eof;
+    /* chunks read from the input that no sender has taken yet */
+    struct par_chunk* outgoing;
+    struct par_chunk** outgoing_tail;
+    int outgoing_count;
+    uint64_t out_seq;
+    uint64_t out_total;
+    struct par_chunk* pending;
+    int failed;
+    uint64_t sent;
+    uint64_t received;
+};
+
+struct par_stream {
+    struct par_state* state;
+    int fd;
+    THREAD_T sender;
+    THREAD_T receiver;
+};
+
+static void put_be(uint8_t* buf, uint64_t val, int size)
+{
+    int i;
+    for (i = 0; i < size; i++) {
+        buf[i] = (uint8_t)(val >> ((size - 1 - i) * 8));
+    }
+}
+
+static uint64_t get_be(const uint8_t* buf, int size)
+{
+    uint64_t val = 0;
+    int i;
+    for (i = 0; i < size; i++) {
+        val = (val << 8) | buf[i];
+    }
+    return val;
+}
+
+static void par_put_header(uint8_t* hdr, uint64_t seq, uint32_t len)
+{
+    put_be(hdr, seq, 8);
+    put_be(hdr + 8, len, 4);
+}
+
+static void par_get_header(const uint8_t* hdr, uint64_t* seq, uint32_t* len)
+{
+    *seq = get_be(hdr, 8);
+    *len = (uint32_t)get_be(hdr + 8, 4);
+}
+
+static void par_put_hello(uint8_t* hello, uint64_t session, int index, int count)
+{
+    memcpy(hello, PARALLEL_MAGIC, 4);
+    put_be(hello + 4, session, 8);
+    put_be(hello + 12, (uint64_t)index, 2);
+    put_be(hello + 14, (uint64_t)count, 2);
+}
+
+static int read_exact(int fd, uint8_t* buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return (n == 0) ? 0 : -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/**
+ * Reads the handshake of a connection.
+ *
+ * @return 1 on success, 0 if the connection was closed, timed out or did
+ *     not send a valid handshake.
+ */
+static int par_read_hello(int fd, uint64_t* session, int* index, int* count)
+{
+    uint8_t hello[PARALLEL_HELLO_SIZE];
+
+    if (socket_check_fd(fd, FDM_READ, PARALLEL_HELLO_TIMEOUT) <= 0 || read_exact(fd, hello, sizeof(hello)) <= 0) {
+        return 0;
+    }
+    if (memcmp(hello, PARALLEL_MAGIC, 4) != 0) {
+        return 0;
+    }
+    *session = get_be(hello + 4, 8);
+    *index = (int)get_be(hello + 12, 2);
+    *count = (int)get_be(hello + 14, 2);
+    return 1;
+}
+
+static uint64_t par_session_id(void)
+{
+    uint64_t id = 0;
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 || read_exact(fd, (uint8_t*)&id, sizeof(id)) <= 0) {
+        id = ((uint64_t)time(NULL) << 32) ^ ((uint64_t)getpid() << 16) ^ (uint64_t)(uintptr_t)&id;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return id;
+}
+
+static void par_fail(struct par_state* state)
+{
+    mutex_lock(&state->mutex);
+    state->failed = 1;
+    cond_broadcast(&state->cond);
+    mutex_unlock(&state->mutex);
+}
+
+static void par_free_chunks(struct par_chunk* chunk)
+{
+    while (chunk) {
+        struct par_chunk* next = chunk->next;
+        free(chunk->data);
+        free(chunk);
+        chunk = next;
+    }
+}
+
+/**
+ * Reads the input into chunks and queues them for the senders until the
+ * input reaches EOF. The input is read without the mutex, so a slow input
+ * does not hold up the receivers; it is only taken to number the chunk and
+ * queue it. At most one chunk per connection is queued at a time.
+ */
+static void par_read_input(struct par_state* state, int infd, int num_streams)
+{
+    while (1) {
+        struct par_chunk* chunk = (struct par_chunk*)calloc(1, sizeof(struct par_chunk));
+        ssize_t n;
+
+        if (chunk) {
+            chunk->data = (uint8_t*)malloc(PARALLEL_HEADER_SIZE + PARALLEL_CHUNK_SIZE);
+        }
+        if (!chunk || !chunk->data) {
+            fprintf(stderr, "Out of memory\n");
+            par_free_chunks(chunk);
+            par_fail(state);
+            break;
+        }
+        do {
+            n = read(infd, chunk->data + PARALLEL_HEADER_SIZE, PARALLEL_CHUNK_SIZE);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            perror("read failed");
+            par_free_chunks(chunk);
+            par_fail(state);
+            break;
+        }
+
+        mutex_lock(&state->mutex);
+        if (n == 0) {
+            state->in_eof = 1;
+            cond_broadcast(&state->cond);
+            mutex_unlock(&state->mutex);
+            par_free_chunks(chunk);
+            break;
+        }
+        while (!state->failed && state->outgoing_count >= num_streams) {
+            cond_wait(&state->cond, &state->mutex);
+        }
+        if (state->failed) {
+            mutex_unlock(&state->mutex);
+            par_free_chunks(chunk);
+            break;
+        }
+        chunk->seq = state->in_seq++;
+        chunk->len = (uint32_t)n;
+        *state->outgoing_tail = chunk;
+        state->outgoing_tail = &chunk->next;
+        state->outgoing_count++;
+        cond_broadcast(&state->cond);
+        mutex_unlock(&state->mutex);
+    }
+}
+
+/**
+ * Sends the queued chunks, and the end marker once the input reached EOF
+ * and all chunks have been taken.
+ */
+static void* par_sender(void* arg)
+{
+    struct par_stream* stream = (struct par_stream*)arg;
+    struct par_state* state = stream->state;
+
+    while (1) {
+        struct par_chunk* chunk;
+        uint64_t total = 0;
+
+        mutex_lock(&state->mutex);
+        while (!state->failed && !state->outgoing && !state->in_eof) {
+            cond_wait(&state->cond, &state->mutex);
+        }
+        if (state->failed) {
+            mutex_unlock(&state->mutex);
+            break;
+        }
+        chunk = state->outgoing;
+        if (chunk) {
+            state->outgoing = chunk->next;
+            if (!state->outgoing) {
+                state->outgoing_tail = &state->outgoing;
+            }
+            state->outgoing_count--;
+            cond_broadcast(&state->cond);
+        } else {
+            total = state->in_seq;
+        }
+        mutex_unlock(&state->mutex);
+
+        if (!chunk) {
+            uint8_t hdr[PARALLEL_HEADER_SIZE];
+            par_put_header(hdr, total, 0);
+            if (write_all(stream->fd, hdr, sizeof(hdr)) < 0) {
+                perror("write failed");
+                par_fail(state);
+            }
+            break;
+        }
+        chunk->next = NULL;
+        par_put_header(chunk->data, chunk->seq, chunk->len);
+        if (write_all(stream->fd, chunk->data, PARALLEL_HEADER_SIZE + chunk->len) < 0) {
+            perror("write failed");
+            par_free_chunks(chunk);
+            par_fail(state);
+            break;
+        }
+        mutex_lock(&state->mutex);
+        state->sent += chunk->len;
+        mutex_unlock(&state->mutex);
+        par_free_chunks(chunk);
+    }
+    shutdown(stream->fd, SHUT_WR);
+    return NULL;
+}
+
+/**
+ * Writes out the received chunks that are next in sequence. Must be called
+ * with the mutex held.
+ */
+static int par_flush(struct par_state* state)
+{
+    while (state->pending && state->pending->seq == state->out_seq) {
+        struct par_chunk* chunk = state->pending;
+        if (write_all(state->outfd, chunk->data, chunk->len) < 0) {
+            perror("write failed");
+            return -1;
+        }
+        state->pending = chunk->next;
+        state->out_seq++;
+        state->received += chunk->len;
+        free(chunk->data);
+        free(chunk);
+    }
+    cond_broadcast(&state->cond);
+    return 0;
+}
+
+static void* par_receiver(void* arg)
+{
+    struct par_stream* stream = (struct par_stream*)arg;
+    struct par_state* state = stream->state;
+    uint8_t hdr[PARALLEL_HEADER_SIZE];
+
+    while (1) {
+        struct par_chunk* chunk;
+        struct par_chunk** pos;
+        int res = read_exact(stream->fd, hdr, sizeof(hdr));
+        if (res <= 0) {
+            if (res < 0) {
+                perror("read failed");
+                par_fail(state);
+            }
+            break;
+        }
+        chunk = (struct par_chunk*)calloc(1, sizeof(struct par_chunk));
+        if (!chunk) {
+            par_fail(state);
+            break;
+        }
+        par_get_header(hdr, &chunk->seq, &chunk->len);
+        if (chunk->len == 0) {
+            mutex_lock(&state->mutex);
+            state->out_total = chunk->seq;
+            mutex_unlock(&state->mutex);
+            free(chunk);
+            continue;
+        }
+        if (chunk->len > PARALLEL_CHUNK_SIZE || !(chunk->data = (uint8_t*)malloc(chunk->len))) {
+            fprintf(stderr, "Invalid chunk of %u bytes received\n", chunk->len);
+            free(chunk);
+            par_fail(state);
+            break;
+        }
+        if (read_exact(stream->fd, chunk->data, chunk->len) <= 0) {
+            fprintf(stderr, "Connection closed in the middle of a chunk\n");
+            free(chunk->data);
+            free(chunk);
+            par_fail(state);
+            break;
+        }
+
+        mutex_lock(&state->mutex);
+        /* don't get too far ahead of the connection carrying the next chunk */
+        while (!state->failed && chunk->seq >= state->out_seq + PARALLEL_WINDOW) {
+            cond_wait(&state->cond, &state->mutex);
+        }
+        if (state->failed || chunk->seq < state->out_seq) {
+            mutex_unlock(&state->mutex);
+            free(chunk->data);
+            free(chunk);
+            break;
+        }
+        for (pos = &state->pending; *pos && (*pos)->seq < chunk->seq; pos = &(*pos)->next);
+        chunk->next = *pos;
+        *pos = chunk;
+        if (par_flush(state) < 0) {
+            state->failed = 1;
+            cond_broadcast(&state->cond);
+        }
+        mutex_unlock(&state->mutex);
+    }
+    return NULL;
+}
+
+/**
+ * Relays between infd/outfd and the peer over the given connections, which
+ * have completed the handshake. Closes the connections.
+ *
+ * @return 0 on success, 1 on error.
+ */
+static int par_run(struct par_stream* streams, int num_streams, int infd, int outfd, int report)
+{
+    struct par_state state;
+    double started = get_time();
+    int ret = 0;
+    int i;
+
+    memset(&state, 0, sizeof(state));
+    mutex_init(&state.mutex);
+    cond_init(&state.cond);
+    state.outfd = outfd;
+    state.outgoing_tail = &state.outgoing;
+    state.out_total = UINT64_MAX;
+
+    for (i = 0; i < num_streams; i++) {
+        streams[i].state = &state;
+    }
+    for (i = 0; i < num_streams && ret == 0; i++) {
+        if (thread_new(&streams[i].receiver, par_receiver, &streams[i]) != 0) {
+            streams[i].receiver = THREAD_T_NULL;
+        } else if (thread_new(&streams[i].sender, par_sender, &streams[i]) != 0) {
+            streams[i].sender = THREAD_T_NULL;
+        } else {
+            continue;
+        }
+        fprintf(stderr, "ERROR: Failed to create thread\n");
+        par_fail(&state);
+        ret = 1;
+    }
+    if (ret == 0) {
+        par_read_input(&state, infd, num_streams);
+    }
+    for (i = 0; i < num_streams; i++) {
+        if (streams[i].sender != THREAD_T_NULL) {
+            thread_join(streams[i].sender);
+            thread_free(streams[i].sender);
+        }
+        if (state.failed) {
+            /* unblock the receivers */
+            shutdown(streams[i].fd, SHUT_RDWR);
+        }
+    }
+    for (i = 0; i < num_streams; i++) {
+        if (streams[i].receiver != THREAD_T_NULL) {
+            thread_join(streams[i].receiver);
+            thread_free(streams[i].receiver);
+        }
+        socket_close(streams[i].fd);
+    }
+
+    if (state.failed) {
+        ret = 1;
+    } else if (state.pending || (state.out_total != UINT64_MAX && state.out_seq != state.out_total)) {
+        fprintf(stderr, "ERROR: Received data is incomplete\n");
+        ret = 1;
+    }
+    par_free_chunks(state.outgoing);
+    par_free_chunks(state.pending);
+    if (report) {
+        double elapsed = get_time() - started;
+        print_rate("Sent", state.sent, elapsed);
+        print_rate("Received", state.received, elapsed);
+    }
+    mutex_destroy(&state.mutex);
+    cond_destroy(&state.cond);
+
+    return ret;
+}
+
+/**
+ * Relays between infd/outfd and the device using num_streams connections.
+ *
+ * @return 0 on success, 1 on error.
+ */
+static int parallel_relay(const usbmuxd_device_info_t* dev, int port, int num_streams, int infd, int outfd, int report)
+{
+    struct par_stream* streams = (struct par_stream*)calloc(num_streams, sizeof(struct par_stream));
+    uint64_t session = par_session_id();
+    int connected = 0;
+    int ret = 0;
+    int i;
+
+    if (!streams) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < num_streams && ret == 0; i++) {
+        uint8_t hello[PARALLEL_HELLO_SIZE];
+        streams[i].fd = connect_device(dev, port);
+        if (streams[i].fd < 0) {
+            fprintf(stderr, "Error connecting to device: %s\n", strerror(-streams[i].fd));
+            ret = 1;
+            break;
+        }
+        connected++;
+        par_put_hello(hello, session, i, num_streams);
+        if (write_all(streams[i].fd, hello, sizeof(hello)) < 0) {
+            perror("write failed");
+            ret = 1;
+        }
+    }
+    for (i = 0; i < connected && ret == 0; i++) {
+        uint64_t ack_session;
+        int ack_index, ack_count;
+        if (!par_read_hello(streams[i].fd, &ack_session, &ack_index, &ack_count)
+         || ack_session != session || ack_index != i || ack_count != num_streams) {
+            fprintf(stderr, "ERROR: The service on the device did not accept the parallel transfer\n");
+            ret = 1;
+        }
+    }
+    if (ret == 0) {
+        ret = par_run(streams, num_streams, infd, outfd, report);
+    } else {
+        for (i = 0; i < connected; i++) {
+            socket_close(streams[i].fd);
+        }
+    }
+    free(streams);
+
+    return ret;
+}
+
+/**
+ * Receiving end of a parallel transfer: accepts connections on the given
+ * port on localhost until all connections of one transfer have completed
+ * the handshake, then relays between infd/outfd and them. Connections that
+ * belong to another transfer or don't start with a valid handshake are
+ * closed.
+ *
+ * @return 0 on success, 1 on error.
+ */
+static int parallel_listen(int port, int infd, int outfd, int report)
+{
+    struct par_stream streams[PARALLEL_MAX_STREAMS];
+    uint64_t session = 0;
+    int num_streams = 0;
+    int connected = 0;
+    int ret = 0;
+    int lfd;
+    int i;
+
+    lfd = socket_create("127.0.0.1", (uint16_t)port);
+    if (lfd < 0) {
+        fprintf(stderr, "Could not listen on port %d: %s\n", port, strerror(errno));
+        return 1;
+    }
+    memset(streams, 0, sizeof(streams));
+    for (i = 0; i < PARALLEL_MAX_STREAMS; i++) {
+        streams[i].fd = -1;
+    }
+
+    while (num_streams == 0 || connected < num_streams) {
+        uint8_t hello[PARALLEL_HELLO_SIZE];
+        uint64_t hello_session;
+        int index, count;
+        int fd = socket_accept(lfd, (uint16_t)port);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("accept failed");
+            ret = 1;
+            break;
+        }
+        if (!par_read_hello(fd, &hello_session, &index, &count)
+         || count <= 0 || count > PARALLEL_MAX_STREAMS || index >= count) {
+            fprintf(stderr, "Ignoring connection without a valid parallel handshake\n");
+            socket_close(fd);
+            continue;
+        }
+        if (num_streams == 0) {
+            session = hello_session;
+            num_streams = count;
+        } else if (hello_session != session || count != num_streams) {
+            fprintf(stderr, "Ignoring connection of another transfer\n");
+            socket_close(fd);
+            continue;
+        }
+        if (streams[index].fd >= 0) {
+            fprintf(stderr, "Ignoring duplicate connection %d of the transfer\n", index);
+            socket_close(fd);
+            continue;
+        }
+        par_put_hello(hello, session, index, num_streams);
+        if (write_all(fd, hello, sizeof(hello)) < 0) {
+            perror("write failed");
+            socket_close(fd);
+            ret = 1;
+            break;
+        }
+        streams[index].fd = fd;
+        connected++;
+    }
+    socket_close(lfd);
+
+    if (ret == 0) {
+        return par_run(streams, num_streams, infd, outfd, report);
+    }
+    for (i = 0; i < num_streams; i++) {
+        if (streams[i].fd >= 0) {
+            socket_close(streams[i].fd);
+        }
+    }
+    return ret;
+}
+
+/* closes the file given with -o, so write errors that only show up on close are not lost */
+static int close_output(int outfd, const char* out_file)
+{
+    if (outfd != STDOUT_FILENO && close(outfd) < 0) {
+        fprintf(stderr, "Could not write %s: %s\n", out_file, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+#endif
+
 static void print_usage(int argc, char **argv, int is_error)
 {
     char *name = NULL;
@@ -102,6 +1022,21 @@ static void print_usage(int argc, char **argv, int is_error)
         "  -u, --udid UDID    target specific device by UDID\n" \
         "  -n, --network      connect to network device\n" \
         "  -l, --local        connect to USB device (default)\n" \
+        "  -s, --stream       streaming mode for bulk transfers: large buffers, splice\n" \
+        "                     on Linux, and when STDIN reaches EOF wait for the device\n" \
+        "                     to close the connection instead of exiting right away\n" \
+        "  -f, --file FILE    send FILE instead of STDIN (implies --stream)\n" \
+        "  -o, --output FILE  write the received data to FILE instead of STDOUT\n" \
+        "                     (implies --stream)\n" \
+        "  -O, --offset N     resume a transfer: start sending FILE at byte N, or keep\n" \
+        "                     the first N bytes of the output FILE and append to them\n" \
+        "  -P, --parallel N   split the data across N device connections; each chunk\n" \
+        "                     carries a sequence header and the received data is\n" \
+        "                     reassembled in order, so the peer has to speak the same\n" \
+        "                     framing (e.g. inetcat -L on the other end)\n" \
+        "  -L, --listen       receive a parallel transfer: accept the connections of\n" \
+        "                     an inetcat -P on DEVICE_PORT on localhost instead of\n" \
+        "                     connecting to a device, e.g. when running on the device\n" \
         "  -h, --help         prints usage information\n" \
         "  -d, --debug        increase debug level\n" \
         "  -v, --version      prints version information\n" \
@@ -119,15 +1054,29 @@ int main(int argc, char **argv)
         { "udid", required_argument, NULL, 'u' },
         { "local", no_argument, NULL, 'l' },
         { "network", no_argument, NULL, 'n' },
+        { "stream", no_argument, NULL, 's' },
+        { "file", required_argument, NULL, 'f' },
+        { "output", required_argument, NULL, 'o' },
+        { "offset", required_argument, NULL, 'O' },
+        { "parallel", required_argument, NULL, 'P' },
+        { "listen", no_argument, NULL, 'L' },
         { "version", no_argument, NULL, 'v' },
         { NULL, 0, NULL, 0}
     };
 
     char* device_udid = NULL;
     static enum usbmux_lookup_options lookup_opts = 0;
+    int stream_mode = 0;
+    const char* in_file = NULL;
+    const char* out_file = NULL;
+    long long offset = 0;
+#ifndef _WIN32
+    int parallel = 0;
+    int listen_mode = 0;
+#endif
 
     int c = 0;
-    while ((c = getopt_long(argc, argv, "dhu:lnv", longopts, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, "dhu:lnsf:o:O:P:Lv", longopts, NULL)) != -1) {
         switch (c) {
         case 'd':
             libusbmuxd_set_debug_level(++debug_level);
@@ -147,6 +1096,52 @@ int main(int argc, char **argv)
         case 'n':
             lookup_opts |= DEVICE_LOOKUP_NETWORK;
             break;
+        case 's':
+#ifdef _WIN32
+            fprintf(stderr, "ERROR: Streaming mode is not supported on this platform.\n");
+            return 2;
+#else
+            stream_mode = 1;
+            break;
+#endif
+        case 'f':
+        case 'o':
+#ifdef _WIN32
+            fprintf(stderr, "ERROR: File transfers are not supported on this platform.\n");
+            return 2;
+#else
+            if (c == 'f') {
+                in_file = optarg;
+            } else {
+                out_file = optarg;
+            }
+            stream_mode = 1;
+            break;
+#endif
+#ifndef _WIN32
+        case 'P': {
+            char* endp = NULL;
+            long val = strtol(optarg, &endp, 10);
+            if (val <= 0 || val > 64 || endp == optarg || *endp != '\0') {
+                fprintf(stderr, "ERROR: Invalid value '%s' for option -%c!\n", optarg, c);
+                print_usage(argc, argv, 1);
+                return 2;
+            }
+            parallel = (int)val;
+            } break;
+        case 'L':
+            listen_mode = 1;
+            break;
+#endif
+        case 'O': {
+            char* endp = NULL;
+            offset = strtoll(optarg, &endp, 10);
+            if (offset < 0 || endp == optarg || *endp != '\0') {
+                fprintf(stderr, "ERROR: Invalid offset specified!\n");
+                print_usage(argc, argv, 1);
+                return 2;
+            }
+            } break;
         case 'h':
             print_usage(argc, argv, 0);
             return 0;
@@ -178,92 +1173,96 @@ int main(int argc, char **argv)
     }
 
 #ifndef _WIN32
-    signal(SIGPIPE, SIG_IGN);
+    if (listen_mode && parallel > 0) {
+        fprintf(stderr, "ERROR: --listen takes the number of connections from the peer and can't be combined with --parallel.\n");
+        return 2;
+    }
 #endif
 
-    usbmuxd_device_info_t *dev_list = NULL;
-    usbmuxd_device_info_t *dev = NULL;
-    usbmuxd_device_info_t muxdev;
+    if (offset > 0 && !in_file && !out_file) {
+        fprintf(stderr, "ERROR: --offset requires --file or --output.\n");
+        return 2;
+    }
 
-    if (device_udid) {
-        if (usbmuxd_get_device(device_udid, &muxdev, lookup_opts) > 0) {
-            dev = &muxdev;
+#ifndef _WIN32
+    /* open the files before connecting so errors don't cost a device connection */
+    int infd = STDIN_FILENO;
+    int outfd = STDOUT_FILENO;
+    if (in_file) {
+        infd = open(in_file, O_RDONLY | O_CLOEXEC);
+        if (infd < 0) {
+            fprintf(stderr, "Could not open %s: %s\n", in_file, strerror(errno));
+            return 1;
         }
-    } else {
-        int count;
-        if ((count = usbmuxd_get_device_list(&dev_list)) < 0) {
-            printf("Connecting to usbmuxd failed, terminating.\n");
-            free(dev_list);
+        if (offset > 0 && lseek(infd, (off_t)offset, SEEK_SET) < 0) {
+            fprintf(stderr, "Could not seek to offset %lld in %s: %s\n", offset, in_file, strerror(errno));
             return 1;
         }
-
-        if (dev_list == NULL || dev_list[0].handle == 0) {
-            fprintf(stderr, "No connected device found, terminating.\n");
-            free(dev_list);
+    }
+    if (out_file) {
+        outfd = open(out_file, O_WRONLY | O_CREAT | O_CLOEXEC | ((offset > 0) ? 0 : O_TRUNC), 0644);
+        if (outfd < 0) {
+            fprintf(stderr, "Could not open %s: %s\n", out_file, strerror(errno));
             return 1;
         }
+        struct stat st;
+        if (offset > 0 && fstat(outfd, &st) == 0 && st.st_size < (off_t)offset) {
+            fprintf(stderr, "ERROR: %s has only %lld bytes, can't resume at offset %lld.\n", out_file, (long long)st.st_size, offset);
+            return 1;
+        }
+        if (offset > 0 && (ftruncate(outfd, (off_t)offset) < 0 || lseek(outfd, (off_t)offset, SEEK_SET) < 0)) {
+            fprintf(stderr, "Could not resume %s at offset %lld: %s\n", out_file, offset, strerror(errno));
+            return 1;
+        }
+    }
+#endif
 
-        int i;
-        for (i = 0; i < count; i++) {
-            if (dev_list[i].conn_type == CONNECTION_TYPE_USB && (lookup_opts & DEVICE_LOOKUP_USBMUX)) {
-                dev = &(dev_list[i]);
-                break;
-            }
-            if (dev_list[i].conn_type == CONNECTION_TYPE_NETWORK && (lookup_opts & DEVICE_LOOKUP_NETWORK)) {
-                dev = &(dev_list[i]);
-                break;
-            }
+#ifndef _WIN32
+    signal(SIGPIPE, SIG_IGN);
+
+    if (listen_mode) {
+        int res = parallel_listen(device_port, infd, outfd, (in_file || out_file));
+        if (close_output(outfd, out_file) < 0) {
+            res = 1;
         }
+        return res;
     }
+#endif
+
+    usbmuxd_device_info_t muxdev;
+    usbmuxd_device_info_t *dev = &muxdev;
 
-    if (dev == NULL || dev->handle == 0) {
-        fprintf(stderr, "No connected/matching device found, disconnecting client.\n");
-        free(dev_list);
+    if (select_device(device_udid, lookup_opts, &muxdev) < 0) {
         return 1;
     }
 
-    int devfd = -1;
-    if (dev->conn_type == CONNECTION_TYPE_NETWORK) {
-        unsigned char saddr_[32];
-        memset(saddr_, '\0', sizeof(saddr_));
-        struct sockaddr* saddr = (struct sockaddr*)&saddr_[0];
-        if (dev->conn_data[1] == 0x02) { // AF_INET
-            saddr->sa_family = AF_INET;
-            memcpy(&saddr->sa_data[0], (uint8_t*)dev->conn_data+2, 14);
-        }
-        else if (dev->conn_data[1] == 0x1E) { //AF_INET6 (bsd)
-#ifdef AF_INET6
-            saddr->sa_family = AF_INET6;
-            memcpy(&saddr->sa_data[0], (uint8_t*)dev->conn_data+2, 26);
-#else
-            fprintf(stderr, "ERROR: Got an IPv6 address but this system doesn't support IPv6\n");
-            free(dev_list);
-            return 1;
-#endif
-        }
-        else {
-            fprintf(stderr, "Unsupported address family 0x%02x\n", dev->conn_data[1]);
-            free(dev_list);
-            return 1;
-        }
-        char addrtxt[48];
-        addrtxt[0] = '\0';
-        if (!socket_addr_to_string(saddr, addrtxt, sizeof(addrtxt))) {
-            fprintf(stderr, "Failed to convert network address: %d (%s)\n", errno, strerror(errno));
-        }
-	devfd = socket_connect_addr(saddr, device_port);
-        if (devfd < 0) {
-            devfd = -errno;
+#ifndef _WIN32
+    if (parallel > 0) {
+        int res = parallel_relay(dev, device_port, parallel, infd, outfd, (in_file || out_file));
+        if (close_output(outfd, out_file) < 0) {
+            res = 1;
         }
-    } else if (dev->conn_type == CONNECTION_TYPE_USB) {
-        devfd = usbmuxd_connect(dev->handle, device_port);
+        return res;
     }
-    free(dev_list);
+#endif
+
+    int devfd = connect_device(dev, device_port);
     if (devfd < 0) {
         fprintf(stderr, "Error connecting to device: %s\n", strerror(-devfd));
         return 1;
     }
 
+#ifndef _WIN32
+    if (stream_mode) {
+        int res = stream_relay(devfd, infd, outfd, (in_file || out_file));
+        socket_close(devfd);
+        if (close_output(outfd, out_file) < 0) {
+            res = 1;
+        }
+        return res;
+    }
+#endif
+
     fd_set fds;
     FD_ZERO(&fds);
     FD_SET(STDIN_FILENO, &fds);
@@ -285,7 +1284,11 @@ int main(int argc, char **argv)
             if (n == 0) {
                 break;
             }
-            write(devfd, buf, n);
+            if (write_all(devfd, buf, n) < 0) {
+                perror("write failed");
+                ret = 1;
+                break;
+            }
         }
 
         if (FD_ISSET(devfd, &read_fds)) {
@@ -293,7 +1296,11 @@ int main(int argc, char **argv)
             if (n == 0) {
                 break;
             }
-            write(STDOUT_FILENO, buf, n);
+            if (write_all(STDOUT_FILENO, buf, n) < 0) {
+                perror("write failed");
+                ret = 1;
+                break;
+            }
         }
     }
 
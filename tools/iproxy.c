@@ -33,7 +33,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -44,179 +48,3787 @@ typedef unsigned int socklen_t;
 #include <unistd.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <signal.h>
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_LIBURING
+#include <sys/eventfd.h>
+#include <liburing.h>
+#endif
+#if defined(HAVE_SYS_EPOLL_H) && defined(SO_REUSEPORT)
+#define HAVE_ACCEPTOR_THREADS 1
+#include <netdb.h>
+#endif
+
+#include <getopt.h>
+#include <libimobiledevice-glue/socket.h>
+#include <libimobiledevice-glue/thread.h>
+#include <libimobiledevice-glue/collection.h>
+#include "usbmuxd.h"
+
+#ifndef ETIMEDOUT
+#define ETIMEDOUT 138
+#endif
+
+static int debug_level = 0;
+
+enum listen_type {
+	LISTEN_TYPE_PORT = 0,
+	LISTEN_TYPE_PROXY,
+	LISTEN_TYPE_METRICS
+};
+
+/* Counters are only ever modified with atomic adds, so relay threads
+ * never have to take a lock to account for their traffic. */
+#if defined(__GNUC__) || defined(__clang__)
+#define STAT_ADD(x, v) __atomic_fetch_add(&(x), (v), __ATOMIC_RELAXED)
+#define STAT_SUB(x, v) __atomic_fetch_sub(&(x), (v), __ATOMIC_RELAXED)
+#define STAT_GET(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#elif defined(_WIN32)
+#define STAT_ADD(x, v) InterlockedExchangeAdd64((volatile LONG64*)&(x), (LONG64)(v))
+#define STAT_SUB(x, v) InterlockedExchangeAdd64((volatile LONG64*)&(x), -(LONG64)(v))
+#define STAT_GET(x) InterlockedCompareExchange64((volatile LONG64*)&(x), 0, 0)
+#else
+#define STAT_ADD(x, v) (((x) += (v)) - (v))
+#define STAT_SUB(x, v) (((x) -= (v)) + (v))
+#define STAT_GET(x) (x)
+#endif
+
+/* Reference counts need stronger ordering than the counters: the thread
+ * dropping the last reference frees the object, so it has to see every
+ * write the other holders made before releasing theirs. Both macros
+ * return the new count. */
+#if defined(__GNUC__) || defined(__clang__)
+#define REF_INC(x) __atomic_add_fetch(&(x), 1, __ATOMIC_RELAXED)
+#define REF_DEC(x) __atomic_sub_fetch(&(x), 1, __ATOMIC_ACQ_REL)
+#elif defined(_WIN32)
+#define REF_INC(x) InterlockedIncrement64((volatile LONG64*)&(x))
+#define REF_DEC(x) InterlockedDecrement64((volatile LONG64*)&(x))
+#else
+static mutex_t refs_mutex;
+static thread_once_t refs_once = THREAD_ONCE_INIT;
+
+static void refs_init(void)
+{
+	mutex_init(&refs_mutex);
+}
+
+static uint64_t ref_add(uint64_t *refs, int value)
+{
+	uint64_t res;
+	thread_once(&refs_once, refs_init);
+	mutex_lock(&refs_mutex);
+	*refs += value;
+	res = *refs;
+	mutex_unlock(&refs_mutex);
+	return res;
+}
+#define REF_INC(x) ref_add(&(x), 1)
+#define REF_DEC(x) ref_add(&(x), -1)
+#endif
+
+/* upper bounds of the connect latency histogram buckets in microseconds */
+static const uint64_t latency_buckets[] = {
+	1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000
+};
+#define NUM_LATENCY_BUCKETS (sizeof(latency_buckets) / sizeof(latency_buckets[0]))
+
+struct relay_stats {
+	uint64_t active;
+	uint64_t accepted;
+	uint64_t connect_failed;
+	uint64_t bytes_to_device;
+	uint64_t bytes_from_device;
+	uint64_t relay_time_us;
+	uint64_t connect_time_us;
+	uint64_t connect_hist[NUM_LATENCY_BUCKETS+1];
+	uint64_t sched_grants;
+	uint64_t sched_wait_us;
+	uint64_t throttle_us;
+	uint64_t queued;
+	uint64_t queue_len;
+	uint64_t rejected;
+	uint64_t abandoned;
+	uint64_t pool_refills;
+	uint64_t pool_refills_rejected;
+	uint64_t queue_time_us;
+	uint64_t queue_hist[NUM_LATENCY_BUCKETS+1];
+};
+
+struct stats_entry {
+	char *label;
+	struct relay_stats stats;
+};
+
+static struct collection device_stats;
+static mutex_t device_stats_mutex;
+
+/* token bucket capping the throughput of a mapping or a device */
+struct rate_limit {
+	uint64_t rate;
+	uint64_t burst;
+	int64_t tokens;
+	uint64_t last;
+	mutex_t mutex;
+};
+
+/*
+ * A gate limits the number of threads inside a section, like the relays
+ * of a device or the pending device connects. Threads finding it full
+ * wait in FIFO order, at most queue_limit of them and each for at most
+ * queue_timeout seconds.
+ */
+struct gate_waiter {
+	struct gate_waiter *next;
+};
+
+struct gate {
+	mutex_t mutex;
+	cond_t cond;
+	unsigned int limit;
+	unsigned int inside;
+	unsigned int waiting;
+	struct gate_waiter *head;
+	struct gate_waiter *tail;
+};
+
+/*
+ * Relays going to the same device share its USB link. With fair sharing
+ * enabled every transfer in one direction has to be granted by the
+ * device's queue first, which serves the waiting connections in deficit
+ * round-robin order: each turn adds SCHED_QUANTUM bytes times the
+ * priority of the mapping to the deficit of a connection, and a grant
+ * never exceeds the deficit. A grant only bounds how much a connection
+ * reads in its turn; the data is written after the grant is released, so
+ * one blocked socket does not stall the queue. A bulk transfer can thus
+ * not starve an interactive session on the same device.
+ */
+#define SCHED_QUANTUM 4096
+#define SCHED_MAX_PRIORITY 64
+
+struct sched_flow {
+	struct sched_queue *queue;
+	struct sched_flow *next;
+	unsigned int weight;
+	size_t deficit;
+	size_t want;
+	size_t granted;
+	int waiting;
+	int queued;
+};
+
+struct sched_queue {
+	mutex_t mutex;
+	cond_t cond;
+	struct sched_flow *head;
+	struct sched_flow *tail;
+	int busy;
+};
+
+enum sched_direction {
+	SCHED_TO_DEVICE = 0,
+	SCHED_FROM_DEVICE
+};
+
+struct device_sched {
+	char *udid;
+	struct sched_queue queue[2];
+	struct rate_limit limit;
+	struct gate relays;
+};
+
+static int fair_share = 0;
+static uint64_t device_rate = 0;
+static char *default_udid = NULL;
+static enum usbmux_lookup_options default_lookup_opts = 0;
+static char *source_addr = NULL;
+/* number of threads accepting connections, including the main thread */
+static int num_acceptors = 1;
+
+/* admission control, 0 means unlimited */
+static unsigned int max_relays = 0;
+static unsigned int max_device_relays = 0;
+static unsigned int max_connects = 0;
+static unsigned int queue_limit = 128;
+static unsigned int queue_timeout = 10;
+/* set if any mapping has a relay limit, its queue is swept regularly */
+static int mappings_limited = 0;
+static struct gate connect_gate;
+
+struct warm_spec {
+	uint16_t device_port;
+	int num;
+};
+static struct warm_spec *warm_specs = NULL;
+static int num_warm_specs = 0;
+static unsigned int warm_idle = 60;
+
+static char *config_path = NULL;
+static time_t config_mtime = 0;
+static off_t config_size = 0;
+#ifndef _WIN32
+static volatile sig_atomic_t reload_requested = 0;
+#endif
+static struct collection device_scheds;
+static mutex_t device_scheds_mutex;
+
+/* a local listener and the device port it forwards to */
+struct mapping {
+	enum listen_type type;
+	char *local_path;
+	uint16_t local_port;
+	uint16_t device_port;
+	char *udid;
+	enum usbmux_lookup_options lookup_opts;
+	int fd;
+	int *acceptor_fds;
+	uint64_t refs;
+	int from_config;
+	/* the listeners were handed to a new mapping by a reload */
+	int taken_over;
+	unsigned int priority;
+	struct rate_limit limit;
+	struct stats_entry stats;
+	struct device_pool *pool;
+	/* clients beyond max_relays wait in a queue without a thread */
+	unsigned int max_relays;
+	unsigned int admitted;
+	struct client_data *queue_head;
+	struct client_data *queue_tail;
+	mutex_t admit_mutex;
+};
+
+struct client_data {
+	int fd;
+	int sfd;
+	char* udid;
+	enum usbmux_lookup_options lookup_opts;
+	uint16_t device_port;
+	enum listen_type type;
+	struct mapping *mapping;
+	struct stats_entry *device;
+	struct device_sched *sched;
+	struct device_pool *pool;
+	uint32_t handle;
+	struct gate *device_gate;
+	struct client_data *next;
+	uint64_t queued_at;
+};
+
+/*
+ * The devices currently attached, as reported by usbmuxd events. Clients
+ * are matched against this list instead of querying the device list from
+ * usbmuxd for every new connection.
+ */
+static int events_active = 0;
+static struct collection attached_devices;
+static mutex_t attached_mutex;
+static cond_t attached_cond;
+/* handles of the devices that had events while the list was seeded */
+static struct collection attached_seen;
+static int attached_seeding = 0;
+/* seconds a client waits for its device to be attached */
+static unsigned int device_wait = 0;
+
+/* clients that are currently being relayed */
+static struct collection relays;
+static mutex_t relays_mutex;
+
+struct mapping_list {
+	struct mapping **items;
+	int count;
+};
+
+/* the active mappings; only modified by the main thread, which holds
+ * mappings_mutex while doing so */
+static struct mapping_list mappings = { NULL, 0 };
+static mutex_t mappings_mutex;
+
+/* pre-established device connections that are handed out on accept */
+struct pool_conn {
+	int sfd;
+	uint64_t created;
+	uint32_t handle;
+	char udid[44];
+};
+
+struct device_pool {
+	struct stats_entry *mapping;
+	char *udid;
+	enum usbmux_lookup_options lookup_opts;
+	uint16_t device_port;
+	int size;
+	uint64_t idle_timeout;
+	struct collection conns;
+	mutex_t mutex;
+	cond_t cond;
+	THREAD_T thread;
+	int stop;
+};
+
+#ifndef SHUT_RDWR
+#define SHUT_RDWR SD_BOTH
+#endif
+
+#define CDATA_FREE(x) if (x) { \
+	if ((x)->fd > 0) socket_close((x)->fd); \
+	if ((x)->sfd > 0) socket_close((x)->sfd); \
+	mapping_unref((x)->mapping); \
+	free((x)->udid); \
+	free(x); \
+}
+
+static uint64_t get_time_us(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000 + (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/**
+ * Returns the statistics entry for the device with the given UDID,
+ * creating it on first use. Entries are never freed so the returned
+ * pointer stays valid for the lifetime of the process.
+ */
+static struct stats_entry *device_stats_get(const char *udid)
+{
+	struct stats_entry *entry = NULL;
+
+	mutex_lock(&device_stats_mutex);
+	FOREACH(struct stats_entry *e, &device_stats) {
+		if (strcmp(e->label, udid) == 0) {
+			entry = e;
+			break;
+		}
+	} ENDFOREACH
+	if (!entry) {
+		entry = (struct stats_entry*)calloc(1, sizeof(struct stats_entry));
+		if (entry) {
+			entry->label = strdup(udid);
+			collection_add(&device_stats, entry);
+		}
+	}
+	mutex_unlock(&device_stats_mutex);
+
+	return entry;
+}
+
+static void stats_observe(uint64_t *hist, uint64_t elapsed)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+		if (elapsed <= latency_buckets[i]) {
+			break;
+		}
+	}
+	STAT_ADD(hist[i], 1);
+}
+
+static void stats_connect_done(struct relay_stats *stats, uint64_t elapsed, int success)
+{
+	stats_observe(stats->connect_hist, elapsed);
+	STAT_ADD(stats->connect_time_us, elapsed);
+	if (!success) {
+		STAT_ADD(stats->connect_failed, 1);
+	}
+}
+
+static void stats_queue_done(struct relay_stats *stats, uint64_t waited)
+{
+	stats_observe(stats->queue_hist, waited);
+	STAT_ADD(stats->queue_time_us, waited);
+}
+
+static void sleep_us(uint64_t us)
+{
+#ifdef _WIN32
+	Sleep((DWORD)((us + 999) / 1000));
+#else
+	struct timespec ts;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+#endif
+}
+
+static void rate_limit_set(struct rate_limit *rl, uint64_t rate)
+{
+	rl->rate = rate;
+	/* allow bursts of a quarter second, but at least one relay buffer */
+	rl->burst = (rate / 4 > 32768) ? rate / 4 : 32768;
+	rl->tokens = (int64_t)rl->burst;
+	rl->last = get_time_us();
+}
+
+static void rate_limit_init(struct rate_limit *rl, uint64_t rate)
+{
+	mutex_init(&rl->mutex);
+	rate_limit_set(rl, rate);
+}
+
+/**
+ * Takes len bytes from the token bucket and sleeps until the bucket would
+ * have been refilled enough to cover them.
+ *
+ * @return the time spent sleeping in microseconds.
+ */
+static uint64_t rate_limit_consume(struct rate_limit *rl, size_t len)
+{
+	uint64_t delay = 0;
+	uint64_t now;
+
+	if (rl->rate == 0 || len == 0) {
+		return 0;
+	}
+	mutex_lock(&rl->mutex);
+	now = get_time_us();
+	rl->tokens += (int64_t)((now - rl->last) * rl->rate / 1000000);
+	if (rl->tokens > (int64_t)rl->burst) {
+		rl->tokens = (int64_t)rl->burst;
+	}
+	rl->last = now;
+	rl->tokens -= (int64_t)len;
+	if (rl->tokens < 0) {
+		delay = (uint64_t)(-rl->tokens) * 1000000 / rl->rate;
+	}
+	mutex_unlock(&rl->mutex);
+
+	if (delay > 0) {
+		sleep_us(delay);
+	}
+	return delay;
+}
+
+static void gate_init(struct gate *g, unsigned int limit)
+{
+	memset(g, 0, sizeof(struct gate));
+	mutex_init(&g->mutex);
+	cond_init(&g->cond);
+	g->limit = limit;
+}
+
+static void gate_unlink(struct gate *g, struct gate_waiter *w)
+{
+	struct gate_waiter *prev = NULL;
+	struct gate_waiter *cur;
+
+	for (cur = g->head; cur; prev = cur, cur = cur->next) {
+		if (cur == w) {
+			if (prev) {
+				prev->next = w->next;
+			} else {
+				g->head = w->next;
+			}
+			if (g->tail == w) {
+				g->tail = prev;
+			}
+			break;
+		}
+	}
+}
+
+/**
+ * Enters the gate, waiting in line for a free slot if it is full. Waits
+ * are accounted to the given statistics; both may be NULL.
+ *
+ * @return 0 on success, or -1 if the wait queue is full or no slot became
+ *    free within queue_timeout seconds.
+ */
+static int gate_enter(struct gate *g, struct relay_stats *mstats, struct relay_stats *dstats)
+{
+	struct gate_waiter self;
+	uint64_t started;
+	uint64_t now;
+	int res = -1;
+
+	if (g->limit == 0) {
+		return 0;
+	}
+	mutex_lock(&g->mutex);
+	if (!g->head && g->inside < g->limit) {
+		g->inside++;
+		mutex_unlock(&g->mutex);
+		return 0;
+	}
+	if (g->waiting >= queue_limit) {
+		mutex_unlock(&g->mutex);
+		if (mstats) {
+			STAT_ADD(mstats->rejected, 1);
+		}
+		if (dstats) {
+			STAT_ADD(dstats->rejected, 1);
+		}
+		return -1;
+	}
+
+	self.next = NULL;
+	if (g->tail) {
+		g->tail->next = &self;
+	} else {
+		g->head = &self;
+	}
+	g->tail = &self;
+	g->waiting++;
+	if (mstats) {
+		STAT_ADD(mstats->queued, 1);
+		STAT_ADD(mstats->queue_len, 1);
+	}
+	if (dstats) {
+		STAT_ADD(dstats->queued, 1);
+		STAT_ADD(dstats->queue_len, 1);
+	}
+
+	started = get_time_us();
+	while (1) {
+		if (g->head == &self && g->inside < g->limit) {
+			g->inside++;
+			res = 0;
+			break;
+		}
+		now = get_time_us();
+		if (queue_timeout == 0) {
+			cond_wait(&g->cond, &g->mutex);
+		} else if (now - started < (uint64_t)queue_timeout * 1000000) {
+			cond_wait_timeout(&g->cond, &g->mutex, (unsigned int)(((uint64_t)queue_timeout * 1000000 - (now - started)) / 1000) + 1);
+		} else {
+			break;
+		}
+	}
+	gate_unlink(g, &self);
+	g->waiting--;
+	/* the next in line might be able to enter now */
+	cond_broadcast(&g->cond);
+	mutex_unlock(&g->mutex);
+
+	now = get_time_us();
+	if (mstats) {
+		STAT_SUB(mstats->queue_len, 1);
+	}
+	if (dstats) {
+		STAT_SUB(dstats->queue_len, 1);
+	}
+	if (res == 0) {
+		if (mstats) {
+			stats_queue_done(mstats, now - started);
+		}
+		if (dstats) {
+			stats_queue_done(dstats, now - started);
+		}
+	} else {
+		if (mstats) {
+			STAT_ADD(mstats->rejected, 1);
+		}
+		if (dstats) {
+			STAT_ADD(dstats->rejected, 1);
+		}
+	}
+
+	return res;
+}
+
+static void gate_leave(struct gate *g)
+{
+	if (g->limit == 0) {
+		return;
+	}
+	mutex_lock(&g->mutex);
+	g->inside--;
+	cond_broadcast(&g->cond);
+	mutex_unlock(&g->mutex);
+}
+
+/**
+ * Returns the scheduler for the device with the given UDID, creating it
+ * on first use. Like the statistics entries schedulers are never freed.
+ */
+static struct device_sched *device_sched_get(const char *udid)
+{
+	struct device_sched *sched = NULL;
+	int i;
+
+	mutex_lock(&device_scheds_mutex);
+	FOREACH(struct device_sched *e, &device_scheds) {
+		if (strcmp(e->udid, udid) == 0) {
+			sched = e;
+			break;
+		}
+	} ENDFOREACH
+	if (!sched) {
+		sched = (struct device_sched*)calloc(1, sizeof(struct device_sched));
+		if (sched) {
+			sched->udid = strdup(udid);
+			for (i = 0; i < 2; i++) {
+				mutex_init(&sched->queue[i].mutex);
+				cond_init(&sched->queue[i].cond);
+			}
+			rate_limit_init(&sched->limit, device_rate);
+			gate_init(&sched->relays, max_device_relays);
+			collection_add(&device_scheds, sched);
+		}
+	}
+	mutex_unlock(&device_scheds_mutex);
+
+	return sched;
+}
+
+static void sched_enqueue(struct sched_queue *q, struct sched_flow *f)
+{
+	f->next = NULL;
+	if (q->tail) {
+		q->tail->next = f;
+	} else {
+		q->head = f;
+	}
+	q->tail = f;
+}
+
+/**
+ * Hands the queue to the next waiting flow in round-robin order. Flows
+ * that are not waiting when their turn comes have nothing to send and
+ * leave the rotation, losing their deficit. Must be called with the queue
+ * mutex held.
+ */
+static void sched_dispatch(struct sched_queue *q)
+{
+	while (!q->busy && q->head) {
+		struct sched_flow *f = q->head;
+		q->head = f->next;
+		if (!q->head) {
+			q->tail = NULL;
+		}
+		if (!f->waiting) {
+			f->queued = 0;
+			f->deficit = 0;
+			continue;
+		}
+		f->deficit += (size_t)SCHED_QUANTUM * f->weight;
+		f->granted = (f->deficit < f->want) ? f->deficit : f->want;
+		f->deficit -= f->granted;
+		f->waiting = 0;
+		sched_enqueue(q, f);
+		q->busy = 1;
+		cond_broadcast(&q->cond);
+	}
+}
+
+/**
+ * Waits for the turn of the given flow.
+ *
+ * @return the number of bytes the flow may transfer, at most max.
+ */
+static size_t sched_acquire(struct sched_flow *f, size_t max)
+{
+	struct sched_queue *q = f->queue;
+
+	mutex_lock(&q->mutex);
+	f->want = max;
+	f->waiting = 1;
+	if (!f->queued) {
+		f->queued = 1;
+		sched_enqueue(q, f);
+	}
+	sched_dispatch(q);
+	while (f->waiting) {
+		cond_wait(&q->cond, &q->mutex);
+	}
+	mutex_unlock(&q->mutex);
+
+	return f->granted;
+}
+
+/**
+ * Ends the transfer of a flow. Bytes granted but not used are credited
+ * back to its deficit.
+ */
+static void sched_release(struct sched_flow *f, size_t used)
+{
+	struct sched_queue *q = f->queue;
+
+	mutex_lock(&q->mutex);
+	if (used < f->granted) {
+		f->deficit += f->granted - used;
+		if (f->deficit > f->want) {
+			f->deficit = f->want;
+		}
+	}
+	q->busy = 0;
+	sched_dispatch(q);
+	mutex_unlock(&q->mutex);
+}
+
+/**
+ * Removes a flow from the rotation of its queue.
+ */
+static void sched_leave(struct sched_flow *f)
+{
+	struct sched_queue *q = f->queue;
+	struct sched_flow *prev = NULL;
+	struct sched_flow *cur;
+
+	mutex_lock(&q->mutex);
+	for (cur = q->head; cur; prev = cur, cur = cur->next) {
+		if (cur == f) {
+			if (prev) {
+				prev->next = f->next;
+			} else {
+				q->head = f->next;
+			}
+			if (q->tail == f) {
+				q->tail = prev;
+			}
+			break;
+		}
+	}
+	f->queued = 0;
+	mutex_unlock(&q->mutex);
+}
+
+/**
+ * Attaches the statistics entry and scheduler of the device with the
+ * given UDID to a client and waits until the device has room for another
+ * relay.
+ *
+ * @return 0 on success, -1 if the client has to be rejected.
+ */
+static int client_set_device(struct client_data *cdata, const char *udid)
+{
+	cdata->device = device_stats_get(udid);
+	if (cdata->device) {
+		STAT_ADD(cdata->device->stats.accepted, 1);
+	}
+	cdata->sched = device_sched_get(udid);
+	if (!cdata->sched) {
+		return 0;
+	}
+	if (gate_enter(&cdata->sched->relays, &cdata->mapping->stats.stats, (cdata->device) ? &cdata->device->stats : NULL) < 0) {
+		printf("Too many connections to device %s, disconnecting client.\n", udid);
+		return -1;
+	}
+	cdata->device_gate = &cdata->sched->relays;
+
+	return 0;
+}
+
+#define PROXY_REQUEST_MAX 8192
+#define PROXY_TIMEOUT 5000
+
+enum proxy_proto {
+	PROXY_PROTO_HTTP = 1,
+	PROXY_PROTO_SOCKS5
+};
+
+/* SOCKS5 reply codes (RFC 1928) */
+#define SOCKS5_REP_SUCCESS 0x00
+#define SOCKS5_REP_FAILURE 0x01
+#define SOCKS5_REP_HOST_UNREACHABLE 0x04
+#define SOCKS5_REP_CONN_REFUSED 0x05
+#define SOCKS5_REP_CMD_NOT_SUPPORTED 0x07
+#define SOCKS5_REP_ATYP_NOT_SUPPORTED 0x08
+
+static int receive_exact(int fd, void *buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		int r = socket_receive_timeout(fd, (char*)buf + done, len - done, 0, PROXY_TIMEOUT);
+		if (r <= 0) {
+			return -1;
+		}
+		done += r;
+	}
+	return 0;
+}
+
+static int send_all(int fd, const void *buf, size_t len)
+{
+	size_t sent = 0;
+	while (sent < len) {
+		int s = socket_send(fd, (char*)buf + sent, len - sent);
+		if (s <= 0) {
+			return -1;
+		}
+		sent += s;
+	}
+	return 0;
+}
+
+/**
+ * Shuts down the connections of all relays to the device with the given
+ * handle, which makes their threads finish right away.
+ *
+ * @return the number of relays affected.
+ */
+static int relays_close_device(uint32_t handle)
+{
+	int count = 0;
+
+	mutex_lock(&relays_mutex);
+	FOREACH(struct client_data *cdata, &relays) {
+		if (cdata->handle == handle) {
+			socket_shutdown(cdata->sfd, SHUT_RDWR);
+			socket_shutdown(cdata->fd, SHUT_RDWR);
+			count++;
+		}
+	} ENDFOREACH
+	mutex_unlock(&relays_mutex);
+
+	return count;
+}
+
+static usbmuxd_device_info_t *attached_find_handle(uint32_t handle)
+{
+	FOREACH(usbmuxd_device_info_t *dev, &attached_devices) {
+		if (dev->handle == handle) {
+			return dev;
+		}
+	} ENDFOREACH
+	return NULL;
+}
+
+/**
+ * Remembers that an event was seen for the device with the given handle
+ * while the list is being seeded. Must be called with attached_mutex held.
+ */
+static void attached_mark_seen(uint32_t handle)
+{
+	if (attached_seeding) {
+		collection_add(&attached_seen, (void*)(uintptr_t)handle);
+	}
+}
+
+static int attached_was_seen(uint32_t handle)
+{
+	FOREACH(void *h, &attached_seen) {
+		if ((uint32_t)(uintptr_t)h == handle) {
+			return 1;
+		}
+	} ENDFOREACH
+	return 0;
+}
+
+static void attached_add(const usbmuxd_device_info_t *device)
+{
+	mutex_lock(&attached_mutex);
+	attached_mark_seen(device->handle);
+	if (!attached_find_handle(device->handle)) {
+		usbmuxd_device_info_t *dev = (usbmuxd_device_info_t*)malloc(sizeof(usbmuxd_device_info_t));
+		if (dev) {
+			memcpy(dev, device, sizeof(usbmuxd_device_info_t));
+			collection_add(&attached_devices, dev);
+		}
+	}
+	cond_broadcast(&attached_cond);
+	mutex_unlock(&attached_mutex);
+}
+
+static void device_event_cb(const usbmuxd_event_t *event, void *user_data)
+{
+	if (event->event == UE_DEVICE_ADD) {
+		attached_add(&event->device);
+	} else if (event->event == UE_DEVICE_REMOVE) {
+		usbmuxd_device_info_t *dev;
+		int count;
+		mutex_lock(&attached_mutex);
+		attached_mark_seen(event->device.handle);
+		dev = attached_find_handle(event->device.handle);
+		if (dev) {
+			collection_remove(&attached_devices, dev);
+			free(dev);
+		}
+		mutex_unlock(&attached_mutex);
+		count = relays_close_device(event->device.handle);
+		if (count > 0) {
+			printf("Device %s was removed, closing %d connection(s)\n", event->device.udid, count);
+		}
+	}
+}
+
+/**
+ * Subscribes to device events and fills the list of attached devices.
+ */
+static void attached_init(void)
+{
+	usbmuxd_subscription_context_t ctx = NULL;
+	usbmuxd_device_info_t *dev_list = NULL;
+	int i;
+
+	collection_init(&attached_devices);
+	collection_init(&attached_seen);
+	mutex_init(&attached_mutex);
+	cond_init(&attached_cond);
+	collection_init(&relays);
+	mutex_init(&relays_mutex);
+
+	attached_seeding = 1;
+	if (usbmuxd_events_subscribe(&ctx, device_event_cb, NULL) != 0) {
+		fprintf(stderr, "WARNING: Could not subscribe to device events, querying usbmuxd for every client.\n");
+		attached_seeding = 0;
+		return;
+	}
+	/* events for devices that are already attached are delivered by the
+	 * monitor thread, so make sure they are known right away. The list
+	 * might be older than events handled in the meantime, so devices
+	 * that had an event keep the state the event gave them. */
+	if (usbmuxd_get_device_list(&dev_list) < 0) {
+		dev_list = NULL;
+	}
+	mutex_lock(&attached_mutex);
+	for (i = 0; dev_list && dev_list[i].handle > 0; i++) {
+		if (!attached_was_seen(dev_list[i].handle) && !attached_find_handle(dev_list[i].handle)) {
+			usbmuxd_device_info_t *dev = (usbmuxd_device_info_t*)malloc(sizeof(usbmuxd_device_info_t));
+			if (dev) {
+				memcpy(dev, &dev_list[i], sizeof(usbmuxd_device_info_t));
+				collection_add(&attached_devices, dev);
+			}
+		}
+	}
+	attached_seeding = 0;
+	collection_free(&attached_seen);
+	cond_broadcast(&attached_cond);
+	mutex_unlock(&attached_mutex);
+	free(dev_list);
+	events_active = 1;
+}
+
+/**
+ * Matches the attached devices like usbmuxd_get_device() and, for a NULL
+ * udid, like the device list loop in find_device(). Must be called with
+ * attached_mutex held.
+ */
+static int attached_match(const char *udid, enum usbmux_lookup_options lookup_opts, usbmuxd_device_info_t *device)
+{
+	usbmuxd_device_info_t *dev_usbmuxd = NULL;
+	usbmuxd_device_info_t *dev_network = NULL;
+	usbmuxd_device_info_t *dev = NULL;
+
+	FOREACH(usbmuxd_device_info_t *d, &attached_devices) {
+		if (udid && strcmp(udid, d->udid) != 0) {
+			continue;
+		}
+		if (!dev_usbmuxd && (lookup_opts & DEVICE_LOOKUP_USBMUX) && d->conn_type == CONNECTION_TYPE_USB) {
+			dev_usbmuxd = d;
+		} else if (!dev_network && (lookup_opts & DEVICE_LOOKUP_NETWORK) && d->conn_type == CONNECTION_TYPE_NETWORK) {
+			dev_network = d;
+		}
+		if (!udid && (dev_usbmuxd || dev_network)) {
+			break;
+		}
+	} ENDFOREACH
+
+	if (dev_usbmuxd && dev_network) {
+		dev = (lookup_opts & DEVICE_LOOKUP_PREFER_NETWORK) ? dev_network : dev_usbmuxd;
+	} else {
+		dev = (dev_usbmuxd) ? dev_usbmuxd : dev_network;
+	}
+	if (!dev) {
+		return 0;
+	}
+	memcpy(device, dev, sizeof(usbmuxd_device_info_t));
+
+	return 1;
+}
+
+/**
+ * Looks up the device to connect to. If udid is NULL the first device
+ * matching the lookup options is used. When device events are available
+ * and wait is not 0, waits up to wait seconds for the device to be
+ * attached.
+ *
+ * @return 1 if a device was found, 0 if not, or a negative value if the
+ *    device list could not be retrieved.
+ */
+static int find_device(const char *udid, enum usbmux_lookup_options lookup_opts, usbmuxd_device_info_t *device, unsigned int wait)
+{
+	usbmuxd_device_info_t *dev_list = NULL;
+	int count;
+	int i;
+
+	if (events_active) {
+		uint64_t deadline = get_time_us() + (uint64_t)wait * 1000000;
+		int found;
+		mutex_lock(&attached_mutex);
+		while (!(found = attached_match(udid, lookup_opts, device))) {
+			uint64_t now = get_time_us();
+			if (now >= deadline) {
+				break;
+			}
+			cond_wait_timeout(&attached_cond, &attached_mutex, (unsigned int)((deadline - now) / 1000) + 1);
+		}
+		mutex_unlock(&attached_mutex);
+		return found;
+	}
+
+	if (udid) {
+		return (usbmuxd_get_device(udid, device, lookup_opts) > 0) ? 1 : 0;
+	}
+
+	if ((count = usbmuxd_get_device_list(&dev_list)) < 0) {
+		free(dev_list);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if ((dev_list[i].conn_type == CONNECTION_TYPE_USB && (lookup_opts & DEVICE_LOOKUP_USBMUX))
+		 || (dev_list[i].conn_type == CONNECTION_TYPE_NETWORK && (lookup_opts & DEVICE_LOOKUP_NETWORK))) {
+			memcpy(device, &dev_list[i], sizeof(usbmuxd_device_info_t));
+			free(dev_list);
+			return 1;
+		}
+	}
+	free(dev_list);
+
+	return 0;
+}
+
+/**
+ * Opens a connection to the given port on the device, either through
+ * usbmuxd or directly to the network address of the device. Connections
+ * made to refill a warm pool are not accounted as client admissions.
+ *
+ * @return socket file descriptor, or a negative errno value on error.
+ */
+static int connect_device(struct stats_entry *mapping, struct stats_entry *device, usbmuxd_device_info_t *dev, uint16_t device_port, int refill)
+{
+	int sfd = -1;
+	uint64_t started;
+
+	/* keep usbmuxd from being flooded with connect requests */
+	if (refill) {
+		STAT_ADD(mapping->stats.pool_refills, 1);
+		if (gate_enter(&connect_gate, NULL, NULL) < 0) {
+			STAT_ADD(mapping->stats.pool_refills_rejected, 1);
+			return -EBUSY;
+		}
+	} else if (gate_enter(&connect_gate, &mapping->stats, (device) ? &device->stats : NULL) < 0) {
+		return -EBUSY;
+	}
+	started = get_time_us();
+
+	if (dev->conn_type == CONNECTION_TYPE_NETWORK) {
+		struct sockaddr_storage saddr_storage;
+		struct sockaddr* saddr = (struct sockaddr*)&saddr_storage;
+
+		if (dev->conn_data[1] == 0x02) { // AF_INET
+			saddr->sa_family = AF_INET;
+			memcpy(&saddr->sa_data[0], (uint8_t*)dev->conn_data+2, 14);
+		}
+		else if (dev->conn_data[1] == 0x1E) { //AF_INET6 (bsd)
+#ifdef AF_INET6
+			saddr->sa_family = AF_INET6;
+			/* copy the address and the host dependent scope id */
+			memcpy(&saddr->sa_data[0], (uint8_t*)dev->conn_data+2, 26);
+#else
+			fprintf(stderr, "ERROR: Got an IPv6 address but this system doesn't support IPv6\n");
+			sfd = -EAFNOSUPPORT;
+#endif
+		}
+		else {
+			fprintf(stderr, "Unsupported address family 0x%02x\n", dev->conn_data[1]);
+			sfd = -EAFNOSUPPORT;
+		}
+		if (sfd != -EAFNOSUPPORT) {
+			char addrtxt[48];
+			addrtxt[0] = '\0';
+			if (!socket_addr_to_string(saddr, addrtxt, sizeof(addrtxt))) {
+				fprintf(stderr, "Failed to convert network address: %d (%s)\n", errno, strerror(errno));
+			}
+			fprintf(stdout, "Requesting connection to NETWORK device %s (serial: %s), port %d\n", addrtxt, dev->udid, device_port);
+			sfd = socket_connect_addr(saddr, device_port);
+			if (sfd < 0) {
+				sfd = -errno;
+			}
+		}
+	} else if (dev->conn_type == CONNECTION_TYPE_USB) {
+		fprintf(stdout, "Requesting connection to USB device handle %d (serial: %s), port %d\n", dev->handle, dev->udid, device_port);
+
+		sfd = usbmuxd_connect(dev->handle, device_port);
+	}
+
+	uint64_t elapsed = get_time_us() - started;
+	gate_leave(&connect_gate);
+	stats_connect_done(&mapping->stats, elapsed, sfd >= 0);
+	if (device) {
+		stats_connect_done(&device->stats, elapsed, sfd >= 0);
+	}
+
+	return sfd;
+}
+
+/**
+ * Checks that a pooled connection has neither been closed by the device
+ * nor received any unsolicited data while it was waiting in the pool.
+ */
+static int socket_is_idle(int fd)
+{
+#ifdef _WIN32
+	fd_set rfds;
+	struct timeval tv = { 0, 0 };
+
+	FD_ZERO(&rfds);
+	FD_SET(fd, &rfds);
+	return (select(fd+1, &rfds, NULL, NULL, &tv) == 0);
+#else
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return (poll(&pfd, 1, 0) == 0);
+#endif
+}
+
+/**
+ * Checks without blocking if a client has closed its connection. Data
+ * the client already sent, like a proxy request, is left in place.
+ */
+static int client_hung_up(int fd)
+{
+	char c;
+
+	if (socket_is_idle(fd)) {
+		return 0;
+	}
+	return (recv(fd, &c, 1, MSG_PEEK) <= 0);
+}
+
+/**
+ * Keeps the pool filled with established device connections and replaces
+ * connections that have been idle for longer than the configured timeout.
+ */
+static void *pool_thread(void *arg)
+{
+	struct device_pool *pool = (struct device_pool*)arg;
+
+	mutex_lock(&pool->mutex);
+	while (!pool->stop) {
+		uint64_t now = get_time_us();
+		FOREACH(struct pool_conn *pc, &pool->conns) {
+			if (now - pc->created > pool->idle_timeout) {
+				collection_remove(&pool->conns, pc);
+				socket_close(pc->sfd);
+				free(pc);
+			}
+		} ENDFOREACH
+
+		if (collection_count(&pool->conns) < pool->size) {
+			usbmuxd_device_info_t muxdev;
+			struct pool_conn *pc = NULL;
+			mutex_unlock(&pool->mutex);
+			if (find_device(pool->udid, pool->lookup_opts, &muxdev, 0) > 0) {
+				int sfd = connect_device(pool->mapping, device_stats_get(muxdev.udid), &muxdev, pool->device_port, 1);
+				if (sfd >= 0) {
+					pc = (struct pool_conn*)malloc(sizeof(struct pool_conn));
+					pc->sfd = sfd;
+					pc->created = get_time_us();
+					pc->handle = muxdev.handle;
+					memcpy(pc->udid, muxdev.udid, sizeof(pc->udid));
+				}
+			}
+			mutex_lock(&pool->mutex);
+			if (pc) {
+				collection_add(&pool->conns, pc);
+				continue;
+			}
+			/* device not available, retry later */
+		}
+		cond_wait_timeout(&pool->cond, &pool->mutex, 1000);
+	}
+	FOREACH(struct pool_conn *pc, &pool->conns) {
+		collection_remove(&pool->conns, pc);
+		socket_close(pc->sfd);
+		free(pc);
+	} ENDFOREACH
+	mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+/**
+ * Takes an established connection out of the pool.
+ *
+ * @return socket file descriptor, or -1 if no usable connection is available.
+ */
+static int pool_take(struct device_pool *pool, uint32_t *handle, char *udid, size_t udid_size)
+{
+	int sfd = -1;
+
+	while (sfd < 0) {
+		struct pool_conn *taken = NULL;
+		mutex_lock(&pool->mutex);
+		FOREACH(struct pool_conn *pc, &pool->conns) {
+			if (!taken || pc->created > taken->created) {
+				taken = pc;
+			}
+		} ENDFOREACH
+		if (taken) {
+			collection_remove(&pool->conns, taken);
+		}
+		cond_signal(&pool->cond);
+		mutex_unlock(&pool->mutex);
+
+		if (!taken) {
+			break;
+		}
+		if (socket_is_idle(taken->sfd)) {
+			sfd = taken->sfd;
+			*handle = taken->handle;
+			snprintf(udid, udid_size, "%s", taken->udid);
+		} else {
+			socket_close(taken->sfd);
+		}
+		free(taken);
+	}
+
+	return sfd;
+}
+
+static struct device_pool *pool_new(struct stats_entry *mapping, const char *udid, enum usbmux_lookup_options lookup_opts, uint16_t device_port, int size, unsigned int idle_timeout)
+{
+	struct device_pool *pool = (struct device_pool*)calloc(1, sizeof(struct device_pool));
+	if (!pool) {
+		return NULL;
+	}
+	pool->mapping = mapping;
+	pool->udid = (udid) ? strdup(udid) : NULL;
+	pool->lookup_opts = lookup_opts;
+	pool->device_port = device_port;
+	pool->size = size;
+	pool->idle_timeout = (uint64_t)idle_timeout * 1000000;
+	collection_init(&pool->conns);
+	mutex_init(&pool->mutex);
+	cond_init(&pool->cond);
+	if (thread_new(&pool->thread, pool_thread, pool) != 0) {
+		fprintf(stderr, "ERROR: Failed to create pool thread for device port %d\n", device_port);
+		collection_free(&pool->conns);
+		mutex_destroy(&pool->mutex);
+		cond_destroy(&pool->cond);
+		free(pool->udid);
+		free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+/**
+ * Makes the pool thread close all idle connections and exit. Connections
+ * can no longer be taken from the pool afterwards.
+ */
+static void pool_stop(struct device_pool *pool)
+{
+	mutex_lock(&pool->mutex);
+	pool->stop = 1;
+	cond_signal(&pool->cond);
+	mutex_unlock(&pool->mutex);
+}
+
+static void pool_free(struct device_pool *pool)
+{
+	pool_stop(pool);
+	thread_join(pool->thread);
+	thread_free(pool->thread);
+	collection_free(&pool->conns);
+	mutex_destroy(&pool->mutex);
+	cond_destroy(&pool->cond);
+	free(pool->udid);
+	free(pool);
+}
+
+/*
+ * Mappings are reference counted: the mapping table holds one reference
+ * and every client accepted on the mapping holds another one, so a mapping
+ * removed by a configuration reload stays valid until its last relay ends.
+ */
+static struct mapping *mapping_ref(struct mapping *m)
+{
+	REF_INC(m->refs);
+	return m;
+}
+
+static void mapping_unref(struct mapping *m)
+{
+	if (!m || REF_DEC(m->refs) != 0) {
+		return;
+	}
+	if (m->pool) {
+		pool_free(m->pool);
+	}
+	mutex_destroy(&m->limit.mutex);
+	mutex_destroy(&m->admit_mutex);
+	free(m->acceptor_fds);
+	free(m->local_path);
+	free(m->udid);
+	free(m->stats.label);
+	free(m);
+}
+
+/**
+ * Disconnects clients that were taken out of a wait queue.
+ */
+static void clients_reject(struct client_data *list)
+{
+	while (list) {
+		struct client_data *cdata = list;
+		list = cdata->next;
+		printf("Client fd = %d waited too long for %s, disconnecting.\n", cdata->fd, cdata->mapping->stats.label);
+		STAT_ADD(cdata->mapping->stats.stats.rejected, 1);
+		CDATA_FREE(cdata);
+	}
+}
+
+/**
+ * Disconnects queued clients that closed their connection while waiting.
+ */
+static void clients_drop(struct client_data *list)
+{
+	while (list) {
+		struct client_data *cdata = list;
+		list = cdata->next;
+		printf("Client fd = %d left the queue of %s.\n", cdata->fd, cdata->mapping->stats.label);
+		STAT_ADD(cdata->mapping->stats.stats.abandoned, 1);
+		CDATA_FREE(cdata);
+	}
+}
+
+/**
+ * Takes the clients that closed their connection out of the wait queue
+ * of the mapping, so they neither hold a queue slot nor cost a device
+ * connection once admitted. Must be called with admit_mutex held.
+ *
+ * @param all check the whole queue instead of only its head
+ *
+ * @return the list of clients to pass to clients_drop() once the mutex
+ *    has been released.
+ */
+static struct client_data *mapping_queue_drop_gone(struct mapping *m, int all)
+{
+	struct client_data *gone = NULL;
+	struct client_data *prev = NULL;
+	struct client_data *cdata = m->queue_head;
+
+	while (cdata) {
+		struct client_data *next = cdata->next;
+		if (client_hung_up(cdata->fd)) {
+			if (prev) {
+				prev->next = next;
+			} else {
+				m->queue_head = next;
+			}
+			if (m->queue_tail == cdata) {
+				m->queue_tail = prev;
+			}
+			STAT_SUB(m->stats.stats.queue_len, 1);
+			cdata->next = gone;
+			gone = cdata;
+		} else if (!all) {
+			break;
+		} else {
+			prev = cdata;
+		}
+		cdata = next;
+	}
+
+	return gone;
+}
+
+/**
+ * Takes the clients that have been waiting for longer than queue_timeout
+ * out of the wait queue of the mapping. Must be called with admit_mutex
+ * held.
+ *
+ * @return the list of expired clients, to be passed to clients_reject()
+ *    once the mutex has been released.
+ */
+static struct client_data *mapping_queue_expire(struct mapping *m, uint64_t now)
+{
+	struct client_data *expired = NULL;
+	struct client_data **tail = &expired;
+
+	/* the queue is in arrival order, so only its head can be expired */
+	while (queue_timeout > 0 && m->queue_head && now - m->queue_head->queued_at >= (uint64_t)queue_timeout * 1000000) {
+		struct client_data *cdata = m->queue_head;
+		m->queue_head = cdata->next;
+		if (!m->queue_head) {
+			m->queue_tail = NULL;
+		}
+		STAT_SUB(m->stats.stats.queue_len, 1);
+		cdata->next = NULL;
+		*tail = cdata;
+		tail = &cdata->next;
+	}
+
+	return expired;
+}
+
+/**
+ * Decides if a newly accepted client of the mapping may be handled right
+ * away. If max_relays clients are being handled already it is appended to
+ * the wait queue of the mapping instead, without a thread of its own.
+ *
+ * @return 1 if the client may be started, 0 if it has been queued, or -1
+ *    if the queue is full.
+ */
+static int mapping_admit(struct mapping *m, struct client_data *cdata)
+{
+	struct client_data *expired;
+	int res;
+
+	mutex_lock(&m->admit_mutex);
+	expired = mapping_queue_expire(m, get_time_us());
+	if (m->max_relays == 0 || m->admitted < m->max_relays) {
+		m->admitted++;
+		res = 1;
+	} else if (STAT_GET(m->stats.stats.queue_len) < queue_limit) {
+		cdata->next = NULL;
+		cdata->queued_at = get_time_us();
+		if (m->queue_tail) {
+			m->queue_tail->next = cdata;
+		} else {
+			m->queue_head = cdata;
+		}
+		m->queue_tail = cdata;
+		STAT_ADD(m->stats.stats.queue_len, 1);
+		STAT_ADD(m->stats.stats.queued, 1);
+		res = 0;
+	} else {
+		STAT_ADD(m->stats.stats.rejected, 1);
+		res = -1;
+	}
+	mutex_unlock(&m->admit_mutex);
+	clients_reject(expired);
+
+	return res;
+}
+
+/**
+ * Gives back the slot of a client that has been handled and admits the
+ * next client waiting in the queue of the mapping, if any.
+ *
+ * @return the client to start in place of the finished one, or NULL.
+ */
+static struct client_data *mapping_release(struct mapping *m)
+{
+	struct client_data *expired;
+	struct client_data *gone;
+	struct client_data *next = NULL;
+	uint64_t now = get_time_us();
+
+	mutex_lock(&m->admit_mutex);
+	m->admitted--;
+	expired = mapping_queue_expire(m, now);
+	gone = mapping_queue_drop_gone(m, 0);
+	if (m->queue_head && (m->max_relays == 0 || m->admitted < m->max_relays)) {
+		next = m->queue_head;
+		m->queue_head = next->next;
+		if (!m->queue_head) {
+			m->queue_tail = NULL;
+		}
+		next->next = NULL;
+		m->admitted++;
+		STAT_SUB(m->stats.stats.queue_len, 1);
+		stats_queue_done(&m->stats.stats, now - next->queued_at);
+	}
+	mutex_unlock(&m->admit_mutex);
+	clients_reject(expired);
+	clients_drop(gone);
+
+	return next;
+}
+
+/**
+ * Disconnects the clients that waited too long in the queue of a mapping
+ * although no slot became free in the meantime, and those that went away.
+ */
+static void mapping_expire_queue(struct mapping *m)
+{
+	struct client_data *expired;
+	struct client_data *gone;
+
+	mutex_lock(&m->admit_mutex);
+	expired = mapping_queue_expire(m, get_time_us());
+	gone = mapping_queue_drop_gone(m, 1);
+	mutex_unlock(&m->admit_mutex);
+	clients_reject(expired);
+	clients_drop(gone);
+}
+
+/**
+ * Waits until the scheduler of the device grants a transfer to the flow.
+ * Without fair sharing the whole buffer may be used right away.
+ */
+static size_t relay_acquire(struct sched_flow *f, size_t max, struct relay_stats *mstats, struct relay_stats *dstats)
+{
+	uint64_t started;
+	uint64_t waited;
+
+	if (!f) {
+		return max;
+	}
+	started = get_time_us();
+	max = sched_acquire(f, max);
+	waited = get_time_us() - started;
+	STAT_ADD(mstats->sched_grants, 1);
+	STAT_ADD(mstats->sched_wait_us, waited);
+	if (dstats) {
+		STAT_ADD(dstats->sched_grants, 1);
+		STAT_ADD(dstats->sched_wait_us, waited);
+	}
+	return max;
+}
+
+static void relay_release(struct sched_flow *f, int used)
+{
+	if (f) {
+		sched_release(f, (used > 0) ? (size_t)used : 0);
+	}
+}
+
+/**
+ * Applies the rate caps of the mapping and the device after len bytes
+ * have been relayed.
+ */
+static void relay_throttle(struct client_data *cdata, size_t len, struct relay_stats *mstats, struct relay_stats *dstats)
+{
+	uint64_t delay = rate_limit_consume(&cdata->mapping->limit, len);
+	if (delay > 0) {
+		STAT_ADD(mstats->throttle_us, delay);
+	}
+	if (cdata->sched) {
+		delay = rate_limit_consume(&cdata->sched->limit, len);
+		if (delay > 0 && dstats) {
+			STAT_ADD(dstats->throttle_us, delay);
+		}
+	}
+}
+
+static void relay_stats_begin(struct relay_stats *mstats, struct relay_stats *dstats)
+{
+	STAT_ADD(mstats->active, 1);
+	if (dstats) {
+		STAT_ADD(dstats->active, 1);
+	}
+}
+
+static void relay_stats_end(struct relay_stats *mstats, struct relay_stats *dstats, uint64_t started)
+{
+	uint64_t elapsed = get_time_us() - started;
+
+	STAT_ADD(mstats->relay_time_us, elapsed);
+	STAT_SUB(mstats->active, 1);
+	if (dstats) {
+		STAT_ADD(dstats->relay_time_us, elapsed);
+		STAT_SUB(dstats->active, 1);
+	}
+}
+
+/**
+ * Copies data between the client and the device connection until one of
+ * both sides closes the connection.
+ */
+static void relay_data(struct client_data *cdata)
+{
+	char buffer[32768];
+	int fd = cdata->fd;
+	int sfd = cdata->sfd;
+	struct relay_stats *mstats = &cdata->mapping->stats.stats;
+	struct relay_stats *dstats = (cdata->device) ? &cdata->device->stats : NULL;
+	struct sched_flow flows[2];
+	struct sched_flow *to_device = NULL;
+	struct sched_flow *from_device = NULL;
+	uint64_t started = get_time_us();
+#ifdef _WIN32
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(fd, &fds);
+	FD_SET(sfd, &fds);
+	int maxfd = fd > sfd ? fd : sfd;
+#else
+	/* poll() has no upper limit on the fd number, unlike select() */
+	struct pollfd pfds[2];
+	pfds[0].fd = fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = sfd;
+	pfds[1].events = POLLIN;
+#endif
+
+	if (fair_share && cdata->sched) {
+		memset(flows, 0, sizeof(flows));
+		flows[SCHED_TO_DEVICE].queue = &cdata->sched->queue[SCHED_TO_DEVICE];
+		flows[SCHED_TO_DEVICE].weight = cdata->mapping->priority;
+		flows[SCHED_FROM_DEVICE].queue = &cdata->sched->queue[SCHED_FROM_DEVICE];
+		flows[SCHED_FROM_DEVICE].weight = cdata->mapping->priority;
+		to_device = &flows[SCHED_TO_DEVICE];
+		from_device = &flows[SCHED_FROM_DEVICE];
+	}
+
+	relay_stats_begin(mstats, dstats);
+
+	while (1) {
+#ifdef _WIN32
+		fd_set read_fds = fds;
+		int ret_sel = select(maxfd+1, &read_fds, NULL, NULL, NULL);
+		if (ret_sel < 0) {
+			perror("select");
+			break;
+		}
+		int client_ready = FD_ISSET(fd, &read_fds);
+		int device_ready = FD_ISSET(sfd, &read_fds);
+#else
+		int ret_poll = poll(pfds, 2, -1);
+		if (ret_poll < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("poll");
+			break;
+		}
+		int client_ready = pfds[0].revents & (POLLIN | POLLHUP | POLLERR);
+		int device_ready = pfds[1].revents & (POLLIN | POLLHUP | POLLERR);
+#endif
+		if (client_ready) {
+			/* the grant only sizes the read, so a stalled device write
+			 * does not hold up the other relays of the device */
+			size_t max = relay_acquire(to_device, sizeof(buffer), mstats, dstats);
+			int r = socket_receive_timeout(fd, buffer, max, 0, 100);
+			relay_release(to_device, r);
+			if (r <= 0) {
+				break;
+			}
+			if (send_all(sfd, buffer, r) < 0) {
+				break;
+			}
+			STAT_ADD(mstats->bytes_to_device, r);
+			if (dstats) {
+				STAT_ADD(dstats->bytes_to_device, r);
+			}
+			relay_throttle(cdata, r, mstats, dstats);
+		}
+		if (device_ready) {
+			/* likewise for a slow client */
+			size_t max = relay_acquire(from_device, sizeof(buffer), mstats, dstats);
+			int r = socket_receive_timeout(sfd, buffer, max, 0, 100);
+			relay_release(from_device, r);
+			if (r <= 0) {
+				break;
+			}
+			if (send_all(fd, buffer, r) < 0) {
+				break;
+			}
+			STAT_ADD(mstats->bytes_from_device, r);
+			if (dstats) {
+				STAT_ADD(dstats->bytes_from_device, r);
+			}
+			relay_throttle(cdata, r, mstats, dstats);
+		}
+	}
+
+	if (to_device) {
+		sched_leave(to_device);
+		sched_leave(from_device);
+	}
+
+	relay_stats_end(mstats, dstats, started);
+}
+
+/**
+ * Parses a SOCKS5 greeting and CONNECT request. The requested host name
+ * is interpreted as device UDID.
+ *
+ * @return 0 on success, or a SOCKS5 reply code that should be sent to the
+ *    client, or -1 if the connection should be dropped silently.
+ */
+static int socks5_read_request(int fd, char **udid, uint16_t *port)
+{
+	unsigned char buf[262];
+	unsigned char nmethods;
+	int i;
+	int noauth = 0;
+
+	if (receive_exact(fd, &nmethods, 1) < 0 || nmethods == 0) {
+		return -1;
+	}
+	if (receive_exact(fd, buf, nmethods) < 0) {
+		return -1;
+	}
+	for (i = 0; i < nmethods; i++) {
+		if (buf[i] == 0x00) {
+			noauth = 1;
+			break;
+		}
+	}
+	buf[0] = 0x05;
+	buf[1] = (noauth) ? 0x00 : 0xFF;
+	if (send_all(fd, buf, 2) < 0 || !noauth) {
+		return -1;
+	}
+
+	/* VER CMD RSV ATYP */
+	if (receive_exact(fd, buf, 4) < 0 || buf[0] != 0x05) {
+		return -1;
+	}
+	if (buf[1] != 0x01) {
+		return SOCKS5_REP_CMD_NOT_SUPPORTED;
+	}
+	if (buf[3] != 0x03) {
+		/* only domain names can carry a UDID */
+		return SOCKS5_REP_ATYP_NOT_SUPPORTED;
+	}
+	if (receive_exact(fd, buf, 1) < 0 || buf[0] == 0) {
+		return -1;
+	}
+	size_t hlen = buf[0];
+	if (receive_exact(fd, buf, hlen + 2) < 0) {
+		return -1;
+	}
+	*port = (buf[hlen] << 8) | buf[hlen+1];
+	buf[hlen] = '\0';
+	*udid = strdup((char*)buf);
+
+	return SOCKS5_REP_SUCCESS;
+}
+
+static void socks5_send_reply(int fd, unsigned char rep)
+{
+	unsigned char reply[10] = { 0x05, rep, 0x00, 0x01, 0, 0, 0, 0, 0, 0 };
+	send_all(fd, reply, sizeof(reply));
+}
+
+/**
+ * Reads an HTTP CONNECT request in the form 'CONNECT <udid>:<port> HTTP/1.x'.
+ * Any data following the request header is returned in extra.
+ *
+ * @return 0 on success, or an HTTP status code on error (500 if the extra
+ *    data could not be stored), or -1 if the connection should be dropped
+ *    silently.
+ */
+static int http_read_request(int fd, char first, char **udid, uint16_t *port, char **extra, size_t *extra_len)
+{
+	char *buf = (char*)malloc(PROXY_REQUEST_MAX + 1);
+	size_t len = 1;
+	char *hdr_end = NULL;
+
+	if (!buf) {
+		return -1;
+	}
+	buf[0] = first;
+	while (!hdr_end) {
+		if (len >= PROXY_REQUEST_MAX) {
+			free(buf);
+			return 431;
+		}
+		int r = socket_receive_timeout(fd, buf + len, PROXY_REQUEST_MAX - len, 0, PROXY_TIMEOUT);
+		if (r <= 0) {
+			free(buf);
+			return -1;
+		}
+		len += r;
+		buf[len] = '\0';
+		hdr_end = strstr(buf, "\r\n\r\n");
+	}
+
+	int status = 400;
+	char *target = NULL;
+	if (strncmp(buf, "CONNECT ", 8) == 0) {
+		target = buf + 8;
+		char *end = strchr(target, ' ');
+		if (end && end < hdr_end) {
+			*end = '\0';
+			char *colon = strrchr(target, ':');
+			if (colon && colon > target) {
+				char *endp = NULL;
+				long l_port = strtol(colon+1, &endp, 10);
+				if (endp && *endp == '\0' && l_port > 0 && l_port < 65536) {
+					*colon = '\0';
+					*udid = strdup(target);
+					*port = (uint16_t)l_port;
+					status = 0;
+				}
+			}
+		}
+	} else {
+		status = 405;
+	}
+
+	hdr_end += 4;
+	*extra_len = len - (hdr_end - buf);
+	if (status == 0 && *extra_len > 0) {
+		*extra = (char*)malloc(*extra_len);
+		if (*extra) {
+			memcpy(*extra, hdr_end, *extra_len);
+		} else {
+			*extra_len = 0;
+			status = 500;
+		}
+	}
+	free(buf);
+
+	return status;
+}
+
+static void http_send_status(int fd, int status)
+{
+	char resp[128];
+	const char *reason;
+
+	switch (status) {
+	case 200:
+		reason = "Connection established";
+		break;
+	case 404:
+		reason = "Device not found";
+		break;
+	case 405:
+		reason = "Method not allowed";
+		break;
+	case 431:
+		reason = "Request header fields too large";
+		break;
+	case 500:
+		reason = "Internal server error";
+		break;
+	case 502:
+		reason = "Bad gateway";
+		break;
+	case 503:
+		reason = "Service unavailable";
+		break;
+	default:
+		status = 400;
+		reason = "Bad request";
+		break;
+	}
+	snprintf(resp, sizeof(resp), "HTTP/1.1 %d %s\r\n%s\r\n", status, reason, (status == 200) ? "" : "Content-Length: 0\r\nConnection: close\r\n");
+	send_all(fd, resp, strlen(resp));
+}
+
+/**
+ * Handles a client on the proxy port: reads the HTTP CONNECT or SOCKS5
+ * request, connects to the device given by the requested host name and
+ * sends the appropriate reply.
+ *
+ * @return 0 if the device connection has been established and the
+ *    streams are ready to be relayed, -1 otherwise.
+ */
+static int proxy_handshake(struct client_data *cdata)
+{
+	usbmuxd_device_info_t muxdev;
+	enum proxy_proto proto;
+	char first = 0;
+	char *extra = NULL;
+	size_t extra_len = 0;
+	int res;
+
+	if (receive_exact(cdata->fd, &first, 1) < 0) {
+		return -1;
+	}
+	if (first == 0x05) {
+		proto = PROXY_PROTO_SOCKS5;
+		res = socks5_read_request(cdata->fd, &cdata->udid, &cdata->device_port);
+		if (res != SOCKS5_REP_SUCCESS) {
+			if (res > 0) {
+				socks5_send_reply(cdata->fd, (unsigned char)res);
+			}
+			return -1;
+		}
+	} else {
+		proto = PROXY_PROTO_HTTP;
+		res = http_read_request(cdata->fd, first, &cdata->udid, &cdata->device_port, &extra, &extra_len);
+		if (res != 0) {
+			if (res > 0) {
+				http_send_status(cdata->fd, res);
+			}
+			return -1;
+		}
+	}
+
+	printf("Proxy request (%s) for device %s port %d\n", (proto == PROXY_PROTO_HTTP) ? "HTTP" : "SOCKS5", cdata->udid, cdata->device_port);
+
+	res = find_device(cdata->udid, cdata->lookup_opts, &muxdev, device_wait);
+	if (res <= 0) {
+		printf("No connected/matching device found for %s, disconnecting client.\n", cdata->udid);
+		STAT_ADD(cdata->mapping->stats.stats.connect_failed, 1);
+		if (proto == PROXY_PROTO_HTTP) {
+			http_send_status(cdata->fd, 404);
+		} else {
+			socks5_send_reply(cdata->fd, SOCKS5_REP_HOST_UNREACHABLE);
+		}
+		free(extra);
+		return -1;
+	}
+
+	if (client_set_device(cdata, muxdev.udid) < 0) {
+		if (proto == PROXY_PROTO_HTTP) {
+			http_send_status(cdata->fd, 503);
+		} else {
+			socks5_send_reply(cdata->fd, SOCKS5_REP_FAILURE);
+		}
+		free(extra);
+		return -1;
+	}
+	cdata->handle = muxdev.handle;
+	cdata->sfd = connect_device(&cdata->mapping->stats, cdata->device, &muxdev, cdata->device_port, 0);
+	if (cdata->sfd < 0) {
+		fprintf(stderr, "Error connecting to device: %s\n", strerror(-cdata->sfd));
+		if (proto == PROXY_PROTO_HTTP) {
+			http_send_status(cdata->fd, (cdata->sfd == -EBUSY) ? 503 : 502);
+		} else {
+			socks5_send_reply(cdata->fd, (cdata->sfd == -ECONNREFUSED) ? SOCKS5_REP_CONN_REFUSED : SOCKS5_REP_FAILURE);
+		}
+		free(extra);
+		return -1;
+	}
+
+	if (proto == PROXY_PROTO_HTTP) {
+		http_send_status(cdata->fd, 200);
+	} else {
+		socks5_send_reply(cdata->fd, SOCKS5_REP_SUCCESS);
+	}
+	if (extra) {
+		res = send_all(cdata->sfd, extra, extra_len);
+		free(extra);
+		if (res < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void *acceptor_thread(void *arg);
+
+/**
+ * Frees a client that has been admitted to its mapping.
+ *
+ * @return the next client of the mapping that may be started, or NULL.
+ */
+static struct client_data *client_release(struct client_data *cdata)
+{
+	struct client_data *next = mapping_release(cdata->mapping);
+
+	if (cdata->device_gate) {
+		gate_leave(cdata->device_gate);
+	}
+	CDATA_FREE(cdata);
+
+	return next;
+}
+
+/**
+ * Starts the thread handling an admitted client.
+ */
+static void client_start(struct client_data *cdata)
+{
+	while (cdata) {
+		THREAD_T acceptor = THREAD_T_NULL;
+		if (thread_new(&acceptor, acceptor_thread, cdata) == 0) {
+			thread_detach(acceptor);
+			return;
+		}
+		fprintf(stderr, "ERROR: Failed to created acceptor thread!\n");
+		cdata = client_release(cdata);
+	}
+}
+
+static void client_done(struct client_data *cdata)
+{
+	client_start(client_release(cdata));
+}
+
+/**
+ * Finishes a client after its relay ended.
+ */
+static void relay_finish(struct client_data *cdata)
+{
+	mutex_lock(&relays_mutex);
+	collection_remove(&relays, cdata);
+	mutex_unlock(&relays_mutex);
+
+	client_done(cdata);
+}
+
+#ifdef HAVE_LIBURING
+/*
+ * With --io-uring established relays are handed over to a single thread
+ * that drives all of them through one io_uring instead of keeping a thread
+ * per relay blocked in poll(). Each direction of a relay reads into a
+ * buffer registered with the ring and writes it out to the other side
+ * before the next read is submitted, so there is at most one request per
+ * direction in flight. Relays that are subject to fair sharing or a rate
+ * cap need to wait between transfers and stay on their own thread.
+ */
+#define URING_ENTRIES 1024
+#define URING_NUM_BUFFERS 128
+#define URING_BUFFER_SIZE 32768
+
+struct uring_relay;
+
+struct uring_dir {
+	struct uring_relay *relay;
+	int from;
+	int to;
+	int to_device;
+	char *buf;
+	int buf_index;
+	int writing;
+	size_t len;
+	size_t off;
+};
+
+struct uring_relay {
+	struct client_data *cdata;
+	struct uring_dir dir[2];
+	int inflight;
+	int closing;
+	uint64_t started;
+	struct uring_relay *next;
+};
+
+static int use_uring = 0;
+static int uring_active = 0;
+static struct io_uring uring;
+static int uring_eventfd = -1;
+static uint64_t uring_eventfd_value;
+static char *uring_buffers = NULL;
+/* indices of the registered buffers not in use, only touched by the ring thread */
+static int uring_free_buffers[URING_NUM_BUFFERS];
+static int uring_num_free = 0;
+/* relays handed over to the ring thread that have not been started yet */
+static struct uring_relay *uring_pending = NULL;
+static mutex_t uring_mutex;
+/* clients whose relay ended; finishing them can block, e.g. on joining the
+ * pool thread of a mapping, so it is left to a thread of its own */
+static struct client_data *uring_finished = NULL;
+static cond_t uring_finished_cond;
+
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&uring);
+	while (!sqe) {
+		/* the submission queue is full, hand it to the kernel */
+		io_uring_submit(&uring);
+		sqe = io_uring_get_sqe(&uring);
+	}
+	return sqe;
+}
+
+static void uring_submit_io(struct uring_dir *d)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	if (d->writing) {
+		if (d->buf_index >= 0) {
+			io_uring_prep_write_fixed(sqe, d->to, d->buf + d->off, (unsigned int)(d->len - d->off), 0, d->buf_index);
+		} else {
+			io_uring_prep_send(sqe, d->to, d->buf + d->off, d->len - d->off, MSG_NOSIGNAL);
+		}
+	} else {
+		if (d->buf_index >= 0) {
+			io_uring_prep_read_fixed(sqe, d->from, d->buf, URING_BUFFER_SIZE, 0, d->buf_index);
+		} else {
+			io_uring_prep_recv(sqe, d->from, d->buf, URING_BUFFER_SIZE, 0);
+		}
+	}
+	io_uring_sqe_set_data(sqe, d);
+	d->relay->inflight++;
+}
+
+static void uring_relay_end(struct uring_relay *r)
+{
+	struct client_data *cdata = r->cdata;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (r->dir[i].buf_index >= 0) {
+			uring_free_buffers[uring_num_free++] = r->dir[i].buf_index;
+		} else {
+			free(r->dir[i].buf);
+		}
+	}
+	relay_stats_end(&cdata->mapping->stats.stats, (cdata->device) ? &cdata->device->stats : NULL, r->started);
+	free(r);
+
+	mutex_lock(&uring_mutex);
+	cdata->next = uring_finished;
+	uring_finished = cdata;
+	cond_signal(&uring_finished_cond);
+	mutex_unlock(&uring_mutex);
+}
+
+/**
+ * Ends the relay once both directions have no request in flight anymore.
+ * Shutting down the sockets makes pending requests complete right away.
+ */
+static void uring_relay_close(struct uring_relay *r)
+{
+	if (!r->closing) {
+		r->closing = 1;
+		socket_shutdown(r->cdata->fd, SHUT_RDWR);
+		socket_shutdown(r->cdata->sfd, SHUT_RDWR);
+	}
+	if (r->inflight == 0) {
+		uring_relay_end(r);
+	}
+}
+
+static void uring_relay_begin(struct uring_relay *r)
+{
+	struct client_data *cdata = r->cdata;
+	int i;
+
+	r->started = get_time_us();
+	relay_stats_begin(&cdata->mapping->stats.stats, (cdata->device) ? &cdata->device->stats : NULL);
+	for (i = 0; i < 2; i++) {
+		struct uring_dir *d = &r->dir[i];
+		d->relay = r;
+		d->to_device = (i == 0);
+		d->from = (d->to_device) ? cdata->fd : cdata->sfd;
+		d->to = (d->to_device) ? cdata->sfd : cdata->fd;
+		if (uring_num_free > 0) {
+			d->buf_index = uring_free_buffers[--uring_num_free];
+			d->buf = uring_buffers + (size_t)d->buf_index * URING_BUFFER_SIZE;
+		} else {
+			d->buf_index = -1;
+			d->buf = (char*)malloc(URING_BUFFER_SIZE);
+		}
+	}
+	if (!r->dir[0].buf || !r->dir[1].buf) {
+		uring_relay_close(r);
+		return;
+	}
+	for (i = 0; i < 2; i++) {
+		uring_submit_io(&r->dir[i]);
+	}
+}
+
+static void uring_complete(struct uring_dir *d, int res)
+{
+	struct uring_relay *r = d->relay;
+	struct client_data *cdata = r->cdata;
+
+	r->inflight--;
+	if (res <= 0 || r->closing) {
+		uring_relay_close(r);
+		return;
+	}
+	if (d->writing) {
+		d->off += res;
+		if (d->off >= d->len) {
+			d->writing = 0;
+		}
+	} else {
+		if (d->to_device) {
+			STAT_ADD(cdata->mapping->stats.stats.bytes_to_device, res);
+			if (cdata->device) {
+				STAT_ADD(cdata->device->stats.bytes_to_device, res);
+			}
+		} else {
+			STAT_ADD(cdata->mapping->stats.stats.bytes_from_device, res);
+			if (cdata->device) {
+				STAT_ADD(cdata->device->stats.bytes_from_device, res);
+			}
+		}
+		d->len = res;
+		d->off = 0;
+		d->writing = 1;
+	}
+	uring_submit_io(d);
+}
+
+static void uring_arm_eventfd(void)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+	io_uring_prep_read(sqe, uring_eventfd, &uring_eventfd_value, sizeof(uring_eventfd_value), 0);
+	io_uring_sqe_set_data(sqe, NULL);
+}
+
+static void *uring_loop_thread(void *arg)
+{
+	struct io_uring_cqe *cqe;
+
+	uring_arm_eventfd();
+	while (1) {
+		int res = io_uring_submit_and_wait(&uring, 1);
+		if (res < 0 && res != -EINTR) {
+			fprintf(stderr, "io_uring: %s\n", strerror(-res));
+			break;
+		}
+		while (io_uring_peek_cqe(&uring, &cqe) == 0) {
+			struct uring_dir *d = (struct uring_dir*)io_uring_cqe_get_data(cqe);
+			res = cqe->res;
+			io_uring_cqe_seen(&uring, cqe);
+			if (d) {
+				uring_complete(d, res);
+			} else {
+				/* new relays have been handed over */
+				struct uring_relay *r;
+				mutex_lock(&uring_mutex);
+				r = uring_pending;
+				uring_pending = NULL;
+				mutex_unlock(&uring_mutex);
+				while (r) {
+					struct uring_relay *next = r->next;
+					uring_relay_begin(r);
+					r = next;
+				}
+				uring_arm_eventfd();
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static void *uring_teardown_thread(void *arg)
+{
+	mutex_lock(&uring_mutex);
+	while (1) {
+		struct client_data *list;
+		while (!uring_finished) {
+			cond_wait(&uring_finished_cond, &uring_mutex);
+		}
+		list = uring_finished;
+		uring_finished = NULL;
+		mutex_unlock(&uring_mutex);
+		while (list) {
+			struct client_data *cdata = list;
+			list = cdata->next;
+			cdata->next = NULL;
+			relay_finish(cdata);
+		}
+		mutex_lock(&uring_mutex);
+	}
+
+	return NULL;
+}
+
+/**
+ * Sets up the ring, registers the relay buffers with it and starts the
+ * threads serving it and finishing its relays. Registering the buffers is optional; without them
+ * plain recv and send requests are used.
+ *
+ * @return 0 on success, -1 on error with errno set.
+ */
+static int uring_init(void)
+{
+	struct iovec iov[URING_NUM_BUFFERS];
+	THREAD_T thread = THREAD_T_NULL;
+	int res;
+	int i;
+
+	res = io_uring_queue_init(URING_ENTRIES, &uring, 0);
+	if (res < 0) {
+		errno = -res;
+		return -1;
+	}
+	uring_eventfd = eventfd(0, EFD_CLOEXEC);
+	if (uring_eventfd < 0) {
+		res = errno;
+		io_uring_queue_exit(&uring);
+		errno = res;
+		return -1;
+	}
+	uring_buffers = (char*)malloc((size_t)URING_NUM_BUFFERS * URING_BUFFER_SIZE);
+	if (uring_buffers) {
+		for (i = 0; i < URING_NUM_BUFFERS; i++) {
+			iov[i].iov_base = uring_buffers + (size_t)i * URING_BUFFER_SIZE;
+			iov[i].iov_len = URING_BUFFER_SIZE;
+			uring_free_buffers[i] = URING_NUM_BUFFERS - 1 - i;
+		}
+		res = io_uring_register_buffers(&uring, iov, URING_NUM_BUFFERS);
+		if (res < 0) {
+			/* most likely RLIMIT_MEMLOCK is too low */
+			fprintf(stderr, "WARNING: Could not register io_uring buffers: %s\n", strerror(-res));
+			free(uring_buffers);
+			uring_buffers = NULL;
+		} else {
+			uring_num_free = URING_NUM_BUFFERS;
+		}
+	}
+	mutex_init(&uring_mutex);
+	cond_init(&uring_finished_cond);
+	if (thread_new(&thread, uring_teardown_thread, NULL) != 0) {
+		io_uring_queue_exit(&uring);
+		close(uring_eventfd);
+		errno = EAGAIN;
+		return -1;
+	}
+	thread_detach(thread);
+	if (thread_new(&thread, uring_loop_thread, NULL) != 0) {
+		/* the teardown thread just keeps waiting */
+		io_uring_queue_exit(&uring);
+		close(uring_eventfd);
+		errno = EAGAIN;
+		return -1;
+	}
+	thread_detach(thread);
+	uring_active = 1;
+
+	return 0;
+}
+
+/**
+ * Hands an established relay over to the ring thread.
+ *
+ * @return 0 if the ring thread took over the client, -1 if the relay has
+ *    to be done by the calling thread.
+ */
+static int uring_relay_start(struct client_data *cdata)
+{
+	struct uring_relay *r;
+	uint64_t one = 1;
+
+	if (!uring_active || (fair_share && cdata->sched) || cdata->mapping->limit.rate > 0 || (cdata->sched && cdata->sched->limit.rate > 0)) {
+		return -1;
+	}
+	r = (struct uring_relay*)calloc(1, sizeof(struct uring_relay));
+	if (!r) {
+		return -1;
+	}
+	r->cdata = cdata;
+	mutex_lock(&uring_mutex);
+	r->next = uring_pending;
+	uring_pending = r;
+	mutex_unlock(&uring_mutex);
+	if (write(uring_eventfd, &one, sizeof(one)) < 0) {
+		fprintf(stderr, "ERROR: Failed to wake up io_uring thread: %s\n", strerror(errno));
+	}
+
+	return 0;
+}
+#endif
+
+static void *acceptor_thread(void *arg)
+{
+	struct client_data *cdata = (struct client_data*)arg;
+	usbmuxd_device_info_t muxdev;
+	int res;
+
+	if (!cdata) {
+		fprintf(stderr, "invalid client_data provided!\n");
+		return NULL;
+	}
+
+	cdata->sfd = -1;
+
+	if (cdata->type == LISTEN_TYPE_PROXY) {
+		if (proxy_handshake(cdata) < 0) {
+			client_done(cdata);
+			return NULL;
+		}
+	} else if (cdata->pool && (cdata->sfd = pool_take(cdata->pool, &cdata->handle, muxdev.udid, sizeof(muxdev.udid))) >= 0) {
+		if (client_set_device(cdata, muxdev.udid) < 0) {
+			client_done(cdata);
+			return NULL;
+		}
+	} else {
+		res = find_device(cdata->udid, cdata->lookup_opts, &muxdev, device_wait);
+		if (res < 0) {
+			printf("Connecting to usbmuxd failed, terminating.\n");
+			STAT_ADD(cdata->mapping->stats.stats.connect_failed, 1);
+			client_done(cdata);
+			return NULL;
+		}
+		if (res == 0 || muxdev.handle == 0) {
+			printf("No connected/matching device found, disconnecting client.\n");
+			STAT_ADD(cdata->mapping->stats.stats.connect_failed, 1);
+			client_done(cdata);
+			return NULL;
+		}
+
+		if (client_set_device(cdata, muxdev.udid) < 0) {
+			client_done(cdata);
+			return NULL;
+		}
+		cdata->handle = muxdev.handle;
+		cdata->sfd = connect_device(&cdata->mapping->stats, cdata->device, &muxdev, cdata->device_port, 0);
+		if (cdata->sfd < 0) {
+			fprintf(stderr, "Error connecting to device: %s\n", strerror(-cdata->sfd));
+			client_done(cdata);
+			return NULL;
+		}
+	}
+
+	mutex_lock(&relays_mutex);
+	collection_add(&relays, cdata);
+	mutex_unlock(&relays_mutex);
+
+#ifdef HAVE_LIBURING
+	if (uring_relay_start(cdata) == 0) {
+		/* the ring thread finishes the client */
+		return NULL;
+	}
+#endif
+	relay_data(cdata);
+	relay_finish(cdata);
+
+	return NULL;
+}
+
+/**
+ * Checks if a LOCAL argument denotes a unix domain socket, i.e. an
+ * absolute or relative path, or an abstract socket name prefixed with '@'.
+ */
+static int is_unix_socket_spec(const char *local)
+{
+	return (local[0] == '/' || local[0] == '.' || local[0] == '@');
+}
+
+/**
+ * Creates a listening unix domain socket. Names starting with '@' denote
+ * a socket in the abstract namespace (Linux only).
+ */
+static int create_unix_listener(const char *path)
+{
+#ifdef _WIN32
+	errno = EAFNOSUPPORT;
+	return -1;
+#else
+	if (path[0] != '@') {
+		return socket_create_unix(path);
+	}
+#ifdef __linux__
+	struct sockaddr_un saddr;
+	size_t namelen = strlen(path+1);
+	int fd;
+
+	if (namelen == 0 || namelen > sizeof(saddr.sun_path) - 1) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sun_family = AF_UNIX;
+	memcpy(saddr.sun_path + 1, path + 1, namelen);
+	if (bind(fd, (struct sockaddr*)&saddr, offsetof(struct sockaddr_un, sun_path) + 1 + namelen) < 0
+	 || listen(fd, 100) < 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+#else
+	errno = EAFNOSUPPORT;
+	return -1;
+#endif
+#endif
+}
+
+static int mapping_list_add(struct mapping_list *list, struct mapping *m)
+{
+	struct mapping **newtable = (struct mapping**)realloc(list->items, sizeof(struct mapping*) * (list->count + 1));
+	if (!newtable) {
+		return -1;
+	}
+	list->items = newtable;
+	list->items[list->count++] = m;
+	return 0;
+}
+
+static void mapping_list_remove(struct mapping_list *list, int index)
+{
+	memmove(&list->items[index], &list->items[index+1], sizeof(struct mapping*) * (list->count - index - 1));
+	list->count--;
+}
+
+/**
+ * Creates a new mapping and appends it to the given list. The list owns
+ * the initial reference.
+ */
+static struct mapping *mapping_new(struct mapping_list *list, enum listen_type type, const char *local_path, uint16_t local_port, uint16_t device_port)
+{
+	struct mapping *m = (struct mapping*)calloc(1, sizeof(struct mapping));
+	char label[32];
+
+	if (!m) {
+		return NULL;
+	}
+	if (mapping_list_add(list, m) < 0) {
+		free(m);
+		return NULL;
+	}
+
+	m->type = type;
+	m->local_path = (local_path) ? strdup(local_path) : NULL;
+	m->local_port = local_port;
+	m->device_port = device_port;
+	m->fd = -1;
+	m->refs = 1;
+	m->lookup_opts = default_lookup_opts;
+	m->priority = 1;
+	rate_limit_init(&m->limit, 0);
+	mutex_init(&m->admit_mutex);
+	if (type == LISTEN_TYPE_PROXY) {
+		snprintf(label, sizeof(label), "proxy:%d", local_port);
+		m->stats.label = strdup(label);
+	} else if (type == LISTEN_TYPE_METRICS) {
+		snprintf(label, sizeof(label), "metrics:%d", local_port);
+		m->stats.label = strdup(label);
+	} else if (local_path) {
+		m->stats.label = (char*)malloc(strlen(local_path) + 7);
+		sprintf(m->stats.label, "%s:%d", local_path, device_port);
+	} else {
+		snprintf(label, sizeof(label), "%d:%d", local_port, device_port);
+		m->stats.label = strdup(label);
+	}
+
+	return m;
+}
+
+/**
+ * Parses a port number or a port range in the form FIRST-LAST.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int parse_port_range(const char *str, const char *end, uint16_t *first, uint16_t *last)
+{
+	char *endp = NULL;
+	long l_first = strtol(str, &endp, 10);
+	long l_last = l_first;
+
+	if (endp == str || l_first <= 0 || l_first > 65535) {
+		return -1;
+	}
+	if (*endp == '-') {
+		const char *p = endp+1;
+		l_last = strtol(p, &endp, 10);
+		if (endp == p || l_last < l_first || l_last > 65535) {
+			return -1;
+		}
+	}
+	if (endp != end) {
+		return -1;
+	}
+	*first = (uint16_t)l_first;
+	*last = (uint16_t)l_last;
+
+	return 0;
+}
+
+/**
+ * Parses a rate in bytes per second with an optional K, M or G suffix
+ * (powers of 1024).
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int parse_rate(const char *str, const char *end, uint64_t *rate)
+{
+	char *endp = NULL;
+	unsigned long long val = strtoull(str, &endp, 10);
+
+	if (endp == str || *str == '-') {
+		return -1;
+	}
+	if (endp < end) {
+		switch (*endp) {
+		case 'k': case 'K': val <<= 10; break;
+		case 'm': case 'M': val <<= 20; break;
+		case 'g': case 'G': val <<= 30; break;
+		default: return -1;
+		}
+		endp++;
+	}
+	if (endp != end) {
+		return -1;
+	}
+	*rate = val;
+
+	return 0;
+}
+
+struct mapping_options {
+	unsigned int priority;
+	uint64_t rate;
+	char *udid;
+	unsigned int max_relays;
+};
+
+/**
+ * Parses the comma separated options following a mapping specification:
+ * priority=N (1-64), rate=RATE, udid=UDID and max=N. The udid member must
+ * be freed by the caller.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int parse_mapping_options(const char *opts, struct mapping_options *mo)
+{
+	while (*opts) {
+		const char *end = strchr(opts, ',');
+		if (!end) {
+			end = opts + strlen(opts);
+		}
+		if (strncmp(opts, "priority=", 9) == 0) {
+			char *endp = NULL;
+			long l_prio = strtol(opts+9, &endp, 10);
+			if (endp != end || l_prio < 1 || l_prio > SCHED_MAX_PRIORITY) {
+				return -1;
+			}
+			mo->priority = (unsigned int)l_prio;
+		} else if (strncmp(opts, "rate=", 5) == 0) {
+			if (parse_rate(opts+5, end, &mo->rate) < 0) {
+				return -1;
+			}
+		} else if (strncmp(opts, "max=", 4) == 0) {
+			char *endp = NULL;
+			long l_max = strtol(opts+4, &endp, 10);
+			if (endp == opts+4 || endp != end || l_max < 0 || l_max > 1000000) {
+				return -1;
+			}
+			mo->max_relays = (unsigned int)l_max;
+		} else if (strncmp(opts, "udid=", 5) == 0 && end > opts+5) {
+			free(mo->udid);
+			mo->udid = (char*)malloc(end - (opts+5) + 1);
+			memcpy(mo->udid, opts+5, end - (opts+5));
+			mo->udid[end - (opts+5)] = '\0';
+		} else {
+			return -1;
+		}
+		opts = (*end) ? end+1 : end;
+	}
+
+	return 0;
+}
+
+/**
+ * Parses a LOCAL:DEVICE_PORT argument and adds the resulting mappings.
+ * LOCAL is either a TCP port, a range of TCP ports like 20000-20099, or the
+ * path of a unix domain socket; the last colon separates the device port.
+ * DEVICE_PORT is a single port or a range of the same length as LOCAL.
+ * It may be followed by mapping options, e.g. 2222:22,priority=8.
+ *
+ * @return the number of mappings added to list, or -1 if LOCAL is invalid,
+ *    -2 if DEVICE_PORT is invalid, -3 if the range lengths do not match,
+ *    -4 if the options are invalid.
+ */
+static int add_port_mappings(struct mapping_list *list, const char *arg)
+{
+	const char *opts = strchr(arg, ',');
+	const char *spec_end = (opts) ? opts : arg + strlen(arg);
+	const char *colon = NULL;
+	const char *p;
+	uint16_t local_first, local_last;
+	uint16_t dev_first, dev_last;
+	struct mapping_options mo = { 1, 0, NULL, max_relays };
+	int count = -1;
+	int i;
+
+	for (p = arg; p < spec_end; p++) {
+		if (*p == ':') {
+			colon = p;
+		}
+	}
+	if (!colon || colon == arg) {
+		return -1;
+	}
+	if (parse_port_range(colon+1, spec_end, &dev_first, &dev_last) < 0) {
+		return -2;
+	}
+	if (opts && parse_mapping_options(opts+1, &mo) < 0) {
+		free(mo.udid);
+		return -4;
+	}
+
+	if (is_unix_socket_spec(arg)) {
+		if (dev_first != dev_last) {
+			free(mo.udid);
+			return -3;
+		}
+		char *path = (char*)malloc(colon - arg + 1);
+		memcpy(path, arg, colon - arg);
+		path[colon - arg] = '\0';
+		if (mapping_new(list, LISTEN_TYPE_PORT, path, 0, dev_first)) {
+			count = 1;
+		}
+		free(path);
+	} else if (parse_port_range(arg, colon, &local_first, &local_last) < 0) {
+		count = -1;
+	} else if (dev_first != dev_last && (dev_last - dev_first) != (local_last - local_first)) {
+		count = -3;
+	} else {
+		for (i = 0; i <= local_last - local_first; i++) {
+			uint16_t dport = (dev_first == dev_last) ? dev_first : (uint16_t)(dev_first + i);
+			if (!mapping_new(list, LISTEN_TYPE_PORT, NULL, (uint16_t)(local_first + i), dport)) {
+				break;
+			}
+		}
+		if (i > local_last - local_first) {
+			count = i;
+		}
+	}
+
+	/* every port of a range gets its own rate cap */
+	for (i = list->count - ((count > 0) ? count : 0); i < list->count; i++) {
+		struct mapping *m = list->items[i];
+		m->priority = mo.priority;
+		rate_limit_set(&m->limit, mo.rate);
+		m->udid = (mo.udid) ? strdup(mo.udid) : ((default_udid) ? strdup(default_udid) : NULL);
+		m->max_relays = mo.max_relays;
+		if (m->max_relays > 0) {
+			mappings_limited = 1;
+		}
+	}
+	free(mo.udid);
+
+	return count;
+}
+
+#ifdef HAVE_ACCEPTOR_THREADS
+/**
+ * Creates a TCP listener that shares its port with the listeners of the
+ * other acceptors through SO_REUSEPORT.
+ */
+static int create_reuseport_listener(const char *addr, uint16_t port)
+{
+	struct addrinfo hints;
+	struct addrinfo *result = NULL;
+	struct addrinfo *rp;
+	char portstr[8];
+	int fd = -1;
+	int yes = 1;
+	int err = EADDRNOTAVAIL;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	snprintf(portstr, sizeof(portstr), "%d", port);
+	if (getaddrinfo((addr) ? addr : "127.0.0.1", portstr, &hints, &result) != 0) {
+		errno = err;
+		return -1;
+	}
+	for (rp = result; rp != NULL; rp = rp->ai_next) {
+		fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		if (fd < 0) {
+			err = errno;
+			continue;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == 0
+		 && bind(fd, rp->ai_addr, rp->ai_addrlen) == 0
+		 && listen(fd, SOMAXCONN) == 0) {
+			break;
+		}
+		err = errno;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(result);
+	errno = err;
+
+	return fd;
+}
+#endif
+
+static void set_nonblocking(int fd)
+{
+#ifdef _WIN32
+	u_long l_yes = 1;
+	ioctlsocket(fd, FIONBIO, &l_yes);
+#else
+	int flags = fcntl(fd, F_GETFL, 0);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
+static void mapping_close(struct mapping *m)
+{
+	int i;
+
+	if (m->fd >= 0) {
+		socket_close(m->fd);
+		m->fd = -1;
+#ifndef _WIN32
+		if (m->local_path && m->local_path[0] != '@') {
+			unlink(m->local_path);
+		}
+#endif
+	}
+	for (i = 0; m->acceptor_fds && i < num_acceptors-1; i++) {
+		if (m->acceptor_fds[i] >= 0) {
+			socket_close(m->acceptor_fds[i]);
+			m->acceptor_fds[i] = -1;
+		}
+	}
+}
+
+/**
+ * Creates the listening socket for a mapping and makes it non-blocking.
+ * TCP listeners are created once per acceptor.
+ *
+ * @return 0 on success, -1 on error with errno set.
+ */
+static int mapping_listen(struct mapping *m)
+{
+	if (m->local_path) {
+		m->fd = create_unix_listener(m->local_path);
+#ifdef HAVE_ACCEPTOR_THREADS
+	} else if (num_acceptors > 1 && m->type != LISTEN_TYPE_METRICS) {
+		int i;
+		m->acceptor_fds = (int*)malloc(sizeof(int) * (num_acceptors-1));
+		if (!m->acceptor_fds) {
+			errno = ENOMEM;
+			return -1;
+		}
+		for (i = 0; i < num_acceptors-1; i++) {
+			m->acceptor_fds[i] = -1;
+		}
+		m->fd = create_reuseport_listener(source_addr, m->local_port);
+		for (i = 0; i < num_acceptors-1 && m->fd >= 0; i++) {
+			m->acceptor_fds[i] = create_reuseport_listener(source_addr, m->local_port);
+			if (m->acceptor_fds[i] < 0) {
+				int err = errno;
+				mapping_close(m);
+				errno = err;
+				return -1;
+			}
+			set_nonblocking(m->acceptor_fds[i]);
+		}
+#endif
+	} else {
+		m->fd = socket_create(source_addr, m->local_port);
+	}
+	if (m->fd < 0) {
+		return -1;
+	}
+	set_nonblocking(m->fd);
+
+	return 0;
+}
+
+/**
+ * Hands the listening sockets of old over to m. Acceptor threads might
+ * still look at the array of old, so it is copied and left untouched;
+ * old is only marked so that it is not closed when it is retired.
+ */
+static void mapping_takeover(struct mapping *old, struct mapping *m)
+{
+	int i;
+
+	m->fd = old->fd;
+	old->fd = -1;
+	old->taken_over = 1;
+	if (old->acceptor_fds) {
+		m->acceptor_fds = (int*)malloc(sizeof(int) * (num_acceptors-1));
+		for (i = 0; i < num_acceptors-1; i++) {
+			m->acceptor_fds[i] = old->acceptor_fds[i];
+		}
+	}
+}
+
+/*
+ * The accept loop waits on all listening sockets at once. On Linux epoll
+ * is used so the number of listeners and their fd numbers are not limited
+ * by FD_SETSIZE; other platforms fall back to select().
+ */
+struct listen_loop {
+#ifdef HAVE_SYS_EPOLL_H
+	int epfd;
+#else
+	fd_set fds;
+	int maxfd;
+#endif
+};
+
+static int listen_loop_init(struct listen_loop *loop)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	return (loop->epfd < 0) ? -1 : 0;
+#else
+	FD_ZERO(&loop->fds);
+	loop->maxfd = -1;
+	return 0;
+#endif
+}
+
+static int listen_loop_add(struct listen_loop *loop, int fd, struct mapping *m)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = m;
+	return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+#else
+#ifndef _WIN32
+	if (fd >= FD_SETSIZE) {
+		errno = EMFILE;
+		return -1;
+	}
+#endif
+	FD_SET(fd, &loop->fds);
+	if (fd > loop->maxfd) {
+		loop->maxfd = fd;
+	}
+	return 0;
+#endif
+}
+
+static void listen_loop_remove(struct listen_loop *loop, int fd)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, &ev);
+#else
+	FD_CLR(fd, &loop->fds);
+#endif
+}
+
+/**
+ * Makes the loop report the mapping m for the already registered fd.
+ */
+static void listen_loop_update(struct listen_loop *loop, int fd, struct mapping *m)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = m;
+	epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev);
+#endif
+}
+
+/**
+ * Waits until at least one listener is ready to accept a connection or
+ * timeout_ms milliseconds have passed; -1 waits forever.
+ *
+ * @return number of ready mappings stored in ready, or -1 on error.
+ */
+static int listen_loop_wait(struct listen_loop *loop, struct mapping **ready, int max_ready, int timeout_ms)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event events[64];
+	int i;
+	if (max_ready > 64) {
+		max_ready = 64;
+	}
+	int n = epoll_wait(loop->epfd, events, max_ready, timeout_ms);
+	if (n < 0) {
+		return (errno == EINTR) ? 0 : -1;
+	}
+	for (i = 0; i < n; i++) {
+		ready[i] = (struct mapping*)events[i].data.ptr;
+	}
+	return n;
+#else
+	fd_set read_fds = loop->fds;
+	struct timeval tv;
+	int n = 0;
+	int i;
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+	if (select(loop->maxfd+1, &read_fds, NULL, NULL, (timeout_ms < 0) ? NULL : &tv) < 0) {
+		return (errno == EINTR) ? 0 : -1;
+	}
+	for (i = 0; i < mappings.count && n < max_ready; i++) {
+		if (mappings.items[i]->fd >= 0 && FD_ISSET(mappings.items[i]->fd, &read_fds)) {
+			ready[n++] = mappings.items[i];
+		}
+	}
+	return n;
+#endif
+}
+
+static void listen_loop_free(struct listen_loop *loop)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	close(loop->epfd);
+#endif
+}
+
+/*
+ * With more than one acceptor every TCP listener is opened once per
+ * acceptor with SO_REUSEPORT and the kernel spreads incoming connections
+ * across them. The main thread serves the first socket of each mapping,
+ * every acceptor thread has its own epoll set with the others. Acceptor
+ * threads count their loop iterations, so the main thread can tell when
+ * none of them can still be looking at a mapping it has unregistered.
+ * Acceptor threads read the socket to accept on from acceptor_fds without
+ * a lock, so the sockets of an unregistered mapping are only closed after
+ * that point; otherwise a closed fd number could be reused by another
+ * socket and accepted on under the wrong mapping.
+ */
+struct acceptor {
+	THREAD_T thread;
+	struct listen_loop loop;
+	int index;
+	uint64_t epoch;
+};
+
+static struct acceptor *acceptors = NULL;
+static int acceptors_running = 0;
+
+static int acceptors_add(struct mapping *m)
+{
+	int i;
+
+	for (i = 0; m->acceptor_fds && i < num_acceptors-1; i++) {
+		if (listen_loop_add(&acceptors[i].loop, m->acceptor_fds[i], m) < 0) {
+			while (--i >= 0) {
+				listen_loop_remove(&acceptors[i].loop, m->acceptor_fds[i]);
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void acceptors_remove(struct mapping *m)
+{
+	int i;
+
+	for (i = 0; m->acceptor_fds && i < num_acceptors-1; i++) {
+		listen_loop_remove(&acceptors[i].loop, m->acceptor_fds[i]);
+	}
+}
+
+static void acceptors_update(struct mapping *m)
+{
+	int i;
+
+	for (i = 0; m->acceptor_fds && i < num_acceptors-1; i++) {
+		listen_loop_update(&acceptors[i].loop, m->acceptor_fds[i], m);
+	}
+}
+
+/**
+ * Waits until every acceptor thread has completed a loop iteration.
+ */
+static void acceptors_sync(void)
+{
+	uint64_t *epochs;
+	int i;
+
+	if (num_acceptors < 2 || !acceptors_running) {
+		return;
+	}
+	epochs = (uint64_t*)malloc(sizeof(uint64_t) * (num_acceptors-1));
+	for (i = 0; i < num_acceptors-1; i++) {
+		epochs[i] = STAT_GET(acceptors[i].epoch);
+	}
+	for (i = 0; i < num_acceptors-1; i++) {
+		while (STAT_GET(acceptors[i].epoch) == epochs[i]) {
+			sleep_us(1000);
+		}
+	}
+	free(epochs);
+}
+
+/**
+ * Starts the warm connection pool of a mapping if one is configured for
+ * its device port.
+ */
+static void mapping_start_pool(struct mapping *m)
+{
+	int i;
+
+	if (m->type != LISTEN_TYPE_PORT) {
+		return;
+	}
+	for (i = 0; i < num_warm_specs; i++) {
+		if (warm_specs[i].device_port == m->device_port) {
+			printf("Keeping %d warm connection(s) to device port %d for %s\n", warm_specs[i].num, m->device_port, m->stats.label);
+			m->pool = pool_new(&m->stats, m->udid, m->lookup_opts, m->device_port, warm_specs[i].num, warm_idle);
+			break;
+		}
+	}
+}
+
+/**
+ * Creates the listener of a mapping and registers it with the accept loop.
+ *
+ * @return 0 on success, -1 on error with errno set.
+ */
+static int mapping_start(struct mapping *m, struct listen_loop *loop)
+{
+	if (m->type == LISTEN_TYPE_PROXY) {
+		printf("Creating proxy listening port %d\n", m->local_port);
+	} else if (m->type == LISTEN_TYPE_METRICS) {
+		printf("Creating metrics listening port %d\n", m->local_port);
+	} else if (m->local_path) {
+		printf("Creating listening socket %s for device port %d\n", m->local_path, m->device_port);
+	} else {
+		printf("Creating listening port %d for device port %d\n", m->local_port, m->device_port);
+	}
+	if (mapping_listen(m) < 0) {
+		return -1;
+	}
+	if (listen_loop_add(loop, m->fd, m) < 0) {
+		int err = errno;
+		mapping_close(m);
+		errno = err;
+		return -1;
+	}
+	if (acceptors_add(m) < 0) {
+		int err = errno;
+		listen_loop_remove(loop, m->fd);
+		/* the sockets registered before the failure might be in use */
+		acceptors_sync();
+		mapping_close(m);
+		errno = err;
+		return -1;
+	}
+	mapping_start_pool(m);
+
+	return 0;
+}
+
+static int mapping_same_listener(struct mapping *a, struct mapping *b)
+{
+	if (a->type != b->type || (a->local_path == NULL) != (b->local_path == NULL)) {
+		return 0;
+	}
+	if (a->local_path) {
+		return strcmp(a->local_path, b->local_path) == 0;
+	}
+	return a->local_port == b->local_port;
+}
+
+static int mapping_same_target(struct mapping *a, struct mapping *b)
+{
+	if (a->device_port != b->device_port || a->priority != b->priority || a->limit.rate != b->limit.rate || a->max_relays != b->max_relays) {
+		return 0;
+	}
+	if (a->udid == NULL || b->udid == NULL) {
+		return a->udid == b->udid;
+	}
+	return strcmp(a->udid, b->udid) == 0;
+}
+
+/**
+ * Reads port mappings from a configuration file. Each line holds one or
+ * more mappings in the same format as on the command line; everything
+ * after a '#' is ignored.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int config_load(const char *path, struct mapping_list *list)
+{
+	FILE *f = fopen(path, "r");
+	struct stat st;
+	char line[1024];
+	int lineno = 0;
+	int i;
+
+	if (!f) {
+		fprintf(stderr, "ERROR: Could not open configuration file %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(fileno(f), &st) == 0) {
+		config_mtime = st.st_mtime;
+		config_size = st.st_size;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		char *p = line;
+		char *hash = strchr(line, '#');
+		lineno++;
+		if (hash) {
+			*hash = '\0';
+		}
+		while (1) {
+			char *next;
+			p += strspn(p, " \t\r\n");
+			if (*p == '\0') {
+				break;
+			}
+			next = p + strcspn(p, " \t\r\n");
+			if (*next) {
+				*next++ = '\0';
+			}
+			if (add_port_mappings(list, p) < 0) {
+				fprintf(stderr, "ERROR: %s:%d: Invalid mapping '%s'\n", path, lineno, p);
+				fclose(f);
+				return -1;
+			}
+			p = next;
+		}
+	}
+	fclose(f);
+
+	for (i = 0; i < list->count; i++) {
+		list->items[i]->from_config = 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Checks if the configuration file was modified since it was last read.
+ */
+static int config_changed(void)
+{
+	struct stat st;
+
+	if (stat(config_path, &st) < 0) {
+		/* editors might replace the file; wait until it is back */
+		return 0;
+	}
+	return st.st_mtime != config_mtime || st.st_size != config_size;
+}
+
+/**
+ * Closes the listeners of the retired mappings starting at index from,
+ * except those that were taken over by a new mapping. Must only be called
+ * once the acceptor threads stopped looking at them.
+ *
+ * @return the number of retired mappings.
+ */
+static int retired_close(struct mapping_list *retired, int from)
+{
+	int i;
+
+	for (i = from; i < retired->count; i++) {
+		if (!retired->items[i]->taken_over) {
+			mapping_close(retired->items[i]);
+		}
+	}
+	return retired->count;
+}
+
+/**
+ * Applies a changed configuration file. Listeners of mappings that are
+ * still present are kept, so clients never see the port go away; mappings
+ * with a new target take over the listening socket of the old mapping.
+ * Relays that are already running are not affected at all.
+ */
+static void config_reload(struct listen_loop *loop)
+{
+	struct mapping_list list = { NULL, 0 };
+	struct mapping_list retired = { NULL, 0 };
+	int closed;
+	int i = 0;
+	int j;
+
+	printf("Reloading configuration from %s\n", config_path);
+	if (config_load(config_path, &list) < 0) {
+		fprintf(stderr, "Keeping the current configuration.\n");
+		for (j = 0; j < list.count; j++) {
+			mapping_unref(list.items[j]);
+		}
+		free(list.items);
+		return;
+	}
+
+	while (i < mappings.count) {
+		struct mapping *m = mappings.items[i];
+		struct mapping *n = NULL;
+		if (!m->from_config) {
+			i++;
+			continue;
+		}
+		for (j = 0; j < list.count; j++) {
+			if (mapping_same_listener(m, list.items[j])) {
+				n = list.items[j];
+				mapping_list_remove(&list, j);
+				break;
+			}
+		}
+		if (n && mapping_same_target(m, n)) {
+			mapping_unref(n);
+			i++;
+			continue;
+		}
+		if (n) {
+			printf("Retargeting %s to %s\n", m->stats.label, n->stats.label);
+			mapping_takeover(m, n);
+			listen_loop_update(loop, n->fd, n);
+			acceptors_update(n);
+			mapping_start_pool(n);
+			mutex_lock(&mappings_mutex);
+			mappings.items[i++] = n;
+			mutex_unlock(&mappings_mutex);
+		} else {
+			printf("Removing %s\n", m->stats.label);
+			listen_loop_remove(loop, m->fd);
+			acceptors_remove(m);
+			mutex_lock(&mappings_mutex);
+			mapping_list_remove(&mappings, i);
+			mutex_unlock(&mappings_mutex);
+		}
+		if (m->pool) {
+			pool_stop(m->pool);
+		}
+		mapping_list_add(&retired, m);
+	}
+
+	/* acceptor threads might still be accepting on the removed mappings,
+	 * and their listeners have to be gone before new ones are created */
+	acceptors_sync();
+	closed = retired_close(&retired, 0);
+
+	for (j = 0; j < list.count; j++) {
+		struct mapping *n = list.items[j];
+		int res;
+		if (mapping_start(n, loop) < 0) {
+			fprintf(stderr, "Error creating socket for %s: %s\n", n->stats.label, strerror(errno));
+			mapping_unref(n);
+			continue;
+		}
+		mutex_lock(&mappings_mutex);
+		res = mapping_list_add(&mappings, n);
+		mutex_unlock(&mappings_mutex);
+		if (res < 0) {
+			listen_loop_remove(loop, n->fd);
+			acceptors_remove(n);
+			mapping_list_add(&retired, n);
+		}
+	}
+	free(list.items);
+
+	if (closed < retired.count) {
+		acceptors_sync();
+		retired_close(&retired, closed);
+	}
+	for (j = 0; j < retired.count; j++) {
+		mapping_unref(retired.items[j]);
+	}
+	free(retired.items);
+}
+
+#ifndef _WIN32
+static void handle_sighup(int sig)
+{
+	reload_requested = 1;
+}
+#endif
+
+struct strbuf {
+	char *data;
+	size_t len;
+	size_t capacity;
+};
+
+static void strbuf_printf(struct strbuf *buf, const char *format, ...)
+{
+	va_list args;
+	int n;
+
+	if (!buf->data) {
+		return;
+	}
+	while (1) {
+		va_start(args, format);
+		n = vsnprintf(buf->data + buf->len, buf->capacity - buf->len, format, args);
+		va_end(args);
+		if (n < 0) {
+			return;
+		}
+		if ((size_t)n < buf->capacity - buf->len) {
+			buf->len += n;
+			return;
+		}
+		size_t newcap = buf->capacity * 2 + n;
+		char *newdata = (char*)realloc(buf->data, newcap);
+		if (!newdata) {
+			return;
+		}
+		buf->data = newdata;
+		buf->capacity = newcap;
+	}
+}
+
+static void metrics_write_header(struct strbuf *buf, const char *scope, const char *name, const char *type, const char *help)
+{
+	strbuf_printf(buf, "# HELP iproxy_%s_%s %s\n", scope, name, help);
+	strbuf_printf(buf, "# TYPE iproxy_%s_%s %s\n", scope, name, type);
+}
+
+static void metrics_write_histogram(struct strbuf *buf, const char *scope, const char *name, const char *key, const char *label, const uint64_t *hist, uint64_t sum_us)
+{
+	uint64_t cumulative = 0;
+	size_t b;
+
+	for (b = 0; b < NUM_LATENCY_BUCKETS; b++) {
+		cumulative += STAT_GET(hist[b]);
+		strbuf_printf(buf, "iproxy_%s_%s_bucket{%s=\"%s\",le=\"%g\"} %llu\n", scope, name, key, label, latency_buckets[b] / 1000000.0, (unsigned long long)cumulative);
+	}
+	cumulative += STAT_GET(hist[NUM_LATENCY_BUCKETS]);
+	strbuf_printf(buf, "iproxy_%s_%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", scope, name, key, label, (unsigned long long)cumulative);
+	strbuf_printf(buf, "iproxy_%s_%s_sum{%s=\"%s\"} %.6f\n", scope, name, key, label, sum_us / 1000000.0);
+	strbuf_printf(buf, "iproxy_%s_%s_count{%s=\"%s\"} %llu\n", scope, name, key, label, (unsigned long long)cumulative);
+}
+
+/**
+ * Returns a copy of a label value with backslashes, double quotes and line
+ * feeds escaped as the Prometheus text format requires, since the labels
+ * of unix socket mappings contain arbitrary paths.
+ */
+static char *metrics_escape_label(const char *label)
+{
+	char *res = (char*)malloc(strlen(label) * 2 + 1);
+	char *p = res;
+
+	if (!res) {
+		return NULL;
+	}
+	for (; *label; label++) {
+		if (*label == '\\' || *label == '"') {
+			*p++ = '\\';
+			*p++ = *label;
+		} else if (*label == '\n') {
+			*p++ = '\\';
+			*p++ = 'n';
+		} else {
+			*p++ = *label;
+		}
+	}
+	*p = '\0';
+
+	return res;
+}
+
+static void metrics_write_scope(struct strbuf *buf, const char *scope, const char *key, struct stats_entry **entries, int count)
+{
+	char **labels = (char**)calloc(count + 1, sizeof(char*));
+	int i;
+
+	if (!labels) {
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		labels[i] = metrics_escape_label(entries[i]->label);
+		if (!labels[i]) {
+			count = i;
+			break;
+		}
+	}
+
+	metrics_write_header(buf, scope, "connections_active", "gauge", "Number of connections currently being relayed.");
+	for (i = 0; i < count; i++) {
+		strbuf_printf(buf, "iproxy_%s_connections_active{%s=\"%s\"} %llu\n", scope, key, labels[i], (unsigned long long)STAT_GET(entries[i]->stats.active));
+	}
+	metrics_write_header(buf, scope, "connections_accepted_total", "counter", "Number of connections accepted.");
+	for (i = 0; i < count; i++) {
+		strbuf_printf(buf, "iproxy_%s_connections_accepted_total{%s=\"%s\"} %llu\n", scope, key, labels[i], (unsigned long long)STAT_GET(entries[i]->stats.accepted));
+	}
+	metrics_write_header(buf, scope, "connect_failures_total", "counter", "Number of failed device connection attempts.");
+	for (i = 0; i < count; i++) {
+		strbuf_printf(buf, "iproxy_%s_connect_failures_total{%s=\"%s\"} %llu\n", scope, key, labels[i], (unsigned long long)STAT_GET(entries[i]->stats.connect_failed));
+	}
+	metrics_write_header(buf, scope, "bytes_total", "counter", "Number of bytes relayed.");
+	for (i = 0; i < count; i++) {
+		strbuf_printf(buf, "iproxy_%s_bytes_total{%s=\"%s\",direction=\"to_device\"} %llu\n", scope, key, labels[i], (unsigned long long)STAT_GET(entries[i]->stats.bytes_to_device));
+		strbuf_printf(buf, "iproxy_%s_bytes_total{%s=\"%s\",direction=\"from_device\"} %llu\n", scope, key, labels[i], (unsigned long long)STAT_GET(entries[i]->stats.bytes_from_device));
+	}
+	metrics_write_header(buf, scope, "relay_seconds_total", "counter", "Time spent relaying finished connections. Divide bytes_total by this for relay throughput.");
+	for (i = 0; i < count; i++) {
+		strbuf_printf(buf, "iproxy_%s_relay_seconds_total{%s=\"%s\"} %.6f\n", scope, key, labels[i], STAT_GET(entries[i]->stats.relay_time_us) / 1000000.0);
+	}
+	metrics_write_header(buf, scope, "sched_grants_total", "counter", "Number of transfers granted by the fair share scheduler.");
+	for (i = 0; i < count; i++) {
+		strbuf_printf(buf, "iproxy_%s_sched_grants_total{%s=\"%s\"} %llu\n", scope, key, labels[i], (unsigned long long)STAT_GET(entries[i]->stats.sched_grants));
+	}
+	metrics_write_header(buf, scope, "sched_wait_seconds_total", "counter", "Time relays spent waiting for their turn on the device.");
+	for (i = 0; i < count; i++) {
+		strbuf_printf(buf, "iproxy_%s_sched_wait_seconds_total{%s=\"%s\"} %.6f\n", scope, key, labels[i], STAT_GET(entries[i]->stats.sched_wait_us) / 1000000.0);
+	}
+	metrics_write_header(buf, scope, "throttle_seconds_total", "counter", "Time relays were delayed by a rate cap.");
+	for (i = 0; i < count; i++) {
+		strbuf_printf(buf, "iproxy_%s_throttle_seconds_total{%s=\"%s\"} %.6f\n", scope, key, labels[i], STAT_GET(entries[i]->stats.throttle_us) / 1000000.0);
+	}
+	metrics_write_header(buf, scope, "connect_duration_seconds", "histogram", "Time needed to establish the device connection.");
+	for (i = 0; i < count; i++) {
+		metrics_write_histogram(buf, scope, "connect_duration_seconds", key, labels[i], entries[i]->stats.connect_hist, STAT_GET(entries[i]->stats.connect_time_us));
+	}
+	metrics_write_header(buf, scope, "queue_length", "gauge", "Number of clients currently waiting to be admitted.");
+	for (i = 0; i < count; i++) {
+		strbuf_printf(buf, "iproxy_%s_queue_length{%s=\"%s\"} %llu\n", scope, key, labels[i], (unsigned long long)STAT_GET(entries[i]->stats.queue_len));
+	}
+	metrics_write_header(buf, scope, "queued_total", "counter", "Number of times a client had to wait because a connection limit was reached.");
+	for (i = 0; i < count; i++) {
+		strbuf_printf(buf, "iproxy_%s_queued_total{%s=\"%s\"} %llu\n", scope, key, labels[i], (unsigned long long)STAT_GET(entries[i]->stats.queued));
+	}
+	metrics_write_header(buf, scope, "rejected_total", "counter", "Number of clients disconnected because the wait queue was full or the wait timed out.");
+	for (i = 0; i < count; i++) {
+		strbuf_printf(buf, "iproxy_%s_rejected_total{%s=\"%s\"} %llu\n", scope, key, labels[i], (unsigned long long)STAT_GET(entries[i]->stats.rejected));
+	}
+	metrics_write_header(buf, scope, "abandoned_total", "counter", "Number of queued clients that disconnected before they were admitted.");
+	for (i = 0; i < count; i++) {
+		strbuf_printf(buf, "iproxy_%s_abandoned_total{%s=\"%s\"} %llu\n", scope, key, labels[i], (unsigned long long)STAT_GET(entries[i]->stats.abandoned));
+	}
+	metrics_write_header(buf, scope, "pool_refills_total", "counter", "Number of device connections opened to refill a warm pool.");
+	for (i = 0; i < count; i++) {
+		strbuf_printf(buf, "iproxy_%s_pool_refills_total{%s=\"%s\"} %llu\n", scope, key, labels[i], (unsigned long long)STAT_GET(entries[i]->stats.pool_refills));
+	}
+	metrics_write_header(buf, scope, "pool_refills_rejected_total", "counter", "Number of pool refills given up because the connect limit's wait queue was full or the wait timed out.");
+	for (i = 0; i < count; i++) {
+		strbuf_printf(buf, "iproxy_%s_pool_refills_rejected_total{%s=\"%s\"} %llu\n", scope, key, labels[i], (unsigned long long)STAT_GET(entries[i]->stats.pool_refills_rejected));
+	}
+	metrics_write_header(buf, scope, "queue_duration_seconds", "histogram", "Time queued clients waited until they were admitted.");
+	for (i = 0; i < count; i++) {
+		metrics_write_histogram(buf, scope, "queue_duration_seconds", key, labels[i], entries[i]->stats.queue_hist, STAT_GET(entries[i]->stats.queue_time_us));
+	}
 
-#include <getopt.h>
-#include <libimobiledevice-glue/socket.h>
-#include <libimobiledevice-glue/thread.h>
-#include "usbmuxd.h"
+	for (i = 0; i < count; i++) {
+		free(labels[i]);
+	}
+	free(labels);
+}
 
-#ifndef ETIMEDOUT
-#define ETIMEDOUT 138
-#endif
+/**
+ * Serves a single HTTP request on the metrics port with the current
+ * counters in the Prometheus text exposition format.
+ */
+static void *metrics_thread(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	char req[1024];
+	size_t len = 0;
+	struct strbuf body = { NULL, 0, 0 };
+	struct strbuf resp = { NULL, 0, 0 };
+	struct stats_entry **entries = NULL;
+	int count = 0;
+	int i;
 
-static int debug_level = 0;
+	while (len < sizeof(req) - 1) {
+		int r = socket_receive_timeout(fd, req + len, sizeof(req) - 1 - len, 0, PROXY_TIMEOUT);
+		if (r <= 0) {
+			break;
+		}
+		len += r;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n")) {
+			break;
+		}
+	}
+	req[len] = '\0';
 
-struct client_data {
-	int fd;
-	int sfd;
-	char* udid;
-	enum usbmux_lookup_options lookup_opts;
-	uint16_t device_port;
-};
+	resp.capacity = 256;
+	resp.data = (char*)malloc(resp.capacity);
+	if (strncmp(req, "GET /metrics ", 13) != 0 && strncmp(req, "GET / ", 6) != 0) {
+		strbuf_printf(&resp, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+		send_all(fd, resp.data, resp.len);
+		free(resp.data);
+		socket_close(fd);
+		return NULL;
+	}
 
-#define CDATA_FREE(x) if (x) { \
-	if ((x)->fd > 0) socket_close((x)->fd); \
-	if ((x)->sfd > 0) socket_close((x)->sfd); \
-	free((x)->udid); \
-	free(x); \
+	body.capacity = 16384;
+	body.data = (char*)malloc(body.capacity);
+
+	/* hold the lock until the output is complete since a reload might
+	 * free mappings that are not in use anymore */
+	mutex_lock(&mappings_mutex);
+	entries = (struct stats_entry**)malloc(sizeof(struct stats_entry*) * (mappings.count + 1));
+	for (i = 0; i < mappings.count; i++) {
+		if (mappings.items[i]->type != LISTEN_TYPE_METRICS) {
+			entries[count++] = &mappings.items[i]->stats;
+		}
+	}
+	metrics_write_scope(&body, "mapping", "mapping", entries, count);
+	mutex_unlock(&mappings_mutex);
+	free(entries);
+	count = 0;
+
+	mutex_lock(&device_stats_mutex);
+	entries = (struct stats_entry**)malloc(sizeof(struct stats_entry*) * (collection_count(&device_stats) + 1));
+	FOREACH(struct stats_entry *e, &device_stats) {
+		entries[count++] = e;
+	} ENDFOREACH
+	mutex_unlock(&device_stats_mutex);
+	metrics_write_scope(&body, "device", "udid", entries, count);
+	free(entries);
+
+	strbuf_printf(&resp, "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %u\r\nConnection: close\r\n\r\n", (unsigned int)body.len);
+	if (send_all(fd, resp.data, resp.len) == 0 && body.data) {
+		send_all(fd, body.data, body.len);
+	}
+	free(resp.data);
+	free(body.data);
+	socket_close(fd);
+
+	return NULL;
 }
 
-static void *acceptor_thread(void *arg)
+/* how long to stop accepting when the process is out of file descriptors */
+#define ACCEPT_BACKOFF_MS 100
+
+/**
+ * Accepts a pending client on the listening socket fd of the given mapping
+ * and starts the thread that handles it.
+ *
+ * @return 0 normally, or -1 if the process ran out of file descriptors.
+ *    The pending connection then stays in the backlog and the listener
+ *    stays readable, so the caller should back off before waiting again.
+ */
+static int handle_accept(struct mapping *m, int fd)
 {
-	char buffer[32768];
-	struct client_data *cdata = (struct client_data*)arg;
-	usbmuxd_device_info_t *dev_list = NULL;
-	usbmuxd_device_info_t *dev = NULL;
-	usbmuxd_device_info_t muxdev;
-	int count;
+	THREAD_T acceptor = THREAD_T_NULL;
+	struct client_data *cdata;
+	int res;
 
-	if (!cdata) {
-		fprintf(stderr, "invalid client_data provided!\n");
-		return NULL;
+	if (fd < 0) {
+		/* the listener was closed by a reload */
+		return 0;
 	}
-
-	if (cdata->udid) {
-		if (usbmuxd_get_device(cdata->udid, &muxdev, cdata->lookup_opts) > 0) {
-			dev = &muxdev;
+	int c_sock = socket_accept(fd, m->local_port);
+	if (c_sock < 0) {
+		if (errno == EMFILE || errno == ENFILE) {
+			return -1;
 		}
-	} else {
-		if ((count = usbmuxd_get_device_list(&dev_list)) < 0) {
-			printf("Connecting to usbmuxd failed, terminating.\n");
-			free(dev_list);
-			CDATA_FREE(cdata);
-			return NULL;
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			fprintf(stderr, "accept: %s\n", strerror(errno));
 		}
+		return 0;
+	}
 
-		if (dev_list == NULL || dev_list[0].handle == 0) {
-			printf("No connected device found, terminating.\n");
-			free(dev_list);
-			CDATA_FREE(cdata);
-			return NULL;
+	if (m->type == LISTEN_TYPE_METRICS) {
+		if (thread_new(&acceptor, metrics_thread, (void*)(intptr_t)c_sock) == 0) {
+			thread_detach(acceptor);
+		} else {
+			socket_close(c_sock);
 		}
+		return 0;
+	}
 
-		int i;
-		for (i = 0; i < count; i++) {
-			if (dev_list[i].conn_type == CONNECTION_TYPE_USB && (cdata->lookup_opts & DEVICE_LOOKUP_USBMUX)) {
-				dev = &(dev_list[i]);
-				break;
-			}
-			if (dev_list[i].conn_type == CONNECTION_TYPE_NETWORK && (cdata->lookup_opts & DEVICE_LOOKUP_NETWORK)) {
-				dev = &(dev_list[i]);
-				break;
-			}
-		}
+	STAT_ADD(m->stats.stats.accepted, 1);
+	if (m->type == LISTEN_TYPE_PROXY) {
+		printf("New proxy connection on port %d, fd = %d\n", m->local_port, c_sock);
+	} else {
+		printf("New connection for %s, fd = %d\n", m->stats.label, c_sock);
 	}
 
-	if (dev == NULL || dev->handle == 0) {
-		printf("No connected/matching device found, disconnecting client.\n");
-		free(dev_list);
+	cdata = (struct client_data*)malloc(sizeof(struct client_data));
+	if (!cdata) {
+		socket_close(c_sock);
+		fprintf(stderr, "ERROR: Out of memory\n");
+		return 0;
+	}
+	cdata->fd = c_sock;
+	cdata->sfd = -1;
+	cdata->type = m->type;
+	cdata->lookup_opts = m->lookup_opts;
+	cdata->mapping = mapping_ref(m);
+	cdata->device = NULL;
+	cdata->sched = NULL;
+	cdata->pool = m->pool;
+	cdata->handle = 0;
+	cdata->device_gate = NULL;
+	cdata->next = NULL;
+	cdata->queued_at = 0;
+	if (m->type == LISTEN_TYPE_PROXY) {
+		/* UDID and port are taken from the proxy request */
+		cdata->udid = NULL;
+		cdata->device_port = 0;
+	} else {
+		cdata->udid = (m->udid) ? strdup(m->udid) : NULL;
+		cdata->device_port = m->device_port;
+	}
+
+	res = mapping_admit(m, cdata);
+	if (res > 0) {
+		client_start(cdata);
+	} else if (res == 0) {
+		printf("Too many connections for %s, queueing client fd = %d\n", m->stats.label, c_sock);
+	} else {
+		printf("Too many connections for %s, disconnecting client.\n", m->stats.label);
 		CDATA_FREE(cdata);
-		return NULL;
 	}
 
-	cdata->sfd = -1;
-	if (dev->conn_type == CONNECTION_TYPE_NETWORK) {
-		struct sockaddr_storage saddr_storage;
-		struct sockaddr* saddr = (struct sockaddr*)&saddr_storage;
+	return 0;
+}
 
-		if (dev->conn_data[1] == 0x02) { // AF_INET
-			saddr->sa_family = AF_INET;
-			memcpy(&saddr->sa_data[0], (uint8_t*)dev->conn_data+2, 14);
-		}
-		else if (dev->conn_data[1] == 0x1E) { //AF_INET6 (bsd)
-#ifdef AF_INET6
-			saddr->sa_family = AF_INET6;
-			/* copy the address and the host dependent scope id */
-			memcpy(&saddr->sa_data[0], (uint8_t*)dev->conn_data+2, 26);
-#else
-			fprintf(stderr, "ERROR: Got an IPv6 address but this system doesn't support IPv6\n");
-			CDATA_FREE(cdata);
-			return NULL;
-#endif
-		}
-		else {
-			fprintf(stderr, "Unsupported address family 0x%02x\n", dev->conn_data[1]);
-			CDATA_FREE(cdata);
-			return NULL;
+/**
+ * Pauses accepting after handle_accept() ran out of file descriptors, so
+ * that the still readable listeners do not make the loop spin.
+ *
+ * @return the new value of the out-of-descriptors state.
+ */
+static int accept_backoff(int out_of_fds, int was_out_of_fds)
+{
+	if (out_of_fds) {
+		if (!was_out_of_fds) {
+			fprintf(stderr, "accept: %s, pausing for %d ms\n", strerror(EMFILE), ACCEPT_BACKOFF_MS);
 		}
-		char addrtxt[48];
-		addrtxt[0] = '\0';
-		if (!socket_addr_to_string(saddr, addrtxt, sizeof(addrtxt))) {
-			fprintf(stderr, "Failed to convert network address: %d (%s)\n", errno, strerror(errno));
+		sleep_us(ACCEPT_BACKOFF_MS * 1000);
+	}
+	return out_of_fds;
+}
+
+#ifdef HAVE_ACCEPTOR_THREADS
+static void *acceptor_loop_thread(void *arg)
+{
+	struct acceptor *a = (struct acceptor*)arg;
+	struct mapping *ready[64];
+	int num_ready;
+	int out_of_fds = 0;
+	int i;
+
+	while (1) {
+		int res = 0;
+		/* the timeout keeps the epoch moving for acceptors_sync() */
+		num_ready = listen_loop_wait(&a->loop, ready, 64, 100);
+		if (num_ready < 0) {
+			perror("wait");
+			break;
 		}
-		fprintf(stdout, "Requesting connection to NETWORK device %s (serial: %s), port %d\n", addrtxt, dev->udid, cdata->device_port);
-		cdata->sfd = socket_connect_addr(saddr, cdata->device_port);
-		if (cdata->sfd < 0) {
-			cdata->sfd = -errno;
+		for (i = 0; i < num_ready; i++) {
+			if (handle_accept(ready[i], ready[i]->acceptor_fds[a->index]) < 0) {
+				res = -1;
+			}
 		}
-	} else if (dev->conn_type == CONNECTION_TYPE_USB) {
-		fprintf(stdout, "Requesting connection to USB device handle %d (serial: %s), port %d\n", dev->handle, dev->udid, cdata->device_port);
-
-		cdata->sfd = usbmuxd_connect(dev->handle, cdata->device_port);
+		STAT_ADD(a->epoch, 1);
+		out_of_fds = accept_backoff(res < 0, out_of_fds);
 	}
-	free(dev_list);
-	if (cdata->sfd < 0) {
-		fprintf(stderr, "Error connecting to device: %s\n", strerror(-cdata->sfd));
-	} else {
-		fd_set fds;
-		FD_ZERO(&fds);
-		FD_SET(cdata->fd, &fds);
-		FD_SET(cdata->sfd, &fds);
-		int maxfd = cdata->fd > cdata->sfd ? cdata->fd : cdata->sfd;
 
-		while (1) {
-			fd_set read_fds = fds;
-			int ret_sel = select(maxfd+1, &read_fds, NULL, NULL, NULL);
-			if (ret_sel < 0) {
-				perror("select");
-				break;
-			}
-			if (FD_ISSET(cdata->fd, &read_fds)) {
-				int r = socket_receive_timeout(cdata->fd, buffer, sizeof(buffer), 0, 100);
-				if (r <= 0) {
-					break;
-				}
-				int sent = 0;
-				while (sent < r) {
-					int s = socket_send(cdata->sfd, buffer+sent, r-sent);
-					if (s <= 0) {
-						break;
-					}
-					sent += s;
-				}
-			}
-			if (FD_ISSET(cdata->sfd, &read_fds)) {
-				int r = socket_receive_timeout(cdata->sfd, buffer, sizeof(buffer), 0, 100);
-				if (r <= 0) {
-					break;
-				}
-				int sent = 0;
-				while (sent < r) {
-					int s = socket_send(cdata->fd, buffer+sent, r-sent);
-					if (s <= 0) {
-						break;
-					}
-					sent += s;
-				}
-			}
+	return NULL;
+}
+#endif
+
+/**
+ * Sets up the event loops of the additional acceptor threads. The threads
+ * are started with acceptors_start() once the listeners are registered.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int acceptors_init(void)
+{
+	int i;
+
+	if (num_acceptors < 2) {
+		return 0;
+	}
+	acceptors = (struct acceptor*)calloc(num_acceptors-1, sizeof(struct acceptor));
+	if (!acceptors) {
+		return -1;
+	}
+	for (i = 0; i < num_acceptors-1; i++) {
+		acceptors[i].index = i;
+		if (listen_loop_init(&acceptors[i].loop) < 0) {
+			return -1;
 		}
 	}
+	return 0;
+}
 
-	CDATA_FREE(cdata);
+static int acceptors_start(void)
+{
+#ifdef HAVE_ACCEPTOR_THREADS
+	int i;
 
-	return NULL;
+	for (i = 0; i < num_acceptors-1; i++) {
+		if (thread_new(&acceptors[i].thread, acceptor_loop_thread, &acceptors[i]) != 0) {
+			return -1;
+		}
+		thread_detach(acceptors[i].thread);
+	}
+	acceptors_running = 1;
+#endif
+	return 0;
 }
 
 static void print_usage(int argc, char **argv, int is_error)
@@ -224,15 +3836,49 @@ static void print_usage(int argc, char **argv, int is_error)
 	char *name = NULL;
 	name = strrchr(argv[0], '/');
 	fprintf(is_error ? stderr : stdout, "Usage: %s [OPTIONS] LOCAL_PORT:DEVICE_PORT [LOCAL_PORT2:DEVICE_PORT2 ...]\n", (name ? name+1 : argv[0]));
+	fprintf(is_error ? stderr : stdout, "       %s [OPTIONS] -p PROXY_PORT [LOCAL_PORT:DEVICE_PORT ...]\n", (name ? name+1 : argv[0]));
 	fprintf(is_error ? stderr : stdout,
 		"\n" \
 		"Proxy that binds local TCP ports to be forwarded to the specified ports on a usbmux device.\n" \
+		"Instead of a TCP port, LOCAL_PORT can be the path of a unix domain socket to\n" \
+		"create, or on Linux an abstract socket name prefixed with '@'.\n" \
+		"Port ranges like 20000-20099:8100 or 20000-20099:8100-8199 are accepted, too.\n" \
+		"A mapping may be followed by options: ,priority=N (1-64) sets the share of the\n" \
+		"device bandwidth with --fair, ,rate=RATE caps its throughput in bytes/s and\n" \
+		",udid=UDID forwards to a specific device and ,max=N limits its concurrent\n" \
+		"connections.\n" \
 		"\n" \
 		"OPTIONS:\n" \
 		"  -u, --udid UDID    target specific device by UDID\n" \
 		"  -n, --network      connect to network device\n" \
 		"  -l, --local        connect to USB device (default)\n" \
 		"  -s, --source ADDR  source address for listening socket (default 127.0.0.1)\n" \
+		"  -p, --proxy PORT   listen on PORT for HTTP CONNECT or SOCKS5 requests with\n" \
+		"                     the device UDID as host name, e.g. CONNECT UDID:22;\n" \
+		"                     mapping options can be appended like 8080,priority=2\n" \
+		"  -m, --metrics PORT serve Prometheus metrics via HTTP on PORT\n" \
+		"  -w, --warm DEVICE_PORT:NUM  keep NUM connections to DEVICE_PORT established\n" \
+		"                     and hand them out to new clients (stateless services only)\n" \
+		"  -W, --warm-idle SEC  replace warm connections idle for SEC seconds (default 60)\n" \
+		"  -f, --fair         share the bandwidth of each device between its connections\n" \
+		"                     according to their priority\n" \
+		"  -R, --device-rate RATE  cap the throughput to each device at RATE bytes/s;\n" \
+		"                     K, M and G suffixes are accepted\n" \
+		"  -c, --config FILE  read additional mappings from FILE and reload them when\n" \
+		"                     the file changes or on SIGHUP\n" \
+		"  -Q, --wait-device SEC  let clients wait up to SEC seconds for their device\n" \
+		"                     to be attached instead of disconnecting them right away\n" \
+		"  -a, --acceptors N  accept TCP connections in N threads, each with its own\n" \
+		"                     SO_REUSEPORT listener per port (Linux only)\n" \
+		"  -M, --max-relays N  relay at most N connections per mapping at once\n" \
+		"  -D, --max-device-relays N  relay at most N connections per device at once\n" \
+		"  -C, --max-connects N  allow at most N device connects in progress at once\n" \
+		"  -q, --queue N      let at most N clients wait when a limit is reached\n" \
+		"                     (default 128)\n" \
+		"  -T, --queue-timeout SEC  disconnect clients that waited SEC seconds (default\n" \
+		"                     10, 0 waits forever)\n" \
+		"  -U, --io-uring     relay data through io_uring instead of one thread per\n" \
+		"                     connection (Linux only)\n" \
 		"  -h, --help         prints usage information\n" \
 		"  -d, --debug        increase debug level\n" \
 		"  -v, --version      prints version information\n" \
@@ -244,23 +3890,14 @@ static void print_usage(int argc, char **argv, int is_error)
 
 int main(int argc, char **argv)
 {
-	char* device_udid = NULL;
-	char* source_addr = NULL;
-	uint16_t listen_port[16];
-	uint16_t device_port[16];
-#ifdef AF_INET6
-#define MAX_LISTEN_NUM 32
-#else
-#define MAX_LISTEN_NUM 16
-#endif
-	struct listen_sock {
-		int fd;
-		int index;
-	} listen_sock[MAX_LISTEN_NUM];
-	int num_listen = 0;
-	int num_pairs = 0;
+	uint16_t proxy_port = 0;
+	const char *proxy_opts = NULL;
+	uint16_t metrics_port = 0;
+	struct listen_loop loop;
+	int print_waiting = 1;
+	int out_of_fds = 0;
 	int i = 0;
-	enum usbmux_lookup_options lookup_opts = 0;
+	int res = 0;
 
 	const struct option longopts[] = {
 		{ "debug", no_argument, NULL, 'd' },
@@ -269,11 +3906,26 @@ int main(int argc, char **argv)
 		{ "local", no_argument, NULL, 'l' },
 		{ "network", no_argument, NULL, 'n' },
 		{ "source", required_argument, NULL, 's' },
+		{ "proxy", required_argument, NULL, 'p' },
+		{ "metrics", required_argument, NULL, 'm' },
+		{ "warm", required_argument, NULL, 'w' },
+		{ "warm-idle", required_argument, NULL, 'W' },
+		{ "fair", no_argument, NULL, 'f' },
+		{ "device-rate", required_argument, NULL, 'R' },
+		{ "config", required_argument, NULL, 'c' },
+		{ "acceptors", required_argument, NULL, 'a' },
+		{ "wait-device", required_argument, NULL, 'Q' },
+		{ "max-relays", required_argument, NULL, 'M' },
+		{ "max-device-relays", required_argument, NULL, 'D' },
+		{ "max-connects", required_argument, NULL, 'C' },
+		{ "queue", required_argument, NULL, 'q' },
+		{ "queue-timeout", required_argument, NULL, 'T' },
+		{ "io-uring", no_argument, NULL, 'U' },
 		{ "version", no_argument, NULL, 'v' },
 		{ NULL, 0, NULL, 0}
 	};
 	int c = 0;
-	while ((c = getopt_long(argc, argv, "dhu:lns:v", longopts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "dhu:lns:p:m:w:W:fR:c:a:Q:M:D:C:q:T:Uv", longopts, NULL)) != -1) {
 		switch (c) {
 		case 'd':
 			libusbmuxd_set_debug_level(++debug_level);
@@ -284,14 +3936,14 @@ int main(int argc, char **argv)
 				print_usage(argc, argv, 1);
 				return 2;
 			}
-			free(device_udid);
-			device_udid = strdup(optarg);
+			free(default_udid);
+			default_udid = strdup(optarg);
 			break;
 		case 'l':
-			lookup_opts |= DEVICE_LOOKUP_USBMUX;
+			default_lookup_opts |= DEVICE_LOOKUP_USBMUX;
 			break;
 		case 'n':
-			lookup_opts |= DEVICE_LOOKUP_NETWORK;
+			default_lookup_opts |= DEVICE_LOOKUP_NETWORK;
 			break;
 		case 's':
 			if (!*optarg) {
@@ -302,6 +3954,126 @@ int main(int argc, char **argv)
 			free(source_addr);
 			source_addr = strdup(optarg);
 			break;
+		case 'p': {
+			char* endp = NULL;
+			long l_port = strtol(optarg, &endp, 10);
+			if (l_port <= 0 || l_port > 65535 || (*endp != '\0' && *endp != ',')) {
+				fprintf(stderr, "ERROR: Invalid proxy port specified!\n");
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			proxy_port = (uint16_t)l_port;
+			proxy_opts = (*endp == ',') ? endp+1 : NULL;
+			} break;
+		case 'm': {
+			char* endp = NULL;
+			long l_port = strtol(optarg, &endp, 10);
+			if (l_port <= 0 || l_port > 65535 || *endp != '\0') {
+				fprintf(stderr, "ERROR: Invalid metrics port specified!\n");
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			metrics_port = (uint16_t)l_port;
+			} break;
+		case 'w': {
+			char* endp = NULL;
+			long l_port = strtol(optarg, &endp, 10);
+			long l_num = 0;
+			if (l_port > 0 && l_port <= 65535 && *endp == ':') {
+				l_num = strtol(endp+1, &endp, 10);
+			}
+			if (l_num <= 0 || l_num > 1024 || *endp != '\0') {
+				fprintf(stderr, "ERROR: Invalid warm pool specification '%s'!\n", optarg);
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			warm_specs = (struct warm_spec*)realloc(warm_specs, sizeof(struct warm_spec) * (num_warm_specs+1));
+			warm_specs[num_warm_specs].device_port = (uint16_t)l_port;
+			warm_specs[num_warm_specs].num = (int)l_num;
+			num_warm_specs++;
+			} break;
+		case 'W': {
+			char* endp = NULL;
+			long l_idle = strtol(optarg, &endp, 10);
+			if (l_idle <= 0 || *endp != '\0') {
+				fprintf(stderr, "ERROR: Invalid warm pool idle timeout specified!\n");
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			warm_idle = (unsigned int)l_idle;
+			} break;
+		case 'f':
+			fair_share = 1;
+			break;
+		case 'c':
+			free(config_path);
+			config_path = strdup(optarg);
+			break;
+		case 'Q': {
+			char* endp = NULL;
+			long l_wait = strtol(optarg, &endp, 10);
+			if (l_wait < 0 || l_wait > 86400 || *endp != '\0') {
+				fprintf(stderr, "ERROR: Invalid device wait time specified!\n");
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			device_wait = (unsigned int)l_wait;
+			} break;
+		case 'a': {
+			char* endp = NULL;
+			long l_num = strtol(optarg, &endp, 10);
+			if (l_num < 1 || l_num > 64 || *endp != '\0') {
+				fprintf(stderr, "ERROR: Invalid number of acceptors specified!\n");
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+#ifndef HAVE_ACCEPTOR_THREADS
+			if (l_num > 1) {
+				fprintf(stderr, "ERROR: Multiple acceptors are not supported on this platform.\n");
+				return 2;
+			}
+#endif
+			num_acceptors = (int)l_num;
+			} break;
+		case 'M':
+		case 'D':
+		case 'C':
+		case 'q':
+		case 'T': {
+			char* endp = NULL;
+			long l_val = strtol(optarg, &endp, 10);
+			if (l_val < 0 || l_val > 1000000 || endp == optarg || *endp != '\0') {
+				fprintf(stderr, "ERROR: Invalid value '%s' for option -%c specified!\n", optarg, c);
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			if (c == 'M') {
+				max_relays = (unsigned int)l_val;
+			} else if (c == 'D') {
+				max_device_relays = (unsigned int)l_val;
+			} else if (c == 'C') {
+				max_connects = (unsigned int)l_val;
+			} else if (c == 'q') {
+				queue_limit = (unsigned int)l_val;
+			} else {
+				queue_timeout = (unsigned int)l_val;
+			}
+			} break;
+		case 'U':
+#ifdef HAVE_LIBURING
+			use_uring = 1;
+#else
+			fprintf(stderr, "ERROR: iproxy was built without io_uring support.\n");
+			return 2;
+#endif
+			break;
+		case 'R':
+			if (parse_rate(optarg, optarg + strlen(optarg), &device_rate) < 0) {
+				fprintf(stderr, "ERROR: Invalid device rate specified!\n");
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			break;
 		case 'h':
 			print_usage(argc, argv, 0);
 			return 0;
@@ -314,165 +4086,200 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if (lookup_opts == 0) {
-		lookup_opts = DEVICE_LOOKUP_USBMUX;
+	if (default_lookup_opts == 0) {
+		default_lookup_opts = DEVICE_LOOKUP_USBMUX;
 	}
 
 	argc -= optind;
 	argv += optind;
 
-	if (argc == 0) {
+	if (argc == 0 && proxy_port == 0 && !config_path) {
 		fprintf(stderr, "ERROR: Not enough parameters. Need at least one pair of ports.\n");
 		print_usage(argc + optind, argv - optind, 1);
-		free(device_udid);
+		free(default_udid);
 		free(source_addr);
 		return 2;
 	}
 
+	mutex_init(&mappings_mutex);
+	gate_init(&connect_gate, max_connects);
+
 	if (argc == 2 && (strchr(argv[0], ':') == NULL) && (strchr(argv[1], ':') == NULL)) {
 		/* support old-style port pair specification */
-		char* endp = NULL;
-		listen_port[0] = (uint16_t)strtol(argv[0], &endp, 10);
-		if (!listen_port[0] || *endp != '\0') {
-			fprintf(stderr, "Invalid listen port specified in argument '%s'!\n", argv[0]);
-			free(device_udid);
+		char *pair = (char*)malloc(strlen(argv[0]) + strlen(argv[1]) + 2);
+		sprintf(pair, "%s:%s", argv[0], argv[1]);
+		res = add_port_mappings(&mappings, pair);
+		free(pair);
+		if (res < 0) {
+			fprintf(stderr, "Invalid %s port specified in argument '%s'!\n", (res == -1) ? "listen" : "device", (res == -1) ? argv[0] : argv[1]);
+			free(default_udid);
 			free(source_addr);
 			return EINVAL;
 		}
-		endp = NULL;
-		device_port[0] = (uint16_t)strtol(argv[1], &endp, 10);
-		if (!device_port[0] || *endp != '\0') {
-			fprintf(stderr, "Invalid device port specified in argument '%s'!\n", argv[1]);
-			free(device_udid);
-			free(source_addr);
-			return EINVAL;
-		}
-		num_pairs = 1;
 	} else {
 		/* new style, colon-separated local:device port pairs */
 		for (i = 0; i < argc; i++) {
-			char* endp = NULL;
-			listen_port[i] = (uint16_t)strtol(argv[i], &endp, 10);
-			if (!listen_port[i] || (*endp != ':')) {
-				fprintf(stderr, "Invalid listen port specified in argument '%s'!\n", argv[i]);
-				free(device_udid);
-				free(source_addr);
-				return EINVAL;
-			}
-			device_port[i] = (uint16_t)strtol(endp+1, &endp, 10);
-			if (!device_port[i] || (*endp != '\0')) {
-				fprintf(stderr, "Invalid device port specified in argument '%s'!\n", argv[i+1]);
-				free(device_udid);
+			res = add_port_mappings(&mappings, argv[i]);
+			if (res < 0) {
+				if (res == -3) {
+					fprintf(stderr, "Port ranges of different size specified in argument '%s'!\n", argv[i]);
+				} else if (res == -4) {
+					fprintf(stderr, "Invalid mapping options specified in argument '%s'!\n", argv[i]);
+				} else {
+					fprintf(stderr, "Invalid %s port specified in argument '%s'!\n", (res == -1) ? "listen" : "device", argv[i]);
+				}
+				free(default_udid);
 				free(source_addr);
 				return EINVAL;
 			}
 		}
-		num_pairs = argc;
 	}
 
-	if (num_pairs > 16) {
-		fprintf(stderr, "ERROR: Too many LOCAL:DEVICE port pairs. Maximum is 16.\n");
-		return 1;
+	if (config_path) {
+		struct mapping_list list = { NULL, 0 };
+		if (config_load(config_path, &list) < 0) {
+			free(default_udid);
+			free(source_addr);
+			return EINVAL;
+		}
+		for (i = 0; i < list.count; i++) {
+			mapping_list_add(&mappings, list.items[i]);
+		}
+		free(list.items);
+	}
+
+	if (proxy_port > 0) {
+		struct mapping *m = mapping_new(&mappings, LISTEN_TYPE_PROXY, NULL, proxy_port, 0);
+		struct mapping_options mo = { 1, 0, NULL, max_relays };
+		if (m && proxy_opts && parse_mapping_options(proxy_opts, &mo) < 0) {
+			fprintf(stderr, "Invalid proxy options '%s' specified!\n", proxy_opts);
+			free(mo.udid);
+			free(default_udid);
+			free(source_addr);
+			return EINVAL;
+		}
+		if (m) {
+			m->priority = mo.priority;
+			rate_limit_set(&m->limit, mo.rate);
+			m->max_relays = mo.max_relays;
+			if (m->max_relays > 0) {
+				mappings_limited = 1;
+			}
+		}
+		/* the device is chosen by the proxy request */
+		free(mo.udid);
+	}
+	if (metrics_port > 0) {
+		mapping_new(&mappings, LISTEN_TYPE_METRICS, NULL, metrics_port, 0);
 	}
 
 #ifndef _WIN32
 	signal(SIGPIPE, SIG_IGN);
+	if (config_path) {
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = handle_sighup;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGHUP, &sa, NULL);
+	}
 #endif
 
-	// first create the listening sockets
-	for (i = 0; i < num_pairs; i++) {
-		printf("Creating listening port %d for device port %d\n", listen_port[i], device_port[i]);
-		if (!source_addr) {
-			listen_sock[num_listen].fd = socket_create(NULL, listen_port[i]);
-			if (listen_sock[num_listen].fd < 0) {
-				int j;
-				fprintf(stderr, "Error creating socket for listen port %u: %s\n", listen_port[i], strerror(errno));
-				free(source_addr);
-				free(device_udid);
-				for (j = num_listen; j >= 0; j--) {
-					socket_close(listen_sock[j].fd);
-				}
-				return 1;
-			}
-			listen_sock[num_listen].index = i;
-			num_listen++;
-		} else {
-			listen_sock[num_listen].fd = socket_create(source_addr, listen_port[i]);
-			if (listen_sock[num_listen].fd < 0) {
-				int j;
-				fprintf(stderr, "Error creating socket for listen port %u: %s\n", listen_port[i], strerror(errno));
-				free(source_addr);
-				free(device_udid);
-				for (j = num_listen; j >= 0; j--) {
-					socket_close(listen_sock[j].fd);
-				}
-				return 1;
+	collection_init(&device_stats);
+	mutex_init(&device_stats_mutex);
+	collection_init(&device_scheds);
+	mutex_init(&device_scheds_mutex);
+	attached_init();
+
+#ifdef HAVE_LIBURING
+	if (use_uring && uring_init() < 0) {
+		fprintf(stderr, "WARNING: Could not set up io_uring, using relay threads: %s\n", strerror(errno));
+	}
+#endif
+
+	if (listen_loop_init(&loop) < 0 || acceptors_init() < 0) {
+		fprintf(stderr, "ERROR: Failed to set up event loop: %s\n", strerror(errno));
+		free(default_udid);
+		free(source_addr);
+		return 1;
+	}
+
+	// create the listening sockets
+	for (i = 0; i < mappings.count; i++) {
+		struct mapping *m = mappings.items[i];
+		if (mapping_start(m, &loop) < 0) {
+			int j;
+			fprintf(stderr, "Error creating socket for %s: %s\n", m->stats.label, strerror(errno));
+			for (j = 0; j < i; j++) {
+				mapping_close(mappings.items[j]);
 			}
-			listen_sock[num_listen].index = i;
-			num_listen++;
+			listen_loop_free(&loop);
+			free(source_addr);
+			free(default_udid);
+			return 1;
 		}
 	}
 
-	// make them non-blocking and add them to fd set
-	fd_set fds;
-	FD_ZERO(&fds);
-	for (i = 0; i < num_listen; i++) {
-#ifdef _WIN32
-		u_long l_yes = 1;
-		ioctlsocket(listen_sock[i].fd, FIONBIO, &l_yes);
-#else
-		int flags = fcntl(listen_sock[i].fd, F_GETFL, 0);
-		fcntl(listen_sock[i].fd, F_SETFL, flags | O_NONBLOCK);
-#endif
-		FD_SET(listen_sock[i].fd, &fds);
+	if (acceptors_start() < 0) {
+		fprintf(stderr, "ERROR: Failed to create acceptor threads!\n");
+		for (i = 0; i < mappings.count; i++) {
+			mapping_close(mappings.items[i]);
+		}
+		listen_loop_free(&loop);
+		free(source_addr);
+		free(default_udid);
+		return 1;
 	}
 
 	// main loop
 	while (1) {
-		printf("waiting for connection\n");
-		fd_set read_fds = fds;
-		int ret_sel = select(listen_sock[num_listen-1].fd+1, &read_fds, NULL, NULL, NULL);
-		if (ret_sel < 0) {
-			perror("select");
+		struct mapping *ready[64];
+		int num_ready;
+		if (print_waiting) {
+			printf("waiting for connection\n");
+			print_waiting = 0;
+		}
+		/* wake up regularly to check the configuration file for changes
+		 * and to disconnect clients that have been queued for too long */
+		num_ready = listen_loop_wait(&loop, ready, 64, (config_path || mappings_limited) ? 1000 : -1);
+		if (num_ready < 0) {
+			perror("wait");
 			break;
 		}
-		for (i = 0; i < num_listen; i++) {
-			if (FD_ISSET(listen_sock[i].fd, &read_fds)) {
-				THREAD_T acceptor = THREAD_T_NULL;
-				struct client_data *cdata;
-				int c_sock = socket_accept(listen_sock[i].fd, listen_port[listen_sock[i].index]);
-				if (c_sock < 0) {
-					fprintf(stderr, "accept: %s\n", strerror(errno));
-					break;
-				}
-				printf("New connection for %d->%d, fd = %d\n", listen_port[listen_sock[i].index], device_port[listen_sock[i].index], c_sock);
-				cdata = (struct client_data*)malloc(sizeof(struct client_data));
-				if (!cdata) {
-					socket_close(c_sock);
-					fprintf(stderr, "ERROR: Out of memory\n");
-					free(device_udid);
-					return 1;
-				}
-				cdata->fd = c_sock;
-				cdata->sfd = -1;
-				cdata->udid = (device_udid) ? strdup(device_udid) : NULL;
-				cdata->lookup_opts = lookup_opts;
-				cdata->device_port = device_port[listen_sock[i].index];
-
-				if (thread_new(&acceptor, acceptor_thread, cdata) == 0) {
-					thread_detach(acceptor);
-				} else {
-					fprintf(stderr, "ERROR: Failed to created acceptor thread!\n");
-				}
+		res = 0;
+		for (i = 0; i < num_ready; i++) {
+			if (handle_accept(ready[i], ready[i]->fd) < 0) {
+				res = -1;
+			}
+			print_waiting = 1;
+		}
+		out_of_fds = accept_backoff(res < 0, out_of_fds);
+		if (mappings_limited) {
+			for (i = 0; i < mappings.count; i++) {
+				mapping_expire_queue(mappings.items[i]);
 			}
 		}
+#ifndef _WIN32
+		if (reload_requested) {
+			reload_requested = 0;
+			config_reload(&loop);
+			print_waiting = 1;
+			continue;
+		}
+#endif
+		if (config_path && config_changed()) {
+			config_reload(&loop);
+			print_waiting = 1;
+		}
 	}
 
-	for (i = 0; i < num_listen; i++) {
-		socket_close(listen_sock[i].fd);
+	for (i = 0; i < mappings.count; i++) {
+		mapping_close(mappings.items[i]);
 	}
+	listen_loop_free(&loop);
 
-	free(device_udid);
+	free(warm_specs);
+	free(config_path);
+	free(default_udid);
 	free(source_addr);
 
 	return 0;
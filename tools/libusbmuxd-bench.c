@@ -0,0 +1,789 @@
+/*
+ * libusbmuxd-bench.c -- benchmarks for libusbmuxd and the tools
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <getopt.h>
+
+#include <libimobiledevice-glue/socket.h>
+#include <libimobiledevice-glue/thread.h>
+#include "usbmuxd.h"
+#include "device.h"
+
+#define STREAM_BUFFER_SIZE (128 * 1024)
+
+static const char *label = "";
+static const char *device_udid = NULL;
+static enum usbmux_lookup_options lookup_opts = 0;
+static usbmuxd_device_info_t device;
+static int have_device = 0;
+
+static uint64_t get_time_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Prints the start of a result line. Every result is one JSON object on
+ * its own line; print_latencies() and the callers append the fields and
+ * close it with print_end().
+ */
+static void print_begin(const char *bench)
+{
+	printf("{\"bench\":\"%s\",\"label\":\"%s\"", bench, label);
+}
+
+static void print_end(void)
+{
+	printf("}\n");
+	fflush(stdout);
+}
+
+static void print_latencies(uint64_t *samples, size_t num)
+{
+	uint64_t sum = 0;
+	size_t i;
+
+	if (num == 0) {
+		printf(",\"count\":0");
+		return;
+	}
+	qsort(samples, num, sizeof(uint64_t), compare_u64);
+	for (i = 0; i < num; i++) {
+		sum += samples[i];
+	}
+	printf(",\"count\":%zu,\"min_us\":%llu,\"avg_us\":%llu,\"p50_us\":%llu,\"p90_us\":%llu,\"p99_us\":%llu,\"max_us\":%llu",
+		num, (unsigned long long)samples[0], (unsigned long long)(sum / num),
+		(unsigned long long)samples[num / 2], (unsigned long long)samples[num * 90 / 100],
+		(unsigned long long)samples[num * 99 / 100], (unsigned long long)samples[num - 1]);
+}
+
+static int bench_device_list(int iterations)
+{
+	uint64_t *samples = (uint64_t*)calloc(iterations, sizeof(uint64_t));
+	int num_devices = -1;
+	int failed = 0;
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		usbmuxd_device_info_t *list = NULL;
+		uint64_t started = get_time_us();
+		int res = usbmuxd_get_device_list(&list);
+		samples[i] = get_time_us() - started;
+		if (res < 0) {
+			failed++;
+		} else {
+			num_devices = res;
+			usbmuxd_device_list_free(&list);
+		}
+	}
+	print_begin("device_list");
+	printf(",\"devices\":%d,\"errors\":%d", num_devices, failed);
+	print_latencies(samples, iterations);
+	print_end();
+	free(samples);
+
+	return (failed > 0);
+}
+
+/**
+ * Looks up the device selected with -u, -n and -l on first use, the same
+ * way inetcat does.
+ */
+static const usbmuxd_device_info_t *get_device(void)
+{
+	if (!have_device) {
+		if (select_device(device_udid, lookup_opts, &device) < 0) {
+			return NULL;
+		}
+		have_device = 1;
+	}
+	return &device;
+}
+
+static int bench_connect(int port, int iterations)
+{
+	uint64_t *samples = (uint64_t*)calloc(iterations, sizeof(uint64_t));
+	const usbmuxd_device_info_t *dev = get_device();
+	int failed = 0;
+	int i;
+
+	if (!dev) {
+		free(samples);
+		return 1;
+	}
+	for (i = 0; i < iterations; i++) {
+		uint64_t started = get_time_us();
+		int fd = connect_device(dev, port);
+		samples[i] = get_time_us() - started;
+		if (fd < 0) {
+			failed++;
+		} else {
+			socket_close(fd);
+		}
+	}
+	print_begin("connect");
+	printf(",\"port\":%d,\"errors\":%d", port, failed);
+	print_latencies(samples, iterations);
+	print_end();
+	free(samples);
+
+	return (failed > 0);
+}
+
+struct subscribe_state {
+	mutex_t mutex;
+	cond_t cond;
+	int added;
+};
+
+static void subscribe_cb(const usbmuxd_event_t *event, void *user_data)
+{
+	struct subscribe_state *state = (struct subscribe_state*)user_data;
+	if (event->event == UE_DEVICE_ADD) {
+		mutex_lock(&state->mutex);
+		state->added++;
+		cond_signal(&state->cond);
+		mutex_unlock(&state->mutex);
+	}
+}
+
+/**
+ * Measures how long it takes from subscribing until the add events of all
+ * num_devices attached devices have been delivered.
+ */
+static int bench_subscribe(int num_devices)
+{
+	struct subscribe_state state;
+	usbmuxd_subscription_context_t ctx = NULL;
+	uint64_t started, replayed = 0, unsubscribed;
+	int res;
+
+	memset(&state, 0, sizeof(state));
+	mutex_init(&state.mutex);
+	cond_init(&state.cond);
+
+	started = get_time_us();
+	res = usbmuxd_events_subscribe(&ctx, subscribe_cb, &state);
+	if (res != 0) {
+		fprintf(stderr, "ERROR: Could not subscribe (%d)\n", res);
+		return 1;
+	}
+	mutex_lock(&state.mutex);
+	while (state.added < num_devices) {
+		if (cond_wait_timeout(&state.cond, &state.mutex, 10000) != 0 && state.added < num_devices) {
+			break;
+		}
+	}
+	replayed = get_time_us() - started;
+	mutex_unlock(&state.mutex);
+
+	started = get_time_us();
+	usbmuxd_events_unsubscribe(ctx);
+	unsubscribed = get_time_us() - started;
+
+	print_begin("subscribe");
+	printf(",\"devices\":%d,\"received\":%d,\"replay_us\":%llu,\"unsubscribe_us\":%llu",
+		num_devices, state.added, (unsigned long long)replayed, (unsigned long long)unsubscribed);
+	print_end();
+	mutex_destroy(&state.mutex);
+	cond_destroy(&state.cond);
+
+	return (state.added < num_devices);
+}
+
+struct xml_state {
+	uint64_t encode_us;
+	uint64_t encoded;
+	uint64_t encoded_bytes;
+	uint64_t decode_us;
+	uint64_t decoded;
+	uint64_t decoded_bytes;
+};
+
+static void xml_trace_cb(const libusbmuxd_trace_t *trace, void *user_data)
+{
+	struct xml_state *state = (struct xml_state*)user_data;
+	if (trace->point == LIBUSBMUXD_TRACE_SEND_PACKET && trace->xml_us > 0) {
+		state->encode_us += trace->xml_us;
+		state->encoded++;
+		state->encoded_bytes += trace->size;
+	} else if (trace->point == LIBUSBMUXD_TRACE_RECEIVE_PACKET && trace->result > 0) {
+		state->decode_us += trace->xml_us;
+		state->decoded++;
+		state->decoded_bytes += trace->size;
+	}
+}
+
+/**
+ * Measures the plist encoding of requests and decoding of replies inside
+ * the library, using the trace records of ListDevices and Connect.
+ */
+static int bench_xml(int iterations)
+{
+	struct xml_state list_state, connect_state;
+	const usbmuxd_device_info_t *dev = get_device();
+	int i;
+
+	if (!dev) {
+		return 1;
+	}
+	memset(&list_state, 0, sizeof(list_state));
+	memset(&connect_state, 0, sizeof(connect_state));
+
+	libusbmuxd_set_trace_callback(xml_trace_cb, &list_state);
+	for (i = 0; i < iterations; i++) {
+		usbmuxd_device_info_t *list = NULL;
+		if (usbmuxd_get_device_list(&list) >= 0) {
+			usbmuxd_device_list_free(&list);
+		}
+	}
+	libusbmuxd_set_trace_callback(xml_trace_cb, &connect_state);
+	for (i = 0; i < iterations; i++) {
+		int fd = usbmuxd_connect(dev->handle, 9);
+		if (fd >= 0) {
+			usbmuxd_disconnect(fd);
+		}
+	}
+	libusbmuxd_set_trace_callback(NULL, NULL);
+
+#define XML_AVG(total, n) (unsigned long long)((n) ? (total) / (n) : 0)
+	print_begin("xml");
+	printf(",\"request\":\"ListDevices\",\"encode_avg_us\":%llu,\"request_bytes\":%llu,\"decode_avg_us\":%llu,\"reply_bytes\":%llu",
+		XML_AVG(list_state.encode_us, list_state.encoded), XML_AVG(list_state.encoded_bytes, list_state.encoded),
+		XML_AVG(list_state.decode_us, list_state.decoded), XML_AVG(list_state.decoded_bytes, list_state.decoded));
+	print_end();
+	print_begin("xml");
+	printf(",\"request\":\"Connect\",\"encode_avg_us\":%llu,\"request_bytes\":%llu,\"decode_avg_us\":%llu,\"reply_bytes\":%llu",
+		XML_AVG(connect_state.encode_us, connect_state.encoded), XML_AVG(connect_state.encoded_bytes, connect_state.encoded),
+		XML_AVG(connect_state.decode_us, connect_state.decoded), XML_AVG(connect_state.decoded_bytes, connect_state.decoded));
+	print_end();
+#undef XML_AVG
+
+	return 0;
+}
+
+/**
+ * Opens a connection to ADDR, which is device:PORT for a port on the
+ * selected device, a path for a unix domain socket, or HOST:PORT.
+ */
+static int connect_addr(const char *addr)
+{
+	const char *p = strrchr(addr, ':');
+	int fd;
+
+	if (strncmp(addr, "device:", 7) == 0) {
+		const usbmuxd_device_info_t *dev = get_device();
+		if (!dev) {
+			return -1;
+		}
+		fd = connect_device(dev, atoi(addr + 7));
+	} else if (addr[0] == '/' || addr[0] == '.' || !p) {
+		fd = socket_connect_unix(addr);
+	} else {
+		char *host = strdup(addr);
+		host[p - addr] = '\0';
+		fd = socket_connect(host, (uint16_t)atoi(p + 1));
+		free(host);
+	}
+	if (fd < 0) {
+		fprintf(stderr, "ERROR: Could not connect to %s\n", addr);
+	}
+	return fd;
+}
+
+static int recv_all(int fd, char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = recv(fd, buf, len, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * rr and stream run one thread per connection for the given time; the
+ * results of all connections are reported together.
+ */
+struct bench_conn {
+	const char *addr;
+	size_t size;
+	double seconds;
+	THREAD_T thread;
+	int failed;
+	uint64_t connect_us;
+	uint64_t elapsed_us;
+	uint64_t sent;
+	uint64_t received;
+	uint64_t *samples;
+	size_t num;
+};
+
+static void *rr_thread(void *arg)
+{
+	struct bench_conn *conn = (struct bench_conn*)arg;
+	size_t max_samples = 1 << 20;
+	char *buf = (char*)malloc(conn->size);
+	uint64_t started = get_time_us();
+	uint64_t end;
+	int fd;
+
+	conn->samples = (uint64_t*)calloc(max_samples, sizeof(uint64_t));
+	if (!buf || !conn->samples) {
+		conn->failed = 1;
+		free(buf);
+		return NULL;
+	}
+	fd = connect_addr(conn->addr);
+	conn->connect_us = get_time_us() - started;
+	if (fd < 0) {
+		conn->failed = 1;
+		free(buf);
+		return NULL;
+	}
+	memset(buf, 'x', conn->size);
+	started = get_time_us();
+	end = started + (uint64_t)(conn->seconds * 1000000);
+	while (conn->num < max_samples) {
+		uint64_t now = get_time_us();
+		if (now >= end) {
+			break;
+		}
+		if (send(fd, buf, conn->size, MSG_NOSIGNAL) != (ssize_t)conn->size || recv_all(fd, buf, conn->size) < 0) {
+			conn->failed = 1;
+			break;
+		}
+		conn->samples[conn->num++] = get_time_us() - now;
+	}
+	conn->elapsed_us = get_time_us() - started;
+	socket_close(fd);
+	free(buf);
+
+	return NULL;
+}
+
+/**
+ * Sends to the address as fast as possible for the given time while
+ * reading whatever comes back.
+ */
+static void *stream_thread(void *arg)
+{
+	struct bench_conn *conn = (struct bench_conn*)arg;
+	char *buf = (char*)malloc(STREAM_BUFFER_SIZE);
+	uint64_t started = get_time_us();
+	uint64_t end, now;
+	int fd;
+
+	if (!buf) {
+		conn->failed = 1;
+		return NULL;
+	}
+	fd = connect_addr(conn->addr);
+	conn->connect_us = get_time_us() - started;
+	if (fd < 0) {
+		conn->failed = 1;
+		free(buf);
+		return NULL;
+	}
+	memset(buf, 'x', STREAM_BUFFER_SIZE);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	started = now = get_time_us();
+	end = started + (uint64_t)(conn->seconds * 1000000);
+	while (now < end) {
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN | POLLOUT;
+		if (poll(&pfd, 1, 100) < 0 && errno != EINTR) {
+			conn->failed = 1;
+			break;
+		}
+		if (pfd.revents & (POLLERR | POLLHUP)) {
+			conn->failed = 1;
+			break;
+		}
+		if (pfd.revents & POLLIN) {
+			ssize_t n = recv(fd, buf, STREAM_BUFFER_SIZE, 0);
+			if (n > 0) {
+				conn->received += n;
+			} else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+				conn->failed = 1;
+				break;
+			}
+		}
+		if (pfd.revents & POLLOUT) {
+			ssize_t n = send(fd, buf, STREAM_BUFFER_SIZE, MSG_NOSIGNAL);
+			if (n > 0) {
+				conn->sent += n;
+			} else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+				conn->failed = 1;
+				break;
+			}
+		}
+		now = get_time_us();
+	}
+	conn->elapsed_us = now - started;
+	socket_close(fd);
+	free(buf);
+
+	return NULL;
+}
+
+/**
+ * Runs func on num_conns connections to addr at once and waits for all
+ * of them to finish.
+ *
+ * @return the connections, to be freed with bench_conns_free().
+ */
+static struct bench_conn *bench_conns_run(const char *addr, size_t size, double seconds, int num_conns, void *(*func)(void*))
+{
+	struct bench_conn *conns = (struct bench_conn*)calloc(num_conns, sizeof(struct bench_conn));
+	int i;
+
+	if (!conns) {
+		return NULL;
+	}
+	for (i = 0; i < num_conns; i++) {
+		conns[i].addr = addr;
+		conns[i].size = size;
+		conns[i].seconds = seconds;
+		if (thread_new(&conns[i].thread, func, &conns[i]) != 0) {
+			conns[i].thread = THREAD_T_NULL;
+			conns[i].failed = 1;
+		}
+	}
+	for (i = 0; i < num_conns; i++) {
+		if (conns[i].thread != THREAD_T_NULL) {
+			thread_join(conns[i].thread);
+			thread_free(conns[i].thread);
+		}
+	}
+	return conns;
+}
+
+static void bench_conns_free(struct bench_conn *conns, int num_conns)
+{
+	int i;
+
+	for (i = 0; i < num_conns; i++) {
+		free(conns[i].samples);
+	}
+	free(conns);
+}
+
+/**
+ * Prints the fields common to rr and stream and sums up the connections.
+ *
+ * @return the number of failed connections.
+ */
+static int print_conns(const char *bench, const char *addr, struct bench_conn *conns, int num_conns)
+{
+	uint64_t connect_us = 0;
+	int failed = 0;
+	int i;
+
+	for (i = 0; i < num_conns; i++) {
+		connect_us += conns[i].connect_us;
+		failed += conns[i].failed;
+	}
+	print_begin(bench);
+	printf(",\"addr\":\"%s\",\"connections\":%d,\"connect_us\":%llu,\"errors\":%d", addr, num_conns, (unsigned long long)(connect_us / num_conns), failed);
+
+	return failed;
+}
+
+static int bench_rr(const char *addr, size_t size, double seconds, int num_conns)
+{
+	struct bench_conn *conns;
+	uint64_t *samples;
+	size_t num = 0;
+	int failed;
+	int i;
+
+	if (size == 0 || seconds <= 0 || num_conns <= 0) {
+		return 2;
+	}
+	conns = bench_conns_run(addr, size, seconds, num_conns, rr_thread);
+	if (!conns) {
+		return 1;
+	}
+	for (i = 0; i < num_conns; i++) {
+		num += conns[i].num;
+	}
+	samples = (uint64_t*)malloc((num ? num : 1) * sizeof(uint64_t));
+	num = 0;
+	for (i = 0; samples && i < num_conns; i++) {
+		memcpy(samples + num, conns[i].samples, conns[i].num * sizeof(uint64_t));
+		num += conns[i].num;
+	}
+	failed = print_conns("rr", addr, conns, num_conns);
+	printf(",\"size\":%zu,\"per_s\":%.1f", size, num / seconds);
+	print_latencies(samples, num);
+	print_end();
+	free(samples);
+	bench_conns_free(conns, num_conns);
+
+	return (failed > 0);
+}
+
+static int bench_stream(const char *addr, double seconds, int num_conns)
+{
+	struct bench_conn *conns;
+	uint64_t sent = 0, received = 0, elapsed_us = 0;
+	double elapsed;
+	int failed;
+	int i;
+
+	if (seconds <= 0 || num_conns <= 0) {
+		return 2;
+	}
+	conns = bench_conns_run(addr, 0, seconds, num_conns, stream_thread);
+	if (!conns) {
+		return 1;
+	}
+	for (i = 0; i < num_conns; i++) {
+		sent += conns[i].sent;
+		received += conns[i].received;
+		if (conns[i].elapsed_us > elapsed_us) {
+			elapsed_us = conns[i].elapsed_us;
+		}
+	}
+	elapsed = (elapsed_us) ? elapsed_us / 1000000.0 : seconds;
+	failed = print_conns("stream", addr, conns, num_conns);
+	printf(",\"seconds\":%.3f,\"sent_bytes\":%llu,\"received_bytes\":%llu,\"sent_mb_per_s\":%.2f,\"received_mb_per_s\":%.2f",
+		elapsed, (unsigned long long)sent, (unsigned long long)received,
+		sent / elapsed / 1000000.0, received / elapsed / 1000000.0);
+	print_end();
+	bench_conns_free(conns, num_conns);
+
+	return (failed > 0);
+}
+
+/**
+ * Runs a command with stdin from infile ("-" for /dev/null) and stdout to
+ * /dev/null and reports its run time and the throughput for the given
+ * number of bytes.
+ */
+static int bench_exec(unsigned long long bytes, const char *infile, char **cmd)
+{
+	uint64_t started = get_time_us();
+	double elapsed;
+	int status = 0;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (pid == 0) {
+		int in = open((strcmp(infile, "-") == 0) ? "/dev/null" : infile, O_RDONLY);
+		int out = open("/dev/null", O_WRONLY);
+		if (in < 0 || out < 0) {
+			perror("open");
+			_exit(127);
+		}
+		dup2(in, STDIN_FILENO);
+		dup2(out, STDOUT_FILENO);
+		execvp(cmd[0], cmd);
+		perror("execvp");
+		_exit(127);
+	}
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+	elapsed = (get_time_us() - started) / 1000000.0;
+
+	print_begin("exec");
+	printf(",\"command\":\"%s\",\"exit\":%d,\"bytes\":%llu,\"seconds\":%.3f,\"mb_per_s\":%.2f",
+		cmd[0], WIFEXITED(status) ? WEXITSTATUS(status) : -1, bytes, elapsed, bytes / elapsed / 1000000.0);
+	print_end();
+
+	return !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+/**
+ * Waits up to 10 seconds until a connection to addr succeeds.
+ */
+static int wait_addr(const char *addr)
+{
+	int i;
+	for (i = 0; i < 100; i++) {
+		int fd;
+		if (addr[0] == '/' || addr[0] == '.') {
+			fd = socket_connect_unix(addr);
+		} else {
+			const char *p = strrchr(addr, ':');
+			char *host = strdup(addr);
+			if (!p) {
+				free(host);
+				return 1;
+			}
+			host[p - addr] = '\0';
+			fd = socket_connect(host, (uint16_t)atoi(p + 1));
+			free(host);
+		}
+		if (fd >= 0) {
+			socket_close(fd);
+			return 0;
+		}
+		usleep(100000);
+	}
+	fprintf(stderr, "ERROR: %s did not come up\n", addr);
+	return 1;
+}
+
+static void print_usage(char **argv)
+{
+	char *name = strrchr(argv[0], '/');
+	fprintf(stderr, "Usage: %s [OPTIONS] COMMAND ARGS\n", (name ? name+1 : argv[0]));
+	fprintf(stderr,
+		"\n" \
+		"Benchmarks for libusbmuxd, the tools and services on a device. Results are\n" \
+		"printed as one JSON object per line.\n" \
+		"\n" \
+		"COMMANDS:\n" \
+		"  device-list ITERATIONS   time usbmuxd_get_device_list()\n" \
+		"  connect PORT ITERATIONS  time connecting to PORT on the device\n" \
+		"  subscribe NUM_DEVICES    time until the add events of all devices arrived\n" \
+		"  xml ITERATIONS           plist encode/decode time of ListDevices and Connect\n" \
+		"  rr ADDR SIZE SECONDS [CONNECTIONS]\n" \
+		"                           request/response round trips of SIZE bytes\n" \
+		"  stream ADDR SECONDS [CONNECTIONS]\n" \
+		"                           throughput sending to ADDR and reading back\n" \
+		"  exec BYTES INFILE -- COMMAND [ARGS]  run COMMAND with stdin from INFILE\n" \
+		"                           (- for none) and report BYTES per run time\n" \
+		"  wait ADDR                wait until ADDR accepts connections\n" \
+		"\n" \
+		"ADDR is device:PORT for a port on the device, the path of a unix domain\n" \
+		"socket, or HOST:PORT. rr and stream use one connection unless CONNECTIONS\n" \
+		"is given, and report the sum of all connections.\n" \
+		"\n" \
+		"OPTIONS:\n" \
+		"  -u, --udid UDID    target specific device by UDID\n" \
+		"  -n, --network      connect to network device\n" \
+		"  -l, --local        connect to USB device (default)\n" \
+		"  -L, --label LABEL  add LABEL to every result\n" \
+		"  -h, --help         prints usage information\n" \
+		"\n"
+	);
+}
+
+int main(int argc, char **argv)
+{
+	const struct option longopts[] = {
+		{ "udid", required_argument, NULL, 'u' },
+		{ "network", no_argument, NULL, 'n' },
+		{ "local", no_argument, NULL, 'l' },
+		{ "label", required_argument, NULL, 'L' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const char *cmd;
+	char **args;
+	int nargs;
+	int c;
+
+	signal(SIGPIPE, SIG_IGN);
+	/* '+' stops at the command, so the arguments of exec are left alone */
+	while ((c = getopt_long(argc, argv, "+u:nlL:h", longopts, NULL)) != -1) {
+		switch (c) {
+		case 'u':
+			if (!*optarg) {
+				fprintf(stderr, "ERROR: UDID must not be empty!\n");
+				return 2;
+			}
+			device_udid = optarg;
+			break;
+		case 'n':
+			lookup_opts |= DEVICE_LOOKUP_NETWORK;
+			break;
+		case 'l':
+			lookup_opts |= DEVICE_LOOKUP_USBMUX;
+			break;
+		case 'L':
+			label = optarg;
+			break;
+		case 'h':
+			print_usage(argv);
+			return 0;
+		default:
+			print_usage(argv);
+			return 2;
+		}
+	}
+	if (lookup_opts == 0) {
+		lookup_opts = DEVICE_LOOKUP_USBMUX;
+	}
+	args = argv + optind - 1;
+	nargs = argc - optind + 1;
+	if (nargs < 2) {
+		print_usage(argv);
+		return 2;
+	}
+	cmd = args[1];
+
+	if (strcmp(cmd, "device-list") == 0 && nargs == 3) {
+		return bench_device_list(atoi(args[2]));
+	} else if (strcmp(cmd, "connect") == 0 && nargs == 4) {
+		return bench_connect(atoi(args[2]), atoi(args[3]));
+	} else if (strcmp(cmd, "subscribe") == 0 && nargs == 3) {
+		return bench_subscribe(atoi(args[2]));
+	} else if (strcmp(cmd, "xml") == 0 && nargs == 3) {
+		return bench_xml(atoi(args[2]));
+	} else if (strcmp(cmd, "rr") == 0 && (nargs == 5 || nargs == 6)) {
+		return bench_rr(args[2], (size_t)atoi(args[3]), atof(args[4]), (nargs == 6) ? atoi(args[5]) : 1);
+	} else if (strcmp(cmd, "stream") == 0 && (nargs == 4 || nargs == 5)) {
+		return bench_stream(args[2], atof(args[3]), (nargs == 5) ? atoi(args[4]) : 1);
+	} else if (strcmp(cmd, "exec") == 0 && nargs > 5 && strcmp(args[4], "--") == 0) {
+		return bench_exec(strtoull(args[2], NULL, 10), args[3], args + 5);
+	} else if (strcmp(cmd, "wait") == 0 && nargs == 3) {
+		return wait_addr(args[2]);
+	}
+	print_usage(argv);
+
+	return 2;
+}
@@ -0,0 +1,1392 @@
+/*
+ * mockmuxd.c -- usbmuxd stand-in for testing and benchmarking libusbmuxd
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define TOOL_NAME "mockmuxd"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <getopt.h>
+#include <plist/plist.h>
+#include <libimobiledevice-glue/socket.h>
+#include <libimobiledevice-glue/thread.h>
+#include <libimobiledevice-glue/collection.h>
+#include "usbmuxd-proto.h"
+
+#define MAX_PACKET_SIZE (1024 * 1024)
+#define RELAY_BUFFER_SIZE 65536
+
+/* device ports that are served by the mock itself instead of a local server */
+#define SERVICE_ECHO 7
+#define SERVICE_DISCARD 9
+#define SERVICE_CHARGEN 19
+
+enum fault_mode {
+	FAULT_CLOSE = 1 << 0,    /* close the connection instead of replying */
+	FAULT_ERROR = 1 << 1,    /* reply with RESULT_BADCOMMAND */
+	FAULT_TRUNCATE = 1 << 2, /* send half of the reply, then close */
+	FAULT_STALL = 1 << 3     /* do not reply, keep the connection open */
+};
+
+struct mock_device {
+	uint32_t id;
+	char udid[44];
+	int network;
+};
+
+struct mock_client {
+	int fd;
+	int listening;
+	int binary;
+	mutex_t send_mutex;
+};
+
+struct pair_record {
+	char *id;
+	char *data;
+	uint64_t size;
+};
+
+struct replay_record {
+	uint64_t time_us;
+	uint16_t type;
+	uint32_t length;
+	char *data;
+};
+
+/* the packets of one recorded connection to usbmuxd */
+struct replay_session {
+	uint32_t conn;
+	int used;
+	struct replay_record *records;
+	unsigned int num_records;
+	unsigned int capacity;
+};
+
+static int debug_level = 0;
+static int binary_only = 0;
+static unsigned int latency_ms = 0;
+static unsigned int jitter_ms = 0;
+static unsigned int connect_latency_ms = 0;
+static unsigned int fault_rate = 0;
+static unsigned int fault_modes = FAULT_CLOSE | FAULT_ERROR | FAULT_TRUNCATE;
+static const char *target_host = "127.0.0.1";
+static int port_offset = 0;
+static uint64_t synthetic_record_size = 0;
+static const char *buid = "00000000-0000-0000-0000-000000000000";
+static unsigned int random_state = 1;
+static int replay_fast = 0;
+
+/* devices, clients and pair records are protected by state_mutex */
+static mutex_t state_mutex;
+static struct collection devices;
+static struct collection clients;
+static struct collection pair_records;
+static struct replay_session *replay_sessions = NULL;
+static unsigned int replay_num_sessions = 0;
+
+static void debug(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void debug(int level, const char *fmt, ...)
+{
+	va_list args;
+	if (level > debug_level) {
+		return;
+	}
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+static unsigned int random_below(unsigned int limit)
+{
+	unsigned int res;
+	mutex_lock(&state_mutex);
+	res = (unsigned int)rand_r(&random_state) % limit;
+	mutex_unlock(&state_mutex);
+	return res;
+}
+
+static void sleep_ms(unsigned int ms)
+{
+	if (ms > 0) {
+		usleep(ms * 1000);
+	}
+}
+
+static void reply_delay(void)
+{
+	sleep_ms(latency_ms + ((jitter_ms > 0) ? random_below(jitter_ms + 1) : 0));
+}
+
+/**
+ * Picks a fault for the next reply according to the configured rate.
+ *
+ * @return 0 for no fault, otherwise one of the enabled fault modes.
+ */
+static int pick_fault(void)
+{
+	unsigned int modes[4];
+	int num = 0;
+	int i;
+
+	if (fault_rate == 0 || random_below(100) >= fault_rate) {
+		return 0;
+	}
+	for (i = 0; i < 4; i++) {
+		if (fault_modes & (1 << i)) {
+			modes[num++] = 1 << i;
+		}
+	}
+	return (num > 0) ? (int)modes[random_below(num)] : 0;
+}
+
+static int send_all(int fd, const void *data, size_t len)
+{
+	const char *p = (const char*)data;
+	while (len > 0) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int recv_all(int fd, void *data, size_t len)
+{
+	char *p = (char*)data;
+	while (len > 0) {
+		ssize_t n = recv(fd, p, len, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * Sends a packet to the client. With fault set, the packet is sent
+ * incompletely (FAULT_TRUNCATE).
+ */
+static int client_send(struct mock_client *client, uint32_t version, uint32_t message, uint32_t tag, const void *payload, uint32_t payload_size, int fault)
+{
+	struct usbmuxd_header hdr;
+	int res;
+
+	hdr.length = sizeof(hdr) + payload_size;
+	hdr.version = version;
+	hdr.message = message;
+	hdr.tag = tag;
+
+	mutex_lock(&client->send_mutex);
+	if (fault == FAULT_TRUNCATE) {
+		size_t total = sizeof(hdr) + payload_size;
+		char *buf = (char*)malloc(total);
+		memcpy(buf, &hdr, sizeof(hdr));
+		if (payload_size > 0) {
+			memcpy(buf + sizeof(hdr), payload, payload_size);
+		}
+		send_all(client->fd, buf, total / 2);
+		free(buf);
+		res = -1;
+	} else {
+		res = send_all(client->fd, &hdr, sizeof(hdr));
+		if (res == 0 && payload_size > 0) {
+			res = send_all(client->fd, payload, payload_size);
+		}
+	}
+	mutex_unlock(&client->send_mutex);
+
+	return res;
+}
+
+static int client_send_plist(struct mock_client *client, uint32_t tag, plist_t plist, int fault)
+{
+	char *xml = NULL;
+	uint32_t xml_len = 0;
+	int res;
+
+	plist_to_xml(plist, &xml, &xml_len);
+	res = client_send(client, 1, MESSAGE_PLIST, tag, xml, xml_len, fault);
+	free(xml);
+
+	return res;
+}
+
+static int client_send_result(struct mock_client *client, uint32_t tag, uint32_t result, int fault)
+{
+	if (client->binary) {
+		return client_send(client, 0, MESSAGE_RESULT, tag, &result, sizeof(result), fault);
+	} else {
+		plist_t plist = plist_new_dict();
+		int res;
+		plist_dict_set_item(plist, "MessageType", plist_new_string("Result"));
+		plist_dict_set_item(plist, "Number", plist_new_uint(result));
+		res = client_send_plist(client, tag, plist, fault);
+		plist_free(plist);
+		return res;
+	}
+}
+
+static plist_t device_properties(const struct mock_device *dev)
+{
+	plist_t props = plist_new_dict();
+	plist_dict_set_item(props, "ConnectionType", plist_new_string(dev->network ? "Network" : "USB"));
+	plist_dict_set_item(props, "DeviceID", plist_new_uint(dev->id));
+	plist_dict_set_item(props, "SerialNumber", plist_new_string(dev->udid));
+	if (dev->network) {
+		/* sockaddr_in of 127.0.0.1 with the BSD length byte first, as sent by usbmuxd */
+		char addr[16] = { 0x10, 0x02, 0, 0, 127, 0, 0, 1 };
+		plist_dict_set_item(props, "NetworkAddress", plist_new_data(addr, sizeof(addr)));
+		plist_dict_set_item(props, "EscapedFullServiceName", plist_new_string(dev->udid));
+	} else {
+		plist_dict_set_item(props, "LocationID", plist_new_uint(dev->id));
+		plist_dict_set_item(props, "ProductID", plist_new_uint(0x12a8));
+	}
+	return props;
+}
+
+static plist_t device_attached_message(const struct mock_device *dev)
+{
+	plist_t plist = plist_new_dict();
+	plist_dict_set_item(plist, "MessageType", plist_new_string("Attached"));
+	plist_dict_set_item(plist, "DeviceID", plist_new_uint(dev->id));
+	plist_dict_set_item(plist, "Properties", device_properties(dev));
+	return plist;
+}
+
+/**
+ * Sends a device event to a listening client. Must be called with
+ * state_mutex held.
+ */
+static void client_send_event(struct mock_client *client, const struct mock_device *dev, int message)
+{
+	if (client->binary) {
+		if (message == MESSAGE_DEVICE_ADD) {
+			struct usbmuxd_device_record rec;
+			memset(&rec, 0, sizeof(rec));
+			rec.device_id = dev->id;
+			rec.product_id = 0x12a8;
+			strncpy(rec.serial_number, dev->udid, sizeof(rec.serial_number)-1);
+			rec.location = dev->id;
+			client_send(client, 0, MESSAGE_DEVICE_ADD, 0, &rec, sizeof(rec), 0);
+		} else if (message == MESSAGE_DEVICE_REMOVE) {
+			uint32_t id = dev->id;
+			client_send(client, 0, MESSAGE_DEVICE_REMOVE, 0, &id, sizeof(id), 0);
+		}
+		/* there is no binary paired message */
+	} else {
+		plist_t plist;
+		if (message == MESSAGE_DEVICE_ADD) {
+			plist = device_attached_message(dev);
+		} else {
+			plist = plist_new_dict();
+			plist_dict_set_item(plist, "MessageType", plist_new_string((message == MESSAGE_DEVICE_REMOVE) ? "Detached" : "Paired"));
+			plist_dict_set_item(plist, "DeviceID", plist_new_uint(dev->id));
+		}
+		client_send_plist(client, 0, plist, 0);
+		plist_free(plist);
+	}
+}
+
+static void broadcast_event(const struct mock_device *dev, int message)
+{
+	FOREACH(struct mock_client *client, &clients) {
+		if (client->listening) {
+			client_send_event(client, dev, message);
+		}
+	} ENDFOREACH
+}
+
+/**
+ * Finds a device by its id. Must be called with state_mutex held.
+ */
+static struct mock_device *device_find(uint32_t id)
+{
+	FOREACH(struct mock_device *dev, &devices) {
+		if (dev->id == id) {
+			return dev;
+		}
+	} ENDFOREACH
+	return NULL;
+}
+
+static void device_attach(uint32_t id, const char *udid, int network)
+{
+	struct mock_device *dev;
+
+	mutex_lock(&state_mutex);
+	if (device_find(id)) {
+		mutex_unlock(&state_mutex);
+		debug(1, "device %u is already attached\n", id);
+		return;
+	}
+	dev = (struct mock_device*)calloc(1, sizeof(struct mock_device));
+	dev->id = id;
+	dev->network = network;
+	if (udid) {
+		strncpy(dev->udid, udid, sizeof(dev->udid)-1);
+	} else {
+		snprintf(dev->udid, sizeof(dev->udid), "00008000-%016X", id);
+	}
+	collection_add(&devices, dev);
+	broadcast_event(dev, MESSAGE_DEVICE_ADD);
+	mutex_unlock(&state_mutex);
+	debug(1, "attached device %u (%s)\n", id, dev->udid);
+}
+
+static void device_detach(uint32_t id)
+{
+	struct mock_device *dev;
+
+	mutex_lock(&state_mutex);
+	dev = device_find(id);
+	if (dev) {
+		broadcast_event(dev, MESSAGE_DEVICE_REMOVE);
+		collection_remove(&devices, dev);
+		free(dev);
+	}
+	mutex_unlock(&state_mutex);
+	debug(1, "detached device %u\n", id);
+}
+
+static void device_paired(uint32_t id)
+{
+	struct mock_device *dev;
+
+	mutex_lock(&state_mutex);
+	dev = device_find(id);
+	if (dev) {
+		broadcast_event(dev, MESSAGE_DEVICE_PAIRED);
+	}
+	mutex_unlock(&state_mutex);
+}
+
+/**
+ * Finds a pair record by its id. Must be called with state_mutex held.
+ */
+static struct pair_record *pair_record_find(const char *id)
+{
+	FOREACH(struct pair_record *rec, &pair_records) {
+		if (strcmp(rec->id, id) == 0) {
+			return rec;
+		}
+	} ENDFOREACH
+	return NULL;
+}
+
+static void pair_record_free(struct pair_record *rec)
+{
+	free(rec->id);
+	free(rec->data);
+	free(rec);
+}
+
+static int is_builtin_service(int port)
+{
+	return (port == SERVICE_ECHO || port == SERVICE_DISCARD || port == SERVICE_CHARGEN);
+}
+
+/**
+ * Relays between the client and the service connection sfd, or serves one
+ * of the built-in services if sfd is -1.
+ */
+static void relay_connection(int cfd, int port, int sfd)
+{
+	char *buf = (char*)malloc(RELAY_BUFFER_SIZE);
+	char *pattern = NULL;
+	struct pollfd pfds[2];
+
+	if (!buf) {
+		return;
+	}
+	if (port == SERVICE_CHARGEN) {
+		int i;
+		pattern = (char*)malloc(RELAY_BUFFER_SIZE);
+		for (i = 0; pattern && i < RELAY_BUFFER_SIZE; i++) {
+			pattern[i] = ' ' + (i % 95);
+		}
+		while (pattern) {
+			pfds[0].fd = cfd;
+			pfds[0].events = POLLIN | POLLOUT;
+			if (poll(pfds, 1, -1) < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				break;
+			}
+			if (pfds[0].revents & (POLLIN | POLLERR | POLLHUP)) {
+				/* input is discarded, the stream ends when the client closes */
+				if (recv(cfd, buf, RELAY_BUFFER_SIZE, 0) <= 0) {
+					break;
+				}
+			}
+			if ((pfds[0].revents & POLLOUT) && send(cfd, pattern, RELAY_BUFFER_SIZE, MSG_NOSIGNAL) < 0) {
+				break;
+			}
+		}
+		free(pattern);
+		free(buf);
+		return;
+	}
+	if (port == SERVICE_ECHO || port == SERVICE_DISCARD) {
+		while (1) {
+			ssize_t n = recv(cfd, buf, RELAY_BUFFER_SIZE, 0);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				break;
+			}
+			if (port == SERVICE_ECHO && send_all(cfd, buf, n) < 0) {
+				break;
+			}
+		}
+		free(buf);
+		return;
+	}
+
+	pfds[0].fd = cfd;
+	pfds[1].fd = sfd;
+	pfds[0].events = pfds[1].events = POLLIN;
+	while (pfds[0].events || pfds[1].events) {
+		int i;
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		for (i = 0; i < 2; i++) {
+			ssize_t n;
+			if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+				continue;
+			}
+			n = recv(pfds[i].fd, buf, RELAY_BUFFER_SIZE, 0);
+			if (n <= 0) {
+				/* pass on the half-close */
+				pfds[i].events = 0;
+				pfds[i].fd = -1;
+				shutdown((i == 0) ? sfd : cfd, SHUT_WR);
+				if (n < 0) {
+					pfds[0].events = pfds[1].events = 0;
+				}
+			} else if (send_all((i == 0) ? sfd : cfd, buf, n) < 0) {
+				pfds[0].events = pfds[1].events = 0;
+			}
+		}
+	}
+	free(buf);
+}
+
+/**
+ * Answers a Connect request.
+ *
+ * @return 1 if the connection has become a device connection, 0 to keep
+ *     serving requests, or -1 to close it.
+ */
+static int handle_connect(struct mock_client *client, uint32_t tag, uint32_t device_id, uint16_t port, int fault)
+{
+	int found;
+	int sfd = -1;
+
+	sleep_ms(connect_latency_ms);
+	mutex_lock(&state_mutex);
+	found = (device_find(device_id) != NULL);
+	mutex_unlock(&state_mutex);
+	if (!found) {
+		client_send_result(client, tag, RESULT_BADDEV, 0);
+		return 0;
+	}
+	if (!is_builtin_service(port)) {
+		sfd = socket_connect(target_host, (uint16_t)(port + port_offset));
+		if (sfd < 0) {
+			client_send_result(client, tag, RESULT_CONNREFUSED, 0);
+			return 0;
+		}
+	}
+	if (client_send_result(client, tag, RESULT_OK, fault) < 0) {
+		if (sfd >= 0) {
+			socket_close(sfd);
+		}
+		return -1;
+	}
+	debug(1, "connection to port %u of device %u\n", port, device_id);
+	relay_connection(client->fd, port, sfd);
+	if (sfd >= 0) {
+		socket_close(sfd);
+	}
+	return 1;
+}
+
+static int handle_plist_request(struct mock_client *client, uint32_t tag, plist_t request, int fault)
+{
+	char *type = NULL;
+	plist_t node;
+	int res = 0;
+
+	node = plist_dict_get_item(request, "MessageType");
+	if (node && plist_get_node_type(node) == PLIST_STRING) {
+		plist_get_string_val(node, &type);
+	}
+	if (!type) {
+		return client_send_result(client, tag, RESULT_BADCOMMAND, fault);
+	}
+	debug(2, "plist request %s tag %u\n", type, tag);
+
+	if (strcmp(type, "Listen") == 0) {
+		res = client_send_result(client, tag, RESULT_OK, fault);
+		if (res == 0) {
+			mutex_lock(&state_mutex);
+			client->listening = 1;
+			FOREACH(struct mock_device *dev, &devices) {
+				client_send_event(client, dev, MESSAGE_DEVICE_ADD);
+			} ENDFOREACH
+			mutex_unlock(&state_mutex);
+		}
+	} else if (strcmp(type, "ListDevices") == 0) {
+		plist_t reply = plist_new_dict();
+		plist_t list = plist_new_array();
+		mutex_lock(&state_mutex);
+		FOREACH(struct mock_device *dev, &devices) {
+			plist_array_append_item(list, device_attached_message(dev));
+		} ENDFOREACH
+		mutex_unlock(&state_mutex);
+		plist_dict_set_item(reply, "DeviceList", list);
+		res = client_send_plist(client, tag, reply, fault);
+		plist_free(reply);
+	} else if (strcmp(type, "Connect") == 0) {
+		uint64_t device_id = 0;
+		uint64_t port = 0;
+		plist_get_uint_val(plist_dict_get_item(request, "DeviceID"), &device_id);
+		plist_get_uint_val(plist_dict_get_item(request, "PortNumber"), &port);
+		res = handle_connect(client, tag, (uint32_t)device_id, ntohs((uint16_t)port), fault);
+	} else if (strcmp(type, "ReadBUID") == 0) {
+		plist_t reply = plist_new_dict();
+		plist_dict_set_item(reply, "BUID", plist_new_string(buid));
+		res = client_send_plist(client, tag, reply, fault);
+		plist_free(reply);
+	} else if (strcmp(type, "ReadPairRecord") == 0 || strcmp(type, "SavePairRecord") == 0 || strcmp(type, "DeletePairRecord") == 0) {
+		char *record_id = NULL;
+		plist_get_string_val(plist_dict_get_item(request, "PairRecordID"), &record_id);
+		if (!record_id) {
+			res = client_send_result(client, tag, RESULT_BADCOMMAND, fault);
+		} else if (type[0] == 'R') {
+			plist_t reply = NULL;
+			struct pair_record *rec;
+			mutex_lock(&state_mutex);
+			rec = pair_record_find(record_id);
+			if (rec) {
+				reply = plist_new_dict();
+				plist_dict_set_item(reply, "PairRecordData", plist_new_data(rec->data, rec->size));
+			}
+			mutex_unlock(&state_mutex);
+			if (!reply && synthetic_record_size > 0) {
+				char *data = (char*)malloc(synthetic_record_size);
+				uint64_t i;
+				for (i = 0; i < synthetic_record_size; i++) {
+					data[i] = (char)(i * 7);
+				}
+				reply = plist_new_dict();
+				plist_dict_set_item(reply, "PairRecordData", plist_new_data(data, synthetic_record_size));
+				free(data);
+			}
+			if (reply) {
+				res = client_send_plist(client, tag, reply, fault);
+				plist_free(reply);
+			} else {
+				res = client_send_result(client, tag, RESULT_BADDEV, fault);
+			}
+		} else if (type[0] == 'S') {
+			plist_t data = plist_dict_get_item(request, "PairRecordData");
+			uint64_t device_id = 0;
+			if (!data || plist_get_node_type(data) != PLIST_DATA) {
+				res = client_send_result(client, tag, RESULT_BADCOMMAND, fault);
+			} else {
+				struct pair_record *rec;
+				mutex_lock(&state_mutex);
+				rec = pair_record_find(record_id);
+				if (!rec) {
+					rec = (struct pair_record*)calloc(1, sizeof(struct pair_record));
+					rec->id = strdup(record_id);
+					collection_add(&pair_records, rec);
+				}
+				free(rec->data);
+				plist_get_data_val(data, &rec->data, &rec->size);
+				mutex_unlock(&state_mutex);
+				res = client_send_result(client, tag, RESULT_OK, fault);
+				plist_get_uint_val(plist_dict_get_item(request, "DeviceID"), &device_id);
+				if (device_id > 0) {
+					device_paired((uint32_t)device_id);
+				}
+			}
+		} else {
+			struct pair_record *rec;
+			mutex_lock(&state_mutex);
+			rec = pair_record_find(record_id);
+			if (rec) {
+				collection_remove(&pair_records, rec);
+				pair_record_free(rec);
+			}
+			mutex_unlock(&state_mutex);
+			res = client_send_result(client, tag, rec ? RESULT_OK : RESULT_BADDEV, fault);
+		}
+		free(record_id);
+	} else {
+		debug(1, "unsupported request %s\n", type);
+		res = client_send_result(client, tag, RESULT_BADCOMMAND, fault);
+	}
+	free(type);
+
+	return res;
+}
+
+static void *client_thread(void *arg)
+{
+	struct mock_client *client = (struct mock_client*)arg;
+	struct usbmuxd_header hdr;
+	char *payload = NULL;
+
+	while (recv_all(client->fd, &hdr, sizeof(hdr)) == 0) {
+		uint32_t payload_size;
+		int fault;
+		int res = 0;
+
+		if (hdr.length < sizeof(hdr) || hdr.length > MAX_PACKET_SIZE) {
+			debug(1, "invalid packet length %u\n", hdr.length);
+			break;
+		}
+		payload_size = hdr.length - sizeof(hdr);
+		free(payload);
+		payload = (char*)malloc(payload_size + 1);
+		if (!payload || recv_all(client->fd, payload, payload_size) < 0) {
+			break;
+		}
+
+		reply_delay();
+		fault = pick_fault();
+		if (fault == FAULT_CLOSE) {
+			debug(1, "injected fault: closing connection\n");
+			break;
+		}
+		if (fault == FAULT_STALL) {
+			debug(1, "injected fault: not replying\n");
+			continue;
+		}
+		if (fault == FAULT_ERROR) {
+			debug(1, "injected fault: error reply\n");
+			client->binary = (hdr.version == 0);
+			client_send_result(client, hdr.tag, RESULT_BADCOMMAND, 0);
+			continue;
+		}
+
+		if (hdr.version == 1 && hdr.message == MESSAGE_PLIST) {
+			plist_t request = NULL;
+			if (binary_only) {
+				/* like an old usbmuxd: a binary result asking for the binary protocol */
+				client->binary = 1;
+				res = client_send_result(client, hdr.tag, RESULT_BADVERSION, fault);
+			} else {
+				client->binary = 0;
+				plist_from_xml(payload, payload_size, &request);
+				if (!request) {
+					res = client_send_result(client, hdr.tag, RESULT_BADCOMMAND, fault);
+				} else {
+					res = handle_plist_request(client, hdr.tag, request, fault);
+					plist_free(request);
+				}
+			}
+		} else if (hdr.version == 0) {
+			client->binary = 1;
+			if (hdr.message == MESSAGE_LISTEN) {
+				res = client_send_result(client, hdr.tag, RESULT_OK, fault);
+				if (res == 0) {
+					mutex_lock(&state_mutex);
+					client->listening = 1;
+					FOREACH(struct mock_device *dev, &devices) {
+						client_send_event(client, dev, MESSAGE_DEVICE_ADD);
+					} ENDFOREACH
+					mutex_unlock(&state_mutex);
+				}
+			} else if (hdr.message == MESSAGE_CONNECT && payload_size >= 8) {
+				uint32_t device_id;
+				uint16_t port;
+				memcpy(&device_id, payload, sizeof(device_id));
+				memcpy(&port, payload + 4, sizeof(port));
+				res = handle_connect(client, hdr.tag, device_id, ntohs(port), fault);
+			} else {
+				res = client_send_result(client, hdr.tag, RESULT_BADCOMMAND, fault);
+			}
+		} else {
+			res = client_send_result(client, hdr.tag, RESULT_BADVERSION, fault);
+		}
+		if (res != 0) {
+			/* closed after a device connection ended, or sending failed */
+			break;
+		}
+	}
+	free(payload);
+
+	mutex_lock(&state_mutex);
+	collection_remove(&clients, client);
+	mutex_unlock(&state_mutex);
+	socket_close(client->fd);
+	mutex_destroy(&client->send_mutex);
+	free(client);
+
+	return NULL;
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct replay_session *replay_session_new(uint32_t conn)
+{
+	struct replay_session *sessions = (struct replay_session*)realloc(replay_sessions, (replay_num_sessions + 1) * sizeof(struct replay_session));
+	if (!sessions) {
+		return NULL;
+	}
+	replay_sessions = sessions;
+	memset(&sessions[replay_num_sessions], 0, sizeof(struct replay_session));
+	sessions[replay_num_sessions].conn = conn;
+	return &sessions[replay_num_sessions++];
+}
+
+/** Reads a little-endian value of size bytes from buf. */
+static uint64_t get_le(const unsigned char *buf, int size)
+{
+	uint64_t val = 0;
+	int i;
+	for (i = size - 1; i >= 0; i--) {
+		val = (val << 8) | buf[i];
+	}
+	return val;
+}
+
+/** Converts the little-endian usbmuxd_header at the start of data in place. */
+static void header_to_host(char *data)
+{
+	struct usbmuxd_header hdr;
+	const unsigned char *le = (const unsigned char*)data;
+
+	hdr.length = (uint32_t)get_le(le, 4);
+	hdr.version = (uint32_t)get_le(le + 4, 4);
+	hdr.message = (uint32_t)get_le(le + 8, 4);
+	hdr.tag = (uint32_t)get_le(le + 12, 4);
+	memcpy(data, &hdr, sizeof(hdr));
+}
+
+/**
+ * Loads a capture file written by libusbmuxd and splits it into the
+ * sessions of the recorded connections. The little-endian records and
+ * packet headers of the file are converted to host byte order.
+ */
+static int replay_load(const char *path)
+{
+	struct usbmuxd_capture_record rec;
+	unsigned char raw[sizeof(struct usbmuxd_capture_record)];
+	char magic[USBMUXD_CAPTURE_MAGIC_LEN];
+	unsigned int num_packets = 0;
+	FILE *f = fopen(path, "rb");
+
+	if (!f) {
+		fprintf(stderr, "ERROR: Could not open capture %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, USBMUXD_CAPTURE_MAGIC, sizeof(magic)) != 0) {
+		fprintf(stderr, "ERROR: %s is not a libusbmuxd capture file\n", path);
+		fclose(f);
+		return -1;
+	}
+	while (fread(raw, sizeof(raw), 1, f) == 1) {
+		struct replay_session *session = NULL;
+		char *data = NULL;
+		int i;
+
+		rec.time_us = get_le(raw, 8);
+		rec.conn = (uint32_t)get_le(raw + 8, 4);
+		rec.type = (uint16_t)get_le(raw + 12, 2);
+		rec.length = (uint32_t)get_le(raw + 16, 4);
+		/* packets carry at least a header, open and close records usually nothing */
+		if (rec.length > MAX_PACKET_SIZE
+		 || ((rec.length > 0 || rec.type == CAPTURE_SEND || rec.type == CAPTURE_RECEIVE) && rec.length < sizeof(struct usbmuxd_header))) {
+			fprintf(stderr, "ERROR: %s: invalid record length %u\n", path, rec.length);
+			break;
+		}
+		if (rec.length > 0) {
+			data = (char*)malloc(rec.length);
+			if (!data || fread(data, 1, rec.length, f) != rec.length) {
+				fprintf(stderr, "WARNING: %s: capture ends in the middle of a packet\n", path);
+				free(data);
+				break;
+			}
+			header_to_host(data);
+		}
+		if (rec.type != CAPTURE_OPEN) {
+			/* packets belong to the latest connection with their number */
+			for (i = (int)replay_num_sessions - 1; i >= 0; i--) {
+				if (replay_sessions[i].conn == rec.conn) {
+					session = &replay_sessions[i];
+					break;
+				}
+			}
+		}
+		if (!session) {
+			session = replay_session_new(rec.conn);
+		}
+		if (!session || (rec.type != CAPTURE_SEND && rec.type != CAPTURE_RECEIVE)) {
+			free(data);
+			continue;
+		}
+		if (session->num_records == session->capacity) {
+			unsigned int capacity = (session->capacity > 0) ? session->capacity * 2 : 8;
+			struct replay_record *records = (struct replay_record*)realloc(session->records, capacity * sizeof(struct replay_record));
+			if (!records) {
+				free(data);
+				break;
+			}
+			session->records = records;
+			session->capacity = capacity;
+		}
+		session->records[session->num_records].time_us = rec.time_us;
+		session->records[session->num_records].type = rec.type;
+		session->records[session->num_records].length = rec.length;
+		session->records[session->num_records].data = data;
+		session->num_records++;
+		num_packets++;
+	}
+	fclose(f);
+	debug(1, "loaded %u sessions with %u packets from %s\n", replay_num_sessions, num_packets, path);
+
+	return (replay_num_sessions > 0) ? 0 : -1;
+}
+
+/**
+ * Describes a request by its message type, and for plist requests also by
+ * the MessageType, so a connection can be matched to a recorded session.
+ */
+static void request_key(const struct usbmuxd_header *hdr, const char *payload, char *key, size_t size)
+{
+	snprintf(key, size, "%u", hdr->message);
+	if (hdr->message == MESSAGE_PLIST && hdr->length > sizeof(*hdr)) {
+		plist_t request = NULL;
+		plist_from_xml(payload, hdr->length - sizeof(*hdr), &request);
+		if (request) {
+			plist_t node = plist_dict_get_item(request, "MessageType");
+			const char *type = (node && plist_get_node_type(node) == PLIST_STRING) ? plist_get_string_ptr(node, NULL) : NULL;
+			if (type) {
+				snprintf(key, size, "%u:%s", hdr->message, type);
+			}
+			plist_free(request);
+		}
+	}
+}
+
+/**
+ * Picks the first unused session whose first request matches key, or the
+ * first unused one if none does. Once all sessions were played back the
+ * capture starts over.
+ */
+static struct replay_session *replay_session_pick(const char *key)
+{
+	struct replay_session *res = NULL;
+	unsigned int i, j;
+
+	mutex_lock(&state_mutex);
+	for (j = 0; j < 2 && !res; j++) {
+		for (i = 0; i < replay_num_sessions && !res; i++) {
+			struct replay_session *session = &replay_sessions[i];
+			if (!session->used && session->num_records > 0 && session->records[0].type == CAPTURE_SEND) {
+				char session_key[64];
+				request_key((struct usbmuxd_header*)session->records[0].data, session->records[0].data + sizeof(struct usbmuxd_header), session_key, sizeof(session_key));
+				if (strcmp(session_key, key) == 0) {
+					res = session;
+				}
+			}
+		}
+		for (i = 0; i < replay_num_sessions && !res; i++) {
+			if (!replay_sessions[i].used) {
+				res = &replay_sessions[i];
+			}
+		}
+		if (!res) {
+			for (i = 0; i < replay_num_sessions; i++) {
+				replay_sessions[i].used = 0;
+			}
+		}
+	}
+	if (res) {
+		res->used = 1;
+	}
+	mutex_unlock(&state_mutex);
+
+	return res;
+}
+
+static int recv_packet(int fd, struct usbmuxd_header *hdr, char **payload)
+{
+	free(*payload);
+	*payload = NULL;
+	if (recv_all(fd, hdr, sizeof(*hdr)) < 0 || hdr->length < sizeof(*hdr) || hdr->length > MAX_PACKET_SIZE) {
+		return -1;
+	}
+	*payload = (char*)malloc(hdr->length - sizeof(*hdr) + 1);
+	if (!*payload || recv_all(fd, *payload, hdr->length - sizeof(*hdr)) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Plays a recorded session back to a client. Each recorded request is
+ * answered by reading the next request of the client, and the recorded
+ * replies and events are sent with their original delay after the request
+ * before them, or right away with --fast. Replies get the tag of the
+ * client's request. When the session is over, anything the client sends
+ * is discarded until it closes the connection.
+ */
+static void *replay_thread(void *arg)
+{
+	struct mock_client *client = (struct mock_client*)arg;
+	struct replay_session *session;
+	struct usbmuxd_header hdr;
+	char *payload = NULL;
+	char key[64];
+	uint64_t anchor_real, anchor_time = 0;
+	uint32_t tag;
+	int have_request = 1;
+	unsigned int i;
+
+	if (recv_packet(client->fd, &hdr, &payload) < 0) {
+		goto leave;
+	}
+	request_key(&hdr, payload, key, sizeof(key));
+	session = replay_session_pick(key);
+	if (!session) {
+		goto leave;
+	}
+	debug(1, "replaying session %u (%s) with %u packets\n", (unsigned int)(session - replay_sessions), key, session->num_records);
+	tag = hdr.tag;
+	anchor_real = now_us();
+	if (session->num_records > 0) {
+		anchor_time = session->records[0].time_us;
+	}
+
+	for (i = 0; i < session->num_records; i++) {
+		struct replay_record *rec = &session->records[i];
+		if (rec->type == CAPTURE_SEND) {
+			if (have_request) {
+				have_request = 0;
+			} else if (recv_packet(client->fd, &hdr, &payload) < 0) {
+				goto leave;
+			} else {
+				tag = hdr.tag;
+			}
+			anchor_real = now_us();
+			anchor_time = rec->time_us;
+		} else {
+			struct usbmuxd_header reply;
+			int res;
+			if (!replay_fast && rec->time_us > anchor_time) {
+				uint64_t target = anchor_real + (rec->time_us - anchor_time);
+				uint64_t now = now_us();
+				if (target > now) {
+					usleep((useconds_t)(target - now));
+				}
+			}
+			memcpy(&reply, rec->data, sizeof(reply));
+			if (reply.tag != 0) {
+				reply.tag = tag;
+			}
+			mutex_lock(&client->send_mutex);
+			res = send_all(client->fd, &reply, sizeof(reply));
+			if (res == 0 && rec->length > sizeof(reply)) {
+				res = send_all(client->fd, rec->data + sizeof(reply), rec->length - sizeof(reply));
+			}
+			mutex_unlock(&client->send_mutex);
+			if (res < 0) {
+				goto leave;
+			}
+		}
+	}
+	while (recv(client->fd, key, sizeof(key), 0) > 0);
+
+leave:
+	free(payload);
+
+	mutex_lock(&state_mutex);
+	collection_remove(&clients, client);
+	mutex_unlock(&state_mutex);
+	socket_close(client->fd);
+	mutex_destroy(&client->send_mutex);
+	free(client);
+
+	return NULL;
+}
+
+/**
+ * Runs the attach/detach script. Each line holds one command:
+ *   attach ID [UDID] [usb|network]
+ *   detach ID
+ *   pair ID
+ *   sleep MS
+ *   repeat     (start over from the first line)
+ * Empty lines and everything after a '#' are ignored.
+ */
+static void *script_thread(void *arg)
+{
+	const char *path = (const char*)arg;
+	char line[256];
+	FILE *f = fopen(path, "r");
+	int lineno = 0;
+
+	if (!f) {
+		fprintf(stderr, "ERROR: Could not open script %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		char cmd[16] = "";
+		char udid[44] = "";
+		char type[16] = "";
+		unsigned int val = 0;
+		char *p = strchr(line, '#');
+		int n;
+
+		lineno++;
+		if (p) {
+			*p = '\0';
+		}
+		n = sscanf(line, "%15s %u %43s %15s", cmd, &val, udid, type);
+		if (n <= 0) {
+			continue;
+		}
+		if (strcmp(cmd, "repeat") == 0) {
+			rewind(f);
+			lineno = 0;
+		} else if (n < 2) {
+			fprintf(stderr, "ERROR: %s:%d: missing argument\n", path, lineno);
+		} else if (strcmp(cmd, "attach") == 0) {
+			int network = (n >= 4 && strcmp(type, "network") == 0) || (n == 3 && strcmp(udid, "network") == 0);
+			device_attach(val, (n >= 3 && strcmp(udid, "usb") != 0 && strcmp(udid, "network") != 0) ? udid : NULL, network);
+		} else if (strcmp(cmd, "detach") == 0) {
+			device_detach(val);
+		} else if (strcmp(cmd, "pair") == 0) {
+			device_paired(val);
+		} else if (strcmp(cmd, "sleep") == 0) {
+			sleep_ms(val);
+		} else {
+			fprintf(stderr, "ERROR: %s:%d: unknown command '%s'\n", path, lineno, cmd);
+		}
+	}
+	fclose(f);
+
+	return NULL;
+}
+
+static int parse_fault_modes(const char *list)
+{
+	char *copy = strdup(list);
+	char *tok;
+	char *saveptr = NULL;
+	int modes = 0;
+
+	for (tok = strtok_r(copy, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+		if (strcmp(tok, "close") == 0) {
+			modes |= FAULT_CLOSE;
+		} else if (strcmp(tok, "error") == 0) {
+			modes |= FAULT_ERROR;
+		} else if (strcmp(tok, "truncate") == 0) {
+			modes |= FAULT_TRUNCATE;
+		} else if (strcmp(tok, "stall") == 0) {
+			modes |= FAULT_STALL;
+		} else {
+			modes = -1;
+			break;
+		}
+	}
+	free(copy);
+
+	return modes;
+}
+
+/**
+ * Creates the listening socket for an address in the format used by
+ * USBMUXD_SOCKET_ADDRESS: UNIX:/path or HOST:PORT.
+ */
+static int create_listen_socket(const char *addr)
+{
+	if (strncmp(addr, "UNIX:", 5) == 0) {
+		unlink(addr + 5);
+		return socket_create_unix(addr + 5);
+	} else {
+		char *host = strdup(addr);
+		char *p = strrchr(host, ':');
+		int fd = -1;
+		if (p) {
+			long port;
+			*p = '\0';
+			port = strtol(p + 1, NULL, 10);
+			if (port > 0 && port < 65536) {
+				fd = socket_create((host[0] != '\0') ? host : NULL, (uint16_t)port);
+			}
+		}
+		free(host);
+		return fd;
+	}
+}
+
+static void print_usage(int argc, char **argv, int is_error)
+{
+	char *name = NULL;
+	name = strrchr(argv[0], '/');
+	fprintf(is_error ? stderr : stdout, "Usage: %s [OPTIONS]\n", (name ? name+1 : argv[0]));
+	fprintf(is_error ? stderr : stdout,
+		"\n" \
+		"Stand-in for usbmuxd to test and benchmark libusbmuxd and the tools without\n" \
+		"devices. It speaks the binary and the plist protocol and simulates devices.\n" \
+		"Connections to device port 7 echo, to port 9 discard and to port 19 generate\n" \
+		"data; connections to other ports are forwarded to the same port on TARGET.\n" \
+		"\n" \
+		"OPTIONS:\n" \
+		"  -s, --socket ADDR   listen on ADDR, UNIX:/path or HOST:PORT, default is the\n" \
+		"                      value of USBMUXD_SOCKET_ADDRESS\n" \
+		"  -n, --devices N     start with N attached devices with ids 1 to N\n" \
+		"  -e, --script FILE   attach and detach devices as described in FILE, with the\n" \
+		"                      commands attach ID [UDID] [usb|network], detach ID,\n" \
+		"                      pair ID, sleep MS and repeat\n" \
+		"  -b, --binary        act like an old usbmuxd that only speaks the binary protocol\n" \
+		"  -t, --target HOST   forward device connections to HOST (default 127.0.0.1)\n" \
+		"  -o, --port-offset N  add N to the device port when forwarding\n" \
+		"  -P, --pair-record-size BYTES  answer reads of unknown pair records with a\n" \
+		"                      record of BYTES bytes instead of an error\n" \
+		"  -B, --buid BUID     system BUID to report\n" \
+		"  -l, --latency MS    delay every reply by MS milliseconds\n" \
+		"  -j, --jitter MS     add up to MS random milliseconds to the delay\n" \
+		"  -c, --connect-latency MS  additional delay for Connect requests\n" \
+		"  -F, --fault-rate PCT  inject a fault into PCT percent of the replies\n" \
+		"  -m, --fault-modes LIST  comma separated faults to inject: close, error,\n" \
+		"                      truncate and stall (default close,error,truncate)\n" \
+		"  -R, --replay FILE   play back a capture recorded with LIBUSBMUXD_CAPTURE or\n" \
+		"                      libusbmuxd_set_capture_file() instead of simulating\n" \
+		"                      devices\n" \
+		"  -x, --fast          replay without the recorded delays\n" \
+		"  -d, --debug         increase debug level\n" \
+		"  -h, --help          prints usage information\n" \
+		"\n"
+	);
+}
+
+int main(int argc, char **argv)
+{
+	const char *addr = getenv("USBMUXD_SOCKET_ADDRESS");
+	const char *script = NULL;
+	const char *replay = NULL;
+	unsigned int num_devices = 0;
+	int listen_fd;
+	int c;
+
+	const struct option longopts[] = {
+		{ "socket", required_argument, NULL, 's' },
+		{ "devices", required_argument, NULL, 'n' },
+		{ "script", required_argument, NULL, 'e' },
+		{ "binary", no_argument, NULL, 'b' },
+		{ "target", required_argument, NULL, 't' },
+		{ "port-offset", required_argument, NULL, 'o' },
+		{ "pair-record-size", required_argument, NULL, 'P' },
+		{ "buid", required_argument, NULL, 'B' },
+		{ "latency", required_argument, NULL, 'l' },
+		{ "jitter", required_argument, NULL, 'j' },
+		{ "connect-latency", required_argument, NULL, 'c' },
+		{ "fault-rate", required_argument, NULL, 'F' },
+		{ "fault-modes", required_argument, NULL, 'm' },
+		{ "replay", required_argument, NULL, 'R' },
+		{ "fast", no_argument, NULL, 'x' },
+		{ "debug", no_argument, NULL, 'd' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, "s:n:e:bt:o:P:B:l:j:c:F:m:R:xdh", longopts, NULL)) != -1) {
+		switch (c) {
+		case 's':
+			addr = optarg;
+			break;
+		case 'n':
+			num_devices = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'e':
+			script = optarg;
+			break;
+		case 'b':
+			binary_only = 1;
+			break;
+		case 't':
+			target_host = optarg;
+			break;
+		case 'o':
+			port_offset = atoi(optarg);
+			break;
+		case 'P':
+			synthetic_record_size = strtoull(optarg, NULL, 10);
+			break;
+		case 'B':
+			buid = optarg;
+			break;
+		case 'l':
+			latency_ms = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'j':
+			jitter_ms = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			connect_latency_ms = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'F':
+			fault_rate = (unsigned int)strtoul(optarg, NULL, 10);
+			if (fault_rate > 100) {
+				fprintf(stderr, "ERROR: fault rate must be between 0 and 100\n");
+				return 2;
+			}
+			break;
+		case 'm': {
+			int modes = parse_fault_modes(optarg);
+			if (modes <= 0) {
+				fprintf(stderr, "ERROR: Invalid fault modes '%s'\n", optarg);
+				return 2;
+			}
+			fault_modes = (unsigned int)modes;
+			break;
+		}
+		case 'R':
+			replay = optarg;
+			break;
+		case 'x':
+			replay_fast = 1;
+			break;
+		case 'd':
+			debug_level++;
+			break;
+		case 'h':
+			print_usage(argc, argv, 0);
+			return 0;
+		default:
+			print_usage(argc, argv, 1);
+			return 2;
+		}
+	}
+
+	if (!addr) {
+		fprintf(stderr, "ERROR: No socket address given, use --socket or set USBMUXD_SOCKET_ADDRESS\n");
+		print_usage(argc, argv, 1);
+		return 2;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	mutex_init(&state_mutex);
+	collection_init(&devices);
+	collection_init(&clients);
+	collection_init(&pair_records);
+	random_state = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+
+	if (replay && replay_load(replay) < 0) {
+		return 1;
+	}
+
+	listen_fd = create_listen_socket(addr);
+	if (listen_fd < 0) {
+		fprintf(stderr, "ERROR: Could not listen on %s: %s\n", addr, strerror(errno));
+		return 1;
+	}
+
+	for (c = 1; c <= (int)num_devices && !replay; c++) {
+		device_attach((uint32_t)c, NULL, 0);
+	}
+	if (script && !replay) {
+		THREAD_T th = THREAD_T_NULL;
+		if (thread_new(&th, script_thread, (void*)script) != 0) {
+			fprintf(stderr, "ERROR: Could not start script thread\n");
+			return 1;
+		}
+		thread_detach(th);
+	}
+	debug(1, "listening on %s\n", addr);
+
+	while (1) {
+		struct mock_client *client;
+		THREAD_T th = THREAD_T_NULL;
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			fprintf(stderr, "ERROR: accept failed: %s\n", strerror(errno));
+			break;
+		}
+		client = (struct mock_client*)calloc(1, sizeof(struct mock_client));
+		if (!client) {
+			socket_close(fd);
+			continue;
+		}
+		client->fd = fd;
+		mutex_init(&client->send_mutex);
+		mutex_lock(&state_mutex);
+		collection_add(&clients, client);
+		mutex_unlock(&state_mutex);
+		if (thread_new(&th, (replay) ? replay_thread : client_thread, client) != 0) {
+			mutex_lock(&state_mutex);
+			collection_remove(&clients, client);
+			mutex_unlock(&state_mutex);
+			socket_close(fd);
+			mutex_destroy(&client->send_mutex);
+			free(client);
+			continue;
+		}
+		thread_detach(th);
+	}
+	socket_close(listen_fd);
+
+	return 1;
+}